@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Mock OpenRouter chat completions endpoint for benchmarking mod-ollama-chat.
+
+Answers every POST like the OpenRouter API would, after a configurable delay,
+and fails a configurable share of the requests with HTTP 429 or 5xx. Streamed
+requests get an SSE reply ending with a usage event.
+
+Usage:
+    python3 apps/bench/mock_llm_server.py --port 8089 --latency-ms 400 --jitter-ms 200 --failure-rate 0.02
+
+Then point the worldserver at it and run the benchmark as an administrator:
+    OllamaChat.OpenRouterUrl = "http://127.0.0.1:8089/api/v1/chat/completions"
+    .ollama bench 500
+
+For allocation counts, run the worldserver under a heap profiler such as
+heaptrack while the benchmark runs.
+"""
+
+import argparse
+import http.server
+import json
+import random
+import time
+
+REPLY = "Well met, traveler. The trainers in the capital know their trade, ask there."
+
+
+class MockHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    args = None
+
+    def log_message(self, *unused):
+        pass
+
+    def send_json(self, status, payload):
+        body = json.dumps(payload).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        if status == 429:
+            self.send_header("Retry-After", "1")
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_event(self, payload):
+        data = ("data: " + (payload if isinstance(payload, str) else json.dumps(payload)) + "\n\n").encode()
+        self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+        self.wfile.flush()
+
+    def do_POST(self):
+        request = json.loads(self.rfile.read(int(self.headers.get("Content-Length", 0))) or b"{}")
+        args = MockHandler.args
+        time.sleep(max(0.0, args.latency_ms + random.uniform(-args.jitter_ms, args.jitter_ms)) / 1000.0)
+
+        if random.random() < args.failure_rate:
+            status = random.choice((429, 500, 502, 503))
+            self.send_json(status, {"error": {"code": status, "message": "mock failure"}})
+            return
+
+        prompt = "".join(
+            m["content"] if isinstance(m["content"], str) else "".join(p.get("text", "") for p in m["content"])
+            for m in request.get("messages", []))
+        usage = {"prompt_tokens": max(1, len(prompt) // 4), "completion_tokens": len(REPLY) // 4}
+        if not request.get("stream"):
+            self.send_json(200, {"choices": [{"message": {"role": "assistant", "content": REPLY}}], "usage": usage})
+            return
+
+        self.send_response(200)
+        self.send_header("Content-Type", "text/event-stream")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+        for word in REPLY.split(" "):
+            self.send_event({"choices": [{"delta": {"content": word + " "}}]})
+            time.sleep(args.token_ms / 1000.0)
+        self.send_event({"choices": [], "usage": usage})
+        self.send_event("[DONE]")
+        self.wfile.write(b"0\r\n\r\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8089)
+    parser.add_argument("--latency-ms", type=float, default=400.0, help="delay before the reply starts")
+    parser.add_argument("--jitter-ms", type=float, default=0.0, help="random +/- added to the delay")
+    parser.add_argument("--token-ms", type=float, default=10.0, help="delay between streamed words")
+    parser.add_argument("--failure-rate", type=float, default=0.0, help="share of requests answered with 429/5xx")
+    MockHandler.args = parser.parse_args()
+
+    server = http.server.ThreadingHTTPServer((MockHandler.args.host, MockHandler.args.port), MockHandler)
+    print("Mock LLM server on http://{}:{}/".format(MockHandler.args.host, MockHandler.args.port))
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,14 @@
+-- Lets the per-pair history trim and load read one bot/player pair without a full table scan.
+SET @index_exists := (
+    SELECT COUNT(*) FROM information_schema.statistics
+    WHERE table_schema = DATABASE()
+      AND table_name = 'mod_ollama_chat_history'
+      AND index_name = 'idx_pair_timestamp'
+);
+SET @create_index := IF(@index_exists = 0,
+    'ALTER TABLE mod_ollama_chat_history ADD INDEX idx_pair_timestamp (bot_guid, player_guid, timestamp)',
+    'DO 0'
+);
+PREPARE stmt FROM @create_index;
+EXECUTE stmt;
+DEALLOCATE PREPARE stmt;
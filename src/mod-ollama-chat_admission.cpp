@@ -0,0 +1,113 @@
+#include "mod-ollama-chat_admission.h"
+#include <algorithm>
+#include <cmath>
+
+ChatAdmissionControl g_ChatAdmission;
+
+// How often buckets that refilled completely are forgotten.
+static constexpr std::chrono::seconds ADMISSION_PRUNE_INTERVAL(60);
+
+static double BucketCapacity(const AdmissionLimit& limit)
+{
+    return std::max<uint32_t>(limit.burst, 1);
+}
+
+void ChatAdmissionControl::configure(const AdmissionLimit& player, const AdmissionLimit& scope, const AdmissionLimit& global)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    playerLimit = player;
+    scopeLimit = scope;
+    globalLimit = global;
+    // Start over at full buckets.
+    playerBuckets.clear();
+    scopeBuckets.clear();
+    globalBucket = TokenBucket();
+}
+
+// A bucket seen for the first time starts full.
+void ChatAdmissionControl::refill(TokenBucket& bucket, const AdmissionLimit& limit, Clock::time_point now)
+{
+    if (bucket.updated == Clock::time_point())
+        bucket.tokens = BucketCapacity(limit);
+    else
+    {
+        double minutes = std::chrono::duration<double, std::ratio<60>>(now - bucket.updated).count();
+        bucket.tokens = std::min(bucket.tokens + minutes * limit.perMinute, BucketCapacity(limit));
+    }
+    bucket.updated = now;
+}
+
+void ChatAdmissionControl::take(TokenBucket& bucket, const AdmissionLimit& limit, uint32_t count, Clock::time_point now)
+{
+    refill(bucket, limit, now);
+    bucket.tokens = std::max(bucket.tokens - count, 0.0);
+}
+
+// A full bucket is the same as none; drop them so the maps stay small.
+void ChatAdmissionControl::pruneFullBuckets(Clock::time_point now)
+{
+    if (now - lastPrune < ADMISSION_PRUNE_INTERVAL)
+        return;
+    lastPrune = now;
+
+    auto prune = [now](std::unordered_map<uint64_t, TokenBucket>& buckets, const AdmissionLimit& limit) {
+        for (auto it = buckets.begin(); it != buckets.end();)
+        {
+            refill(it->second, limit, now);
+            if (limit.perMinute == 0 || it->second.tokens >= BucketCapacity(limit))
+                it = buckets.erase(it);
+            else
+                ++it;
+        }
+    };
+    prune(playerBuckets, playerLimit);
+    prune(scopeBuckets, scopeLimit);
+}
+
+uint32_t ChatAdmissionControl::available(uint64_t senderGuid, uint64_t scopeKey)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point now = Clock::now();
+    pruneFullBuckets(now);
+
+    double tokens = UINT32_MAX;
+    if (playerLimit.perMinute > 0)
+    {
+        TokenBucket& bucket = playerBuckets[senderGuid];
+        refill(bucket, playerLimit, now);
+        tokens = std::min(tokens, bucket.tokens);
+    }
+    if (scopeLimit.perMinute > 0)
+    {
+        TokenBucket& bucket = scopeBuckets[scopeKey];
+        refill(bucket, scopeLimit, now);
+        tokens = std::min(tokens, bucket.tokens);
+    }
+    if (globalLimit.perMinute > 0)
+    {
+        refill(globalBucket, globalLimit, now);
+        tokens = std::min(tokens, globalBucket.tokens);
+    }
+
+    uint32_t replies = static_cast<uint32_t>(std::floor(tokens));
+    if (replies == 0)
+        ++throttledMessages;
+    return replies;
+}
+
+void ChatAdmissionControl::consume(uint64_t senderGuid, uint64_t scopeKey, uint32_t granted, uint32_t wanted)
+{
+    if (wanted > granted)
+        throttledReplies += wanted - granted;
+    if (granted == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point now = Clock::now();
+    if (playerLimit.perMinute > 0)
+        take(playerBuckets[senderGuid], playerLimit, granted, now);
+    if (scopeLimit.perMinute > 0)
+        take(scopeBuckets[scopeKey], scopeLimit, granted, now);
+    if (globalLimit.perMinute > 0)
+        take(globalBucket, globalLimit, granted, now);
+}
@@ -0,0 +1,59 @@
+#ifndef MOD_OLLAMA_CHAT_ADMISSION_H
+#define MOD_OLLAMA_CHAT_ADMISSION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// Sustained rate and burst of one token bucket; a rate of 0 means no limit.
+struct AdmissionLimit {
+    uint32_t perMinute = 0;
+    uint32_t burst = 0;
+};
+
+// Token buckets metering the bot replies chat messages may cause: per
+// sender, per zone or channel, and for the whole server. A reply costs one
+// token of each; buckets refill continuously up to their burst. Checked
+// before any listener is gathered or prompt built, so a flood costs neither.
+class ChatAdmissionControl {
+public:
+    void configure(const AdmissionLimit& player, const AdmissionLimit& scope, const AdmissionLimit& global);
+
+    // Replies a message of the sender in the scope may cause right now;
+    // 0 means the message gets no reply at all.
+    uint32_t available(uint64_t senderGuid, uint64_t scopeKey);
+    // Charges the granted replies. Any wanted beyond them count as throttled.
+    void consume(uint64_t senderGuid, uint64_t scopeKey, uint32_t granted, uint32_t wanted);
+
+    uint64_t getThrottledMessages() const { return throttledMessages; }
+    uint64_t getThrottledReplies() const { return throttledReplies; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct TokenBucket {
+        double tokens = 0.0;
+        Clock::time_point updated;
+    };
+
+    static void refill(TokenBucket& bucket, const AdmissionLimit& limit, Clock::time_point now);
+    static void take(TokenBucket& bucket, const AdmissionLimit& limit, uint32_t count, Clock::time_point now);
+    void pruneFullBuckets(Clock::time_point now);
+
+    std::mutex mutex_;
+    AdmissionLimit playerLimit;
+    AdmissionLimit scopeLimit;
+    AdmissionLimit globalLimit;
+    std::unordered_map<uint64_t, TokenBucket> playerBuckets;
+    std::unordered_map<uint64_t, TokenBucket> scopeBuckets;
+    TokenBucket globalBucket;
+    Clock::time_point lastPrune;
+    std::atomic<uint64_t> throttledMessages{0};
+    std::atomic<uint64_t> throttledReplies{0};
+};
+
+extern ChatAdmissionControl g_ChatAdmission;
+
+#endif // MOD_OLLAMA_CHAT_ADMISSION_H
@@ -1,14 +1,114 @@
 #include "mod-ollama-chat_api.h"
+#include "mod-ollama-chat_completion.h"
 #include "mod-ollama-chat_config.h"
+#include "mod-ollama-chat_httpmulti.h"
+#include "mod-ollama-chat_metrics.h"
+#include "mod-ollama-chat_router.h"
 #include "Log.h"
 #include <curl/curl.h>
 #include <sstream>
 #include <nlohmann/json.hpp>
 #include <fmt/core.h>
-#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
 #include <mutex>
-#include <queue>
-#include <future>
+#include <vector>
+
+// Share object for the DNS and TLS session caches of all workers. Connections
+// are not shared: libcurl does not support using one connection cache from
+// concurrent threads, so each worker's handle keeps its own.
+static CURLSH* g_CurlShare = nullptr;
+static std::mutex g_CurlShareLocks[CURL_LOCK_DATA_LAST];
+
+static void StopOllamaAsyncClient();
+
+static void CurlShareLock(CURL* /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void* /*userptr*/)
+{
+    g_CurlShareLocks[data].lock();
+}
+
+static void CurlShareUnlock(CURL* /*handle*/, curl_lock_data data, void* /*userptr*/)
+{
+    g_CurlShareLocks[data].unlock();
+}
+
+// Each worker thread keeps one easy handle for its whole lifetime,
+// so keep-alive connections survive between requests.
+struct WorkerCurlHandle
+{
+    CURL* handle = nullptr;
+    ~WorkerCurlHandle()
+    {
+        if (handle)
+            curl_easy_cleanup(handle);
+    }
+};
+
+static CURL* AcquireWorkerCurlHandle()
+{
+    thread_local WorkerCurlHandle worker;
+    if (!worker.handle)
+        worker.handle = curl_easy_init();
+    else
+        curl_easy_reset(worker.handle); // Keeps live connections and caches
+    return worker.handle;
+}
+
+void InitOllamaHttpClient()
+{
+    if (g_CurlShare)
+        return;
+
+    g_CurlShare = curl_share_init();
+    if (!g_CurlShare)
+    {
+        LOG_ERROR("server.loading", "[OpenRouter Chat] Failed to create cURL share handle, DNS and TLS sessions will not be shared.");
+        return;
+    }
+    curl_share_setopt(g_CurlShare, CURLSHOPT_LOCKFUNC, CurlShareLock);
+    curl_share_setopt(g_CurlShare, CURLSHOPT_UNLOCKFUNC, CurlShareUnlock);
+    curl_share_setopt(g_CurlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(g_CurlShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+void CleanupOllamaHttpClient()
+{
+    StopOllamaAsyncClient();
+
+    // Worker threads (and their easy handles) must be gone by now.
+    if (g_CurlShare)
+    {
+        curl_share_cleanup(g_CurlShare);
+        g_CurlShare = nullptr;
+    }
+}
+
+static void BuildRequestHeaders(ChatEndpoint& endpoint)
+{
+    // Set up headers with authentication
+    struct curl_slist* headers = nullptr;
+    if (!endpoint.apiKey.empty()) {
+        std::string auth_header = "Authorization: Bearer " + endpoint.apiKey;
+        headers = curl_slist_append(headers, auth_header.c_str());
+    }
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    // Optional headers for better tracking
+    if (endpoint.type == EndpointType::OpenRouter && !g_OpenRouterSiteUrl.empty()) {
+        std::string referer_header = "HTTP-Referer: " + g_OpenRouterSiteUrl;
+        headers = curl_slist_append(headers, referer_header.c_str());
+    }
+    if (endpoint.type == EndpointType::OpenRouter && !g_OpenRouterSiteName.empty()) {
+        std::string title_header = "X-Title: " + g_OpenRouterSiteName;
+        headers = curl_slist_append(headers, title_header.c_str());
+    }
+
+    endpoint.headers = std::shared_ptr<curl_slist>(headers, curl_slist_free_all);
+}
 
 // Callback for cURL write function.
 static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp)
@@ -19,6 +119,298 @@ static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* use
     return totalSize;
 }
 
+// Incremental state of a streamed (SSE) completion.
+struct StreamState
+{
+    QueryChunkCallback onChunk;
+    std::string lineBuffer;   // Incomplete SSE line
+    std::string pending;      // Text not released to chat yet
+    std::string fullText;     // Whole completion, for the final callback
+    std::string rawBody;      // Non-SSE body, e.g. an HTTP error document
+    std::string errorMessage; // Error event sent inside the stream
+    std::shared_ptr<const QueryRuntimeSettings> settings;  // chunk size and limit of this query
+    uint32_t chunksSent = 0;
+    bool cancelled = false;   // We stopped the stream after StreamMaxChunks lines
+};
+
+// Largest prefix of text that fits in maxLen bytes without splitting a UTF-8 sequence.
+static size_t Utf8SafeCut(const std::string& text, size_t maxLen)
+{
+    size_t cut = std::min(maxLen, text.size());
+    while (cut > 0 && cut < text.size() && (static_cast<unsigned char>(text[cut]) & 0xC0) == 0x80)
+        --cut;
+    return cut;
+}
+
+// Returns one past the end of the first (or, with last set, the last) sentence
+// that ends within the first limit bytes of text, or npos.
+static size_t FindSentenceEnd(const std::string& text, size_t limit, bool last)
+{
+    size_t found = std::string::npos;
+    limit = std::min(limit, text.size());
+    for (size_t i = 0; i < limit; ++i)
+    {
+        char c = text[i];
+        size_t end = std::string::npos;
+        if (c == '\n')
+            end = i + 1;
+        else if (c == '.' || c == '!' || c == '?')
+        {
+            end = i + 1;
+            while (end < text.size() && (text[end] == '.' || text[end] == '!' || text[end] == '?'))
+                ++end;
+            i = end - 1;
+            // Only a terminator followed by whitespace ends a sentence ("3.5" does not).
+            if (end >= text.size() || !std::isspace(static_cast<unsigned char>(text[end])) || end > limit)
+                end = std::string::npos;
+        }
+        if (end == std::string::npos)
+            continue;
+        if (!last)
+            return end;
+        found = end;
+    }
+    return found;
+}
+
+// Cuts the next chat line out of the pending text. The first line is released
+// as soon as the first sentence is complete; later lines are filled up to the
+// chat line size. With flush set, whatever is left is released as well.
+static bool TakeStreamChunk(StreamState& state, bool flush, std::string& chunk)
+{
+    std::string& pending = state.pending;
+    size_t maxLen = std::max<uint32_t>(state.settings->streamChunkLength, 16);
+    size_t cut = std::string::npos;
+
+    if (state.chunksSent == 0)
+        cut = FindSentenceEnd(pending, maxLen, false);
+
+    if (cut == std::string::npos && pending.size() > maxLen)
+    {
+        // Break after the last sentence that fits, else at the last space.
+        cut = FindSentenceEnd(pending, maxLen, true);
+        if (cut == std::string::npos)
+        {
+            size_t space = pending.find_last_of(" \t", maxLen);
+            cut = (space != std::string::npos && space > 0) ? space : Utf8SafeCut(pending, maxLen);
+        }
+    }
+
+    if (cut == std::string::npos && flush && !pending.empty())
+        cut = pending.size();
+    if (cut == std::string::npos)
+        return false;
+
+    chunk = pending.substr(0, cut);
+    pending.erase(0, cut);
+
+    size_t first = chunk.find_first_not_of(" \t\r\n");
+    size_t lastChar = chunk.find_last_not_of(" \t\r\n");
+    chunk = (first == std::string::npos) ? std::string() : chunk.substr(first, lastChar - first + 1);
+    return true;
+}
+
+// Releases every complete chat line. Returns false once StreamMaxChunks lines were sent.
+static bool ReleaseStreamChunks(StreamState& state, bool flush)
+{
+    std::string chunk;
+    while (!state.cancelled && TakeStreamChunk(state, flush, chunk))
+    {
+        if (chunk.empty())
+            continue;
+        ++state.chunksSent;
+        if (state.onChunk)
+            state.onChunk(std::move(chunk));
+        uint32_t maxChunks = state.settings->streamMaxChunks;
+        if (maxChunks > 0 && state.chunksSent >= maxChunks)
+        {
+            state.cancelled = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Picks what we need out of a completion, or out of one event of a streamed
+// one, while it is parsed: the text of the first choice, the error message
+// and the token counts. No DOM is built, and the text is moved out of the
+// parser instead of copied.
+class CompletionSaxHandler
+{
+public:
+    std::string content;      // choices[0].message.content, or .delta.content of an event
+    bool hasContent = false;
+    bool hasError = false;
+    std::string errorMessage;
+
+    bool null() { return value(); }
+    bool boolean(bool) { return value(); }
+    bool number_integer(nlohmann::json::number_integer_t) { return value(); }
+    bool number_unsigned(nlohmann::json::number_unsigned_t number)
+    {
+        // The "usage" object with the token counts of the whole completion.
+        if (keyIs(0, "usage"))
+        {
+            if (frames.size() == 2 && keyIs(1, "prompt_tokens"))
+                g_ChatMetrics.promptTokens += number;
+            else if (frames.size() == 2 && keyIs(1, "completion_tokens"))
+                g_ChatMetrics.completionTokens += number;
+            else if (frames.size() == 3 && keyIs(1, "prompt_tokens_details") && keyIs(2, "cached_tokens"))
+                g_ChatMetrics.cachedPromptTokens += number;
+        }
+        return value();
+    }
+    bool number_float(nlohmann::json::number_float_t, const nlohmann::json::string_t&) { return value(); }
+    bool string(nlohmann::json::string_t& text)
+    {
+        if (frames.size() == 4 && keyIs(0, "choices") && frames[1].array && frames[1].elements == 1 &&
+            (keyIs(2, "message") || keyIs(2, "delta")) && keyIs(3, "content"))
+        {
+            content = std::move(text);
+            hasContent = true;
+        }
+        else if (keyIs(0, "error") && (frames.size() == 1 || (frames.size() == 2 && keyIs(1, "message"))))
+            errorMessage = std::move(text);
+        return value();
+    }
+    bool binary(nlohmann::json::binary_t&) { return value(); }
+    bool start_object(std::size_t)
+    {
+        value();
+        frames.push_back({ false, 0, std::string() });
+        return true;
+    }
+    bool key(nlohmann::json::string_t& name)
+    {
+        frames.back().key = name;
+        if (frames.size() == 1 && name == "error")
+            hasError = true;
+        return true;
+    }
+    bool end_object()
+    {
+        frames.pop_back();
+        return true;
+    }
+    bool start_array(std::size_t)
+    {
+        value();
+        frames.push_back({ true, 0, std::string() });
+        return true;
+    }
+    bool end_array()
+    {
+        frames.pop_back();
+        return true;
+    }
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) { return false; }
+
+private:
+    // One open object (with its current key) or array (with the number of
+    // elements seen so far) on the way from the root to the current value.
+    struct Frame {
+        bool array;
+        size_t elements;
+        std::string key;
+    };
+
+    bool value()
+    {
+        if (!frames.empty() && frames.back().array)
+            ++frames.back().elements;
+        return true;
+    }
+
+    bool keyIs(size_t depth, const char* name) const
+    {
+        return depth < frames.size() && !frames[depth].array && frames[depth].key == name;
+    }
+
+    std::vector<Frame> frames;
+};
+
+// Tells the query manager why the transfer failed, so it can back off and retry.
+static void MarkQueryFailed(QueryControl* control, QueryErrorType type)
+{
+    if (!control)
+        return;
+    control->failed = true;
+    control->failure = type;
+}
+
+static void RecordQueryFailure(QueryControl* control, QueryErrorType type)
+{
+    g_ChatMetrics.recordError(type);
+    MarkQueryFailed(control, type);
+}
+
+// Handles one "data:" payload of the OpenRouter event stream.
+static void HandleStreamEvent(StreamState& state, const char* payload, size_t length)
+{
+    if (length == 6 && std::memcmp(payload, "[DONE]", 6) == 0)
+        return;
+
+    CompletionSaxHandler event;
+    if (!nlohmann::json::sax_parse(payload, payload + length, &event))
+        return;
+
+    if (event.hasError)
+    {
+        state.errorMessage = event.errorMessage.empty() ? "API Error" : std::move(event.errorMessage);
+        return;
+    }
+
+    if (event.hasContent)
+    {
+        state.pending += event.content;
+        state.fullText += event.content;
+    }
+}
+
+// Callback for cURL write function when the completion is streamed.
+static size_t StreamWriteCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    StreamState* state = static_cast<StreamState*>(userp);
+    size_t totalSize = size * nmemb;
+    state->lineBuffer.append(static_cast<char*>(contents), totalSize);
+
+    // Lines are handled where they lie in the buffer, and the consumed ones
+    // dropped at once when the chunk is done.
+    const std::string& buffer = state->lineBuffer;
+    size_t lineStart = 0;
+    size_t lineEnd;
+    while ((lineEnd = buffer.find('\n', lineStart)) != std::string::npos)
+    {
+        const char* line = buffer.data() + lineStart;
+        size_t length = lineEnd - lineStart;
+        lineStart = lineEnd + 1;
+        if (length > 0 && line[length - 1] == '\r')
+            --length;
+
+        // Blank lines separate events and ':' lines are keep-alive comments.
+        if (length == 0 || line[0] == ':')
+            continue;
+        if (length >= 5 && std::memcmp(line, "data:", 5) == 0)
+        {
+            size_t start = 5;
+            while (start < length && line[start] == ' ')
+                ++start;
+            HandleStreamEvent(*state, line + start, length - start);
+        }
+        else
+        {
+            state->rawBody.append(line, length);
+            state->rawBody += '\n';
+        }
+    }
+    state->lineBuffer.erase(0, lineStart);
+
+    // Returning less than totalSize aborts the transfer once we have enough lines.
+    if (!ReleaseStreamChunks(*state, false))
+        return 0;
+    return totalSize;
+}
+
 // Function to handle OpenRouter.ai API errors based on HTTP status codes
 void HandleOpenRouterErrors(long response_code, const std::string& response_body)
 {
@@ -38,27 +430,20 @@ void HandleOpenRouterErrors(long response_code, const std::string& response_body
     }
 }
 
-// Function to construct OpenRouter.ai request format
-nlohmann::json ConstructOpenRouterRequest(const std::string& prompt)
+// Models that only cache a prompt prefix marked with cache_control. Others
+// (OpenAI, DeepSeek, ...) cache a repeated prefix by themselves.
+static bool ModelTakesCacheControl(const std::string& model)
+{
+    return model.rfind("anthropic/", 0) == 0 || model.rfind("google/gemini", 0) == 0;
+}
+
+// The request parameters other than the messages, in OpenRouter.ai format.
+static nlohmann::json ConstructRequestParameters(const ChatEndpoint& endpoint, bool stream)
 {
     nlohmann::json request;
-    request["model"] = g_OpenRouterModel;
+    request["model"] = endpoint.model;
     request["messages"] = nlohmann::json::array();
-    
-    // Add system message if system prompt is configured
-    if (!g_OpenRouterSystemPrompt.empty()) {
-        request["messages"].push_back({
-            {"role", "system"},
-            {"content", g_OpenRouterSystemPrompt}
-        });
-    }
-    
-    // Add user message
-    request["messages"].push_back({
-        {"role", "user"},
-        {"content", prompt}
-    });
-    
+
     // Add optional parameters only if they differ from defaults
     if (g_OpenRouterTemperature != 0.7f) {
         request["temperature"] = g_OpenRouterTemperature;
@@ -82,115 +467,382 @@ nlohmann::json ConstructOpenRouterRequest(const std::string& prompt)
             }
         }
     }
-    
-    // Always set stream to false for this implementation
-    request["stream"] = false;
-    
+
+    request["stream"] = stream;
+    // Token counts for the metrics, at the end of the reply or the stream.
+    // Other OpenAI-compatible servers always report them in a whole reply.
+    if (endpoint.type == EndpointType::OpenRouter) {
+        request["usage"] = {{"include", true}};
+    } else if (stream) {
+        request["stream_options"] = {{"include_usage", true}};
+    }
+
     return request;
 }
 
-// Function to parse OpenRouter.ai response format
-std::string ParseOpenRouterResponse(const std::string& response_json)
+// Appends text as the inside of a JSON string, escaped the way a dump with
+// error_handler_t::replace escapes it: bytes that are not valid UTF-8 become
+// U+FFFD instead of failing the request.
+static void AppendJsonString(std::string& out, const std::string& text)
 {
-    try {
-        nlohmann::json response = nlohmann::json::parse(response_json);
-        
-        // Check for error in response
-        if (response.contains("error")) {
-            std::string error_msg = "API Error";
-            if (response["error"].contains("message")) {
-                error_msg = response["error"]["message"].get<std::string>();
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text.data());
+    const unsigned char* end = p + text.size();
+    while (p < end)
+    {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+            ++p;
+        } else if (c < 0x20) {
+            switch (c) {
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+            }
+            ++p;
+        } else if (c < 0x80) {
+            out += static_cast<char>(c);
+            ++p;
+        } else {
+            // Length of the sequence, and the range its second byte must lie
+            // in to rule out overlong forms, surrogates and code points past U+10FFFF.
+            size_t length = 0;
+            unsigned char low = 0x80, high = 0xbf;
+            if (c >= 0xc2 && c <= 0xdf)
+                length = 2;
+            else if (c >= 0xe0 && c <= 0xef) {
+                length = 3;
+                if (c == 0xe0) low = 0xa0;
+                if (c == 0xed) high = 0x9f;
+            } else if (c >= 0xf0 && c <= 0xf4) {
+                length = 4;
+                if (c == 0xf0) low = 0x90;
+                if (c == 0xf4) high = 0x8f;
             }
-            throw std::runtime_error("OpenRouter API Error: " + error_msg);
-        }
-        
-        // Extract content from choices array
-        if (response.contains("choices") && !response["choices"].empty()) {
-            auto& choice = response["choices"][0];
-            if (choice.contains("message") && choice["message"].contains("content")) {
-                return choice["message"]["content"].get<std::string>();
+            size_t valid = length && p + 1 < end && p[1] >= low && p[1] <= high ? 2 : 0;
+            while (valid && valid < length && p + valid < end && (p[valid] & 0xc0) == 0x80)
+                ++valid;
+            if (valid && valid == length) {
+                out.append(reinterpret_cast<const char*>(p), length);
+                p += length;
+            } else {
+                out += "\xef\xbf\xbd";
+                p += std::max<size_t>(valid, 1);
             }
         }
-        
-        throw std::runtime_error("Invalid response format: missing choices or content");
-        
-    } catch (const nlohmann::json::parse_error& e) {
-        throw std::runtime_error("Failed to parse JSON response: " + std::string(e.what()));
     }
 }
 
-// Updated function to perform the OpenRouter.ai API call
-std::string QueryOllamaAPI(const std::string& prompt)
+void PrepareEndpointRequests(ChatEndpoint& endpoint)
 {
-    // Check if API key is configured
-    if (g_OpenRouterApiKey.empty()) {
-        if (g_DebugEnabled) {
-            LOG_INFO("server.loading", "OpenRouter API key not configured.");
-        }
-        return "AI service not properly configured.";
+    BuildRequestHeaders(endpoint);
+
+    // The parameters are the same for every query of the endpoint, so they
+    // are serialized once here; a query only writes its messages between the
+    // two halves. Keys come out sorted, as a dump of the whole request would.
+    static const std::string messagesKey = "\"messages\":[";
+    for (int stream = 0; stream < 2; ++stream)
+    {
+        std::string request = ConstructRequestParameters(endpoint, stream != 0).dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+        size_t split = request.find(messagesKey) + messagesKey.size();
+        endpoint.requestHead[stream] = request.substr(0, split);
+        endpoint.requestTail[stream] = request.substr(split);
     }
-    
-    CURL* curl = curl_easy_init();
-    if (!curl) {
+
+    endpoint.systemPrompt.clear();
+    AppendJsonString(endpoint.systemPrompt, g_OpenRouterSystemPrompt);
+    endpoint.cacheControl = g_OpenRouterCacheControl && endpoint.type == EndpointType::OpenRouter && ModelTakesCacheControl(endpoint.model);
+}
+
+// Writes the request for a prompt into body, reusing its capacity.
+static void BuildRequestBody(const ChatEndpoint& endpoint, const std::string& prompt, const std::string& systemPrompt, bool stream,
+                             std::string& body)
+{
+    const std::string& head = endpoint.requestHead[stream];
+    const std::string& tail = endpoint.requestTail[stream];
+    body.clear();
+    // Room for the messages with a little escaping.
+    body.reserve(head.size() + tail.size() + endpoint.systemPrompt.size() + (prompt.size() + systemPrompt.size()) * 9 / 8 + 160);
+    body += head;
+
+    // The static text goes first, as one system message, so that requests of
+    // the same personality start with the same prefix and the provider can
+    // reuse its cached computation of it. Keys are in sorted order, like the
+    // parameters around them.
+    if (!endpoint.systemPrompt.empty() || !systemPrompt.empty()) {
+        body += endpoint.cacheControl ? "{\"content\":[{\"cache_control\":{\"type\":\"ephemeral\"},\"text\":\""
+                                      : "{\"content\":\"";
+        body += endpoint.systemPrompt;
+        if (!endpoint.systemPrompt.empty() && !systemPrompt.empty())
+            body += "\\n\\n";
+        AppendJsonString(body, systemPrompt);
+        body += endpoint.cacheControl ? "\",\"type\":\"text\"}],\"role\":\"system\"}," : "\",\"role\":\"system\"},";
+    }
+
+    // Add user message
+    body += "{\"content\":\"";
+    AppendJsonString(body, prompt);
+    body += "\",\"role\":\"user\"}";
+    body += tail;
+}
+
+// Function to parse OpenRouter.ai response format
+std::string ParseOpenRouterResponse(const std::string& response_json)
+{
+    CompletionSaxHandler response;
+    if (!nlohmann::json::sax_parse(response_json, &response)) {
+        g_ChatMetrics.recordError(QueryErrorType::BadResponse);
+        throw std::runtime_error("Failed to parse JSON response");
+    }
+
+    // Check for error in response
+    if (response.hasError) {
+        std::string error_msg = response.errorMessage.empty() ? "API Error" : response.errorMessage;
+        g_ChatMetrics.recordError(QueryErrorType::ApiError);
+        throw std::runtime_error("OpenRouter API Error: " + error_msg);
+    }
+
+    if (response.hasContent) {
+        return std::move(response.content);
+    }
+
+    g_ChatMetrics.recordError(QueryErrorType::BadResponse);
+    throw std::runtime_error("Invalid response format: missing choices or content");
+}
+
+// In-character replies said in place of a failed query.
+static const char* const QUERY_ERROR_REPLIES[] = {
+    "AI service not properly configured.",
+    "Error preparing request.",
+    "Failed to reach OpenRouter AI.",
+    "AI service error occurred.",
+    "Error processing response.",
+    "I'm having trouble understanding.",
+    "Hmm... I'm lost in thought.",
+};
+
+bool IsQueryErrorReply(const std::string& reply)
+{
+    for (const char* errorReply : QUERY_ERROR_REPLIES)
+    {
+        if (reply == errorReply)
+            return true;
+    }
+    return false;
+}
+
+// Builds the JSON body for a prompt. Returns an in-character error reply on failure.
+static bool PrepareRequestBody(const ChatEndpoint& endpoint, const std::string& prompt, const std::string& systemPrompt, bool stream,
+                               std::string& body, std::string& errorReply, QueryControl* control)
+{
+    // Check if API key is configured; local servers usually take none.
+    if (endpoint.type == EndpointType::OpenRouter && endpoint.apiKey.empty()) {
         if (g_DebugEnabled) {
-            LOG_INFO("server.loading", "Failed to initialize cURL.");
+            LOG_INFO("server.loading", "OpenRouter API key not configured.");
         }
-        return "Hmm... I'm lost in thought.";
+        RecordQueryFailure(control, QueryErrorType::Local);
+        errorReply = "AI service not properly configured.";
+        return false;
     }
 
-    std::string url = g_OpenRouterUrl;
-    
     // Construct request in OpenRouter.ai format
-    nlohmann::json requestData;
-    try {
-        requestData = ConstructOpenRouterRequest(prompt);
-    } catch (const std::exception& e) {
+    if (endpoint.requestHead[stream].empty()) {
         if (g_DebugEnabled) {
-            LOG_INFO("server.loading", "Failed to construct request: {}", e.what());
+            LOG_INFO("server.loading", "No request template for endpoint {}.", endpoint.name);
         }
-        curl_easy_cleanup(curl);
-        return "Error preparing request.";
+        RecordQueryFailure(control, QueryErrorType::Local);
+        errorReply = "Error preparing request.";
+        return false;
     }
-    
-    std::string requestDataStr = requestData.dump();
+    BuildRequestBody(endpoint, prompt, systemPrompt, stream, body);
+    return true;
+}
 
-    // Set up headers with authentication
-    struct curl_slist* headers = nullptr;
-    std::string auth_header = "Authorization: Bearer " + g_OpenRouterApiKey;
-    headers = curl_slist_append(headers, auth_header.c_str());
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    
-    // Optional headers for better tracking
-    if (!g_OpenRouterSiteUrl.empty()) {
-        std::string referer_header = "HTTP-Referer: " + g_OpenRouterSiteUrl;
-        headers = curl_slist_append(headers, referer_header.c_str());
+// Aborts the transfer once its query was cancelled or missed its deadline.
+static int TransferProgressCallback(void* clientp, curl_off_t /*dltotal*/, curl_off_t /*dlnow*/, curl_off_t /*ultotal*/, curl_off_t /*ulnow*/)
+{
+    const QueryControl* control = static_cast<const QueryControl*>(clientp);
+    return control->shouldAbort() ? 1 : 0;
+}
+
+// Picks the Retry-After header out of the response, in seconds or as an HTTP date.
+static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userp)
+{
+    size_t length = size * nitems;
+    static const char name[] = "retry-after:";
+    constexpr size_t nameLength = sizeof(name) - 1;
+    if (length <= nameLength)
+        return length;
+    for (size_t i = 0; i < nameLength; ++i)
+    {
+        if (std::tolower(static_cast<unsigned char>(buffer[i])) != name[i])
+            return length;
     }
-    if (!g_OpenRouterSiteName.empty()) {
-        std::string title_header = "X-Title: " + g_OpenRouterSiteName;
-        headers = curl_slist_append(headers, title_header.c_str());
+
+    std::string value(buffer + nameLength, length - nameLength);
+    size_t first = value.find_first_not_of(" \t");
+    size_t last = value.find_last_not_of(" \t\r\n");
+    if (first == std::string::npos)
+        return length;
+    value = value.substr(first, last - first + 1);
+
+    QueryControl* control = static_cast<QueryControl*>(userp);
+    if (std::all_of(value.begin(), value.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }))
+        control->retryAfter = static_cast<uint32_t>(std::min<unsigned long>(std::strtoul(value.c_str(), nullptr, 10), UINT32_MAX));
+    else
+    {
+        time_t when = curl_getdate(value.c_str(), nullptr);
+        time_t now = time(nullptr);
+        if (when > now)
+            control->retryAfter = static_cast<uint32_t>(when - now);
     }
+    return length;
+}
 
-    std::string responseBuffer;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+// Applies the options shared by the blocking and the curl_multi transfers.
+// A stream state switches the transfer to incremental SSE parsing.
+static void SetupTransfer(CURL* curl, const ChatEndpoint& endpoint, const std::string& body, std::string& responseBuffer,
+                          StreamState* stream, QueryControl* control)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, endpoint.url.c_str());
     curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, requestDataStr.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, long(requestDataStr.length()));
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseBuffer);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, long(body.length()));
+    if (stream) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StreamWriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, stream);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseBuffer);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, endpoint.headers.get());
+
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
     // Set timeout to prevent hanging
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
 
-    CURLcode res = curl_easy_perform(curl);
-    
+    if (control) {
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, TransferProgressCallback);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, control);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, control);
+    }
+}
+
+static std::string FinishTransfer(CURL* curl, CURLcode res, const std::string& responseBuffer, QueryControl* control);
+
+static QueryErrorType ClassifyHttpError(long response_code)
+{
+    if (response_code == 429)
+        return QueryErrorType::RateLimited;
+    if (response_code == 401 || response_code == 402 || response_code == 403)
+        return QueryErrorType::Auth;
+    if (response_code >= 500)
+        return QueryErrorType::ServerError;
+    return QueryErrorType::ClientError;
+}
+
+// Records the phase timings of a transfer that reached the server. Connect
+// and TLS times are only taken for new connections; a reused one has none.
+static void RecordTransferMetrics(CURL* curl)
+{
+    long response_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code == 0)
+        return;
+
+    uint64_t connect = 0, appConnect = 0, firstByte = 0, total = 0;
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    curl_off_t value = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &value) == CURLE_OK) connect = value;
+    if (curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &value) == CURLE_OK) appConnect = value;
+    if (curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &value) == CURLE_OK) firstByte = value;
+    if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &value) == CURLE_OK) total = value;
+#else
+    double seconds = 0.0;
+    if (curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &seconds) == CURLE_OK) connect = uint64_t(seconds * 1e6);
+    if (curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &seconds) == CURLE_OK) appConnect = uint64_t(seconds * 1e6);
+    if (curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &seconds) == CURLE_OK) firstByte = uint64_t(seconds * 1e6);
+    if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &seconds) == CURLE_OK) total = uint64_t(seconds * 1e6);
+#endif
+
+    if (connect > 0)
+    {
+        g_ChatMetrics.connect.record(connect);
+        if (appConnect > connect)
+            g_ChatMetrics.tlsHandshake.record(appConnect - connect);
+    }
+    else
+        ++g_ChatMetrics.reusedConnections;
+    g_ChatMetrics.firstByte.record(firstByte);
+    g_ChatMetrics.total.record(total);
+}
+
+// Streamed variant: the lines said so far went through onChunk; the
+// returned reply (or error reply) is said by the query manager if none were.
+static std::string FinishStreamTransfer(CURL* curl, CURLcode res, StreamState& stream, QueryControl* control)
+{
+    // We aborted the transfer ourselves after StreamMaxChunks lines.
+    if (stream.cancelled && res == CURLE_WRITE_ERROR)
+        res = CURLE_OK;
+
+    long response_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    std::string botReply;
+    if (res == CURLE_OK && response_code < 400 && stream.errorMessage.empty() && !stream.fullText.empty())
+    {
+        ReleaseStreamChunks(stream, true);
+        // A cancelled stream leaves text in pending that was never said.
+        botReply = std::move(stream.fullText);
+        botReply.resize(botReply.size() - stream.pending.size());
+        size_t last = botReply.find_last_not_of(" \t\r\n");
+        botReply.erase(last == std::string::npos ? 0 : last + 1);
+        if (g_DebugEnabled) {
+            LOG_INFO("server.loading", "Streamed bot response in {} line(s): {}", stream.chunksSent, botReply);
+        }
+    }
+    else if (res == CURLE_OK && !stream.errorMessage.empty())
+    {
+        if (g_DebugEnabled) {
+            LOG_INFO("server.loading", "OpenRouter API Error: {}", stream.errorMessage);
+        }
+        RecordQueryFailure(control, QueryErrorType::ApiError);
+        botReply = "AI service error occurred.";
+    }
+    else
+    {
+        // Not an event stream (HTTP error, network failure): use the regular handling.
+        // A body without a final line break is still in the line buffer.
+        if (!stream.lineBuffer.empty())
+        {
+            stream.rawBody += stream.lineBuffer;
+            stream.lineBuffer.clear();
+        }
+        botReply = FinishTransfer(curl, res, stream.rawBody, control);
+    }
+    return botReply;
+}
+
+// Turns a finished transfer into the bot reply (or an in-character error reply).
+static std::string FinishTransfer(CURL* curl, CURLcode res, const std::string& responseBuffer, QueryControl* control)
+{
     // Get HTTP response code
-    long response_code;
+    long response_code = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-    
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
 
     if (res != CURLE_OK) {
         if (g_DebugEnabled) {
@@ -198,10 +850,14 @@ std::string QueryOllamaAPI(const std::string& prompt)
                     "Failed to reach OpenRouter AI. cURL error: {}",
                     curl_easy_strerror(res));
         }
+        RecordQueryFailure(control, res == CURLE_OPERATION_TIMEDOUT ? QueryErrorType::Timeout : QueryErrorType::Network);
         return "Failed to reach OpenRouter AI.";
     }
 
     // Handle HTTP errors
+    if (response_code >= 400) {
+        RecordQueryFailure(control, ClassifyHttpError(response_code));
+    }
     try {
         HandleOpenRouterErrors(response_code, responseBuffer);
     } catch (const std::exception& e) {
@@ -219,6 +875,8 @@ std::string QueryOllamaAPI(const std::string& prompt)
         if (g_DebugEnabled) {
             LOG_INFO("server.loading", "Response parsing error: {}", e.what());
         }
+        // Counted by ParseOpenRouterResponse.
+        MarkQueryFailed(control, QueryErrorType::BadResponse);
         return "Error processing response.";
     }
 
@@ -226,20 +884,213 @@ std::string QueryOllamaAPI(const std::string& prompt)
         if (g_DebugEnabled) {
             LOG_INFO("server.loading", "No valid response extracted.");
         }
+        RecordQueryFailure(control, QueryErrorType::BadResponse);
         return "I'm having trouble understanding.";
     }
 
     if (g_DebugEnabled) {
         LOG_INFO("server.loading", "Parsed bot response: {}", botReply);
     }
-    
+
+    return botReply;
+}
+
+// Updated function to perform the OpenRouter.ai API call
+std::string QueryOllamaAPI(const ChatEndpoint& endpoint, const std::string& prompt, const std::string& systemPrompt,
+                           const QueryChunkCallback& onChunk, const std::shared_ptr<QueryControl>& control)
+{
+    std::shared_ptr<const QueryRuntimeSettings> settings = GetQueryRuntimeSettings();
+    bool stream = settings->enableStreaming && onChunk;
+    // Each worker keeps its buffers from query to query, so a request is
+    // written and its response read without growing a fresh string.
+    thread_local std::string requestBody;
+    thread_local std::string responseBuffer;
+    std::string errorReply;
+    if (!PrepareRequestBody(endpoint, prompt, systemPrompt, stream, requestBody, errorReply, control.get()))
+        return errorReply;
+
+    CURL* curl = AcquireWorkerCurlHandle();
+    if (!curl) {
+        if (g_DebugEnabled) {
+            LOG_INFO("server.loading", "Failed to initialize cURL.");
+        }
+        RecordQueryFailure(control.get(), QueryErrorType::Local);
+        return "Hmm... I'm lost in thought.";
+    }
+
+    responseBuffer.clear();
+    StreamState streamState;
+    streamState.onChunk = onChunk;
+    streamState.settings = std::move(settings);
+    SetupTransfer(curl, endpoint, requestBody, responseBuffer, stream ? &streamState : nullptr, control.get());
+
+    // Reuse TLS sessions and DNS lookups across workers; the handle keeps its own connections
+    if (g_CurlShare) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, g_CurlShare);
+    }
+
+    CURLcode res = curl_easy_perform(curl);
+    std::string botReply;
+    if (res != CURLE_ABORTED_BY_CALLBACK)
+        RecordTransferMetrics(curl);
+    if (res == CURLE_ABORTED_BY_CALLBACK)
+    {
+        // Cancelled or past its deadline: nobody wants the reply any more.
+        if (g_DebugEnabled) {
+            LOG_INFO("server.loading", "Aborted a cancelled or expired query.");
+        }
+    }
+    else if (stream)
+        botReply = FinishStreamTransfer(curl, res, streamState, control.get());
+    else
+        botReply = FinishTransfer(curl, res, responseBuffer, control.get());
+
+    // The handle stays with this worker; drop references to our buffers.
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, nullptr);
+
     return botReply;
 }
 
+// Room reserved for a whole (non-streamed) response, enough for a chat reply
+// and the fields around it.
+static constexpr size_t RESPONSE_BUFFER_RESERVE = 4096;
+
+// State owned by one curl_multi transfer until its completion callback runs.
+struct AsyncTransfer
+{
+    std::string requestBody;
+    std::string responseBuffer;
+    std::shared_ptr<ChatEndpoint> endpoint;   // keeps its headers alive
+    bool stream = false;
+    StreamState streamState;
+    std::shared_ptr<QueryControl> control;
+    QueryResponseCallback done;
+};
+
+static HttpMultiClient g_HttpMultiClient;
+
+// Idle easy handles kept for the curl_multi backend; their connections
+// live in the multi handle's connection cache.
+static std::vector<CURL*> g_IdleAsyncHandles;
+static std::mutex g_IdleAsyncHandlesMutex;
+
+static CURL* AcquireAsyncCurlHandle()
+{
+    {
+        std::lock_guard<std::mutex> lock(g_IdleAsyncHandlesMutex);
+        if (!g_IdleAsyncHandles.empty())
+        {
+            CURL* curl = g_IdleAsyncHandles.back();
+            g_IdleAsyncHandles.pop_back();
+            return curl;
+        }
+    }
+    return curl_easy_init();
+}
+
+static void ReleaseAsyncCurlHandle(CURL* curl)
+{
+    curl_easy_reset(curl);
+    std::lock_guard<std::mutex> lock(g_IdleAsyncHandlesMutex);
+    g_IdleAsyncHandles.push_back(curl);
+}
+
+// Starts the API call on the curl_multi I/O thread. The callback always runs
+// exactly once, either on the I/O thread or right away if the transfer could not start.
+void QueryOllamaAPIAsync(std::shared_ptr<ChatEndpoint> endpoint, const std::string& prompt, const std::string& systemPrompt,
+                         QueryResponseCallback callback, QueryChunkCallback onChunk, std::shared_ptr<QueryControl> control)
+{
+    auto transfer = std::make_shared<AsyncTransfer>();
+    transfer->endpoint = std::move(endpoint);
+    transfer->done = std::move(callback);
+    transfer->control = std::move(control);
+    transfer->streamState.settings = GetQueryRuntimeSettings();
+    transfer->stream = transfer->streamState.settings->enableStreaming && onChunk;
+    transfer->streamState.onChunk = std::move(onChunk);
+    if (!transfer->stream)
+        transfer->responseBuffer.reserve(RESPONSE_BUFFER_RESERVE);
+
+    std::string errorReply;
+    if (!PrepareRequestBody(*transfer->endpoint, prompt, systemPrompt, transfer->stream, transfer->requestBody, errorReply,
+                            transfer->control.get()))
+    {
+        transfer->done(std::move(errorReply));
+        return;
+    }
+
+    CURL* curl = AcquireAsyncCurlHandle();
+    if (!curl || !g_HttpMultiClient.start())
+    {
+        if (curl)
+            ReleaseAsyncCurlHandle(curl);
+        if (g_DebugEnabled) {
+            LOG_INFO("server.loading", "Failed to initialize cURL.");
+        }
+        RecordQueryFailure(transfer->control.get(), QueryErrorType::Local);
+        transfer->done("Hmm... I'm lost in thought.");
+        return;
+    }
+
+    SetupTransfer(curl, *transfer->endpoint, transfer->requestBody, transfer->responseBuffer,
+                  transfer->stream ? &transfer->streamState : nullptr, transfer->control.get());
+
+    bool added = g_HttpMultiClient.addTransfer(curl, [transfer](CURL* easy, CURLcode result)
+    {
+        // Aborted transfers were cancelled, expired or stopped by a shutdown;
+        // there is nobody left to reply to.
+        std::string botReply;
+        if (result != CURLE_ABORTED_BY_CALLBACK)
+        {
+            RecordTransferMetrics(easy);
+            if (transfer->stream)
+                botReply = FinishStreamTransfer(easy, result, transfer->streamState, transfer->control.get());
+            else
+                botReply = FinishTransfer(easy, result, transfer->responseBuffer, transfer->control.get());
+        }
+        ReleaseAsyncCurlHandle(easy);
+        transfer->done(std::move(botReply));
+    });
+
+    if (!added)
+    {
+        ReleaseAsyncCurlHandle(curl);
+        transfer->done(std::string());
+    }
+}
+
+static void StopOllamaAsyncClient()
+{
+    g_HttpMultiClient.stop();
+
+    std::lock_guard<std::mutex> lock(g_IdleAsyncHandlesMutex);
+    for (CURL* curl : g_IdleAsyncHandles)
+        curl_easy_cleanup(curl);
+    g_IdleAsyncHandles.clear();
+}
+
 QueryManager g_queryManager;
 
-// Interface function to submit a query.
-std::future<std::string> SubmitQuery(const std::string& prompt)
+// Interface function to submit a query. Both callbacks are posted to the
+// completion queue, so they run on the world thread in the order the worker
+// produced them.
+bool SubmitQuery(std::string prompt, QueryResponseCallback callback, QueryChunkCallback onChunk, QueryOptions options)
 {
-    return g_queryManager.submitQuery(prompt);
+    // Shared, so posting a reply copies a pointer rather than the callback,
+    // and the text is moved along rather than copied.
+    if (callback)
+    {
+        auto held = std::make_shared<QueryResponseCallback>(std::move(callback));
+        callback = [held](std::string response) {
+            PostToWorldThread([held, response = std::move(response)]() mutable { (*held)(std::move(response)); });
+        };
+    }
+    if (onChunk)
+    {
+        auto held = std::make_shared<QueryChunkCallback>(std::move(onChunk));
+        onChunk = [held](std::string chunk) {
+            PostToWorldThread([held, chunk = std::move(chunk)]() mutable { (*held)(std::move(chunk)); });
+        };
+    }
+    return g_queryManager.submitQuery(std::move(prompt), std::move(callback), std::move(onChunk), std::move(options));
 }
@@ -2,13 +2,24 @@
 #define MOD_OLLAMA_CHAT_API_H
 
 #include <string>
-#include <future>
 #include "mod-ollama-chat_querymanager.h"
 
-std::string QueryOllamaAPI(const std::string& prompt);
 
-// Submits a query to the API.
-std::future<std::string> SubmitQuery(const std::string& prompt);
+// Sets up the cURL share object used by all query workers.
+void InitOllamaHttpClient();
+// Releases the share object; call after the query workers have been joined.
+void CleanupOllamaHttpClient();
+// Builds the request headers and body templates of an endpoint from its
+// settings and the current configuration.
+void PrepareEndpointRequests(ChatEndpoint& endpoint);
+
+// Submits a query to the worker pool; the callback receives the reply on the
+// world thread. Returns false if the query could not be queued.
+bool SubmitQuery(std::string prompt, QueryResponseCallback callback, QueryChunkCallback onChunk = nullptr,
+                 QueryOptions options = {});
+
+// True for the in-character replies used when a query failed (these must not be cached).
+bool IsQueryErrorReply(const std::string& reply);
 
 // Declare the global QueryManager variable.
 extern QueryManager g_queryManager;
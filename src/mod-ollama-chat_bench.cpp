@@ -0,0 +1,290 @@
+#include "mod-ollama-chat_bench.h"
+#include "mod-ollama-chat_api.h"
+#include "mod-ollama-chat_completion.h"
+#include "mod-ollama-chat_config.h"
+#include "mod-ollama-chat_handler.h"
+#include "mod-ollama-chat_history.h"
+#include "mod-ollama-chat_router.h"
+#include "mod-ollama-chat_template.h"
+#include "Chat.h"
+#include "Log.h"
+#include "ObjectAccessor.h"
+#include "Player.h"
+#include "WorldSession.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <vector>
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+using BenchClock = std::chrono::steady_clock;
+
+// Iterations of the prompt rendering and history micro benchmarks.
+static constexpr uint32_t BENCH_RENDER_ITERATIONS = 10000;
+static constexpr uint32_t BENCH_HISTORY_TURNS = 10000;
+static constexpr uint32_t BENCH_HISTORY_PAIRS = 100;
+
+// Queries rendered and submitted per world update.
+static constexpr uint32_t BENCH_QUERIES_PER_UPDATE = 50;
+
+// Unsettled queries allowed per query slot. Enough to keep every slot busy,
+// well short of filling the queue and crowding out real chat.
+static constexpr uint32_t BENCH_QUERIES_PER_SLOT = 4;
+
+// One benchmark in progress. Only touched on the world thread: the query
+// results are delivered through the completion queue.
+struct ChatBenchmarkRun
+{
+    uint64_t requesterGuid = 0;
+    uint32_t queries = 0;
+    uint32_t nextQuery = 0;   // next one to submit
+    uint32_t submitted = 0;
+    uint32_t settled = 0;     // submitted queries that came back or were dropped
+    uint32_t replies = 0;
+    uint32_t errors = 0;
+    uint32_t lost = 0;        // dropped by the query manager without a reply
+    uint32_t rejected = 0;
+    bool finished = false;
+    BenchClock::time_point start;
+    std::vector<uint64_t> latencyMicros;
+    std::vector<std::string> report;    // micro benchmark results, sent with the load results
+};
+
+static std::shared_ptr<ChatBenchmarkRun> g_ChatBenchmark;
+
+// The benchmark must never reach a paid endpoint: only localhost, [::1] and
+// IPv4 loopback literals pass, never a name that merely starts with "127.".
+static bool IsLocalEndpoint(const std::string& url)
+{
+    size_t hostStart = url.find("://");
+    hostStart = hostStart == std::string::npos ? 0 : hostStart + 3;
+    // User info would put the real host after the '@'.
+    if (url.find('@', hostStart) < url.find('/', hostStart))
+        return false;
+    size_t hostEnd = url[hostStart] == '[' ? url.find(']', hostStart) + 1 : url.find_first_of(":/", hostStart);
+    std::string host = url.substr(hostStart, hostEnd == std::string::npos ? std::string::npos : hostEnd - hostStart);
+    if (host == "localhost" || host == "[::1]")
+        return true;
+    in_addr address;
+    return inet_pton(AF_INET, host.c_str(), &address) == 1 && reinterpret_cast<const unsigned char*>(&address)[0] == 127;
+}
+
+static double NanosPer(BenchClock::duration elapsed, uint32_t iterations)
+{
+    return std::chrono::duration<double, std::nano>(elapsed).count() / std::max<uint32_t>(iterations, 1);
+}
+
+// Threads of the whole process, where /proc tells.
+static uint32_t ProcessThreadCount()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.rfind("Threads:", 0) == 0)
+            return static_cast<uint32_t>(std::strtoul(line.c_str() + 8, nullptr, 10));
+    }
+    return 0;
+}
+
+static std::string RenderBenchPrompt(uint32_t i)
+{
+    std::string message = fmt::format("Benchmark message {}: where can I find a good trainer around here?", i);
+    return g_CompiledChatPrompt.render({ "Benchbot", "80", "Warrior", "A grumpy veteran who has seen too many wars.",
+                                         "80", "Mage", "Benchplayer", message, "", "" });
+}
+
+static void RunMicroBenchmarks(ChatBenchmarkRun& run)
+{
+    size_t promptBytes = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (uint32_t i = 0; i < BENCH_RENDER_ITERATIONS; ++i)
+        promptBytes += RenderBenchPrompt(i).size();
+    double renderNanos = NanosPer(BenchClock::now() - start, BENCH_RENDER_ITERATIONS);
+
+    // A scratch store, so the benchmark leaves the real history alone.
+    ConversationHistoryStore history;
+    history.setCapacity(g_MaxConversationHistory);
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < BENCH_HISTORY_TURNS; ++i)
+        history.append(1 + i % BENCH_HISTORY_PAIRS, 1000000 + i % 7, "Where can I find a good trainer around here?",
+                       "Ask in the capital, the trainers there know their trade.", true);
+    double appendNanos = NanosPer(BenchClock::now() - start, BENCH_HISTORY_TURNS);
+
+    start = BenchClock::now();
+    std::vector<PendingHistoryRow> rows = history.takePendingRows();
+    double takeNanos = NanosPer(BenchClock::now() - start, static_cast<uint32_t>(rows.size()));
+
+    // The save statements only: nothing is sent to the database.
+    start = BenchClock::now();
+    size_t statements = BuildHistorySaveStatements(rows).size();
+    double saveNanos = NanosPer(BenchClock::now() - start, static_cast<uint32_t>(rows.size()));
+
+    run.report.push_back(fmt::format("Prompt render: {:.0f} ns per prompt ({} bytes avg)",
+                                     renderNanos, promptBytes / BENCH_RENDER_ITERATIONS));
+    run.report.push_back(fmt::format("History: {:.0f} ns per appended turn, {:.0f} ns per row taken for saving, "
+                                     "{:.0f} ns per row to build the save ({} statements)",
+                                     appendNanos, takeNanos, saveNanos, statements));
+}
+
+static uint64_t PercentileMicros(const std::vector<uint64_t>& sorted, double q)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+static void FinishChatBenchmark(const std::shared_ptr<ChatBenchmarkRun>& run)
+{
+    if (run->finished)
+        return;
+    run->finished = true;
+
+    double seconds = std::chrono::duration<double>(BenchClock::now() - run->start).count();
+    std::vector<uint64_t>& latency = run->latencyMicros;
+    std::sort(latency.begin(), latency.end());
+
+    run->report.push_back(fmt::format("Load: {} replies in {:.2f} s, {:.1f} requests/s, {} errors ({} dropped unanswered), {} rejected (queue full)",
+                                      run->replies, seconds, seconds > 0 ? run->replies / seconds : 0.0,
+                                      run->errors + run->lost, run->lost, run->rejected));
+    run->report.push_back(fmt::format("Latency: p50 {:.1f} ms, p99 {:.1f} ms, max {:.1f} ms",
+                                      PercentileMicros(latency, 0.50) / 1000.0, PercentileMicros(latency, 0.99) / 1000.0,
+                                      latency.empty() ? 0.0 : latency.back() / 1000.0));
+    run->report.push_back(fmt::format("Threads: {} query threads ({}), {} in the process",
+                                      g_queryManager.getWorkerThreads(), g_UseCurlMulti ? "curl_multi" : "blocking pool",
+                                      ProcessThreadCount()));
+
+    Player* requester = run->requesterGuid ? ObjectAccessor::FindPlayer(ObjectGuid(run->requesterGuid)) : nullptr;
+    for (const std::string& line : run->report)
+    {
+        LOG_INFO("server.loading", "[OpenRouter Chat] Benchmark: {}", line);
+        if (requester)
+            ChatHandler(requester->GetSession()).SendSysMessage(line);
+    }
+
+    if (g_ChatBenchmark == run)
+        g_ChatBenchmark.reset();
+}
+
+static void RecordBenchQuery(const std::shared_ptr<ChatBenchmarkRun>& run, bool answered, bool failed, uint64_t latencyMicros)
+{
+    if (answered)
+    {
+        ++run->replies;
+        run->latencyMicros.push_back(latencyMicros);
+        if (failed)
+            ++run->errors;
+    }
+    else
+        ++run->lost;
+
+    if (++run->settled == run->submitted && run->nextQuery == run->queries)
+        FinishChatBenchmark(run);
+}
+
+// Owned by the reply callback of one query. The query manager destroys the
+// callback of a query it drops (expired, displaced, shut down) without calling
+// it, so the query is settled here rather than in the callback. That may
+// happen on any thread; the result is passed on to the world thread.
+struct ChatBenchmarkQuery
+{
+    std::shared_ptr<ChatBenchmarkRun> run;   // null once the query was rejected
+    BenchClock::time_point submitted;
+    bool answered = false;
+    bool failed = false;
+    uint64_t latencyMicros = 0;
+
+    ~ChatBenchmarkQuery()
+    {
+        if (!run)
+            return;
+        PostToWorldThread([run = std::move(run), answered = answered, failed = failed, latency = latencyMicros]() {
+            RecordBenchQuery(run, answered, failed, latency);
+        });
+    }
+};
+
+static void SubmitBenchQuery(const std::shared_ptr<ChatBenchmarkRun>& run, uint32_t i)
+{
+    auto query = std::make_shared<ChatBenchmarkQuery>();
+    query->run = run;
+    query->submitted = BenchClock::now();
+
+    // Live players come first.
+    QueryOptions options;
+    options.botName = "Benchbot";
+    options.priority = QueryPriority::RandomChatter;
+    bool queued = SubmitQuery(RenderBenchPrompt(i), [query](const std::string& reply)
+    {
+        query->answered = true;
+        query->failed = reply.empty() || IsQueryErrorReply(reply);
+        query->latencyMicros = std::chrono::duration_cast<std::chrono::microseconds>(BenchClock::now() - query->submitted).count();
+    }, nullptr, std::move(options));
+
+    if (queued)
+        ++run->submitted;
+    else
+    {
+        // The callback is gone with the query; ours is the last reference.
+        ++run->rejected;
+        query->run.reset();
+    }
+}
+
+void UpdateChatBenchmark()
+{
+    std::shared_ptr<ChatBenchmarkRun> run = g_ChatBenchmark;
+    if (!run || run->nextQuery == run->queries)
+        return;
+
+    uint32_t window = std::max<uint32_t>(g_queryManager.getConcurrencyLimit(), 1) * BENCH_QUERIES_PER_SLOT;
+    uint32_t unsettled = run->submitted - run->settled;
+    if (unsettled >= window)
+        return;
+
+    uint32_t batch = std::min(BENCH_QUERIES_PER_UPDATE, window - unsettled);
+    uint32_t end = std::min(run->queries, run->nextQuery + batch);
+    while (run->nextQuery < end)
+        SubmitBenchQuery(run, run->nextQuery++);
+
+    // Only the case where the last queries were all rejected; otherwise the
+    // last settled query finishes the run.
+    if (run->nextQuery == run->queries && run->settled == run->submitted)
+        FinishChatBenchmark(run);
+}
+
+bool StartChatBenchmark(Player* requester, uint32_t queries, std::string& error)
+{
+    if (g_ChatBenchmark)
+    {
+        error = "A benchmark is already running.";
+        return false;
+    }
+    for (const std::string& url : g_ChatEndpointRouter.getUrls())
+    {
+        if (!IsLocalEndpoint(url))
+        {
+            error = "Every endpoint must point at a local mock server (see apps/bench/mock_llm_server.py), not " + url + ".";
+            return false;
+        }
+    }
+
+    auto run = std::make_shared<ChatBenchmarkRun>();
+    run->requesterGuid = requester ? requester->GetGUID().GetRawValue() : 0;
+    run->queries = queries;
+    run->latencyMicros.reserve(queries);
+    RunMicroBenchmarks(*run);
+
+    // The queries go out from the next world update on.
+    g_ChatBenchmark = run;
+    run->start = BenchClock::now();
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef MOD_OLLAMA_CHAT_BENCH_H
+#define MOD_OLLAMA_CHAT_BENCH_H
+
+#include <cstdint>
+#include <string>
+
+class Player; // forward declaration
+
+// Times prompt rendering and history appends, then runs queries synthetic
+// queries through SubmitQuery, a batch per world update. The results go to
+// the log and, once the last query is settled, to the requester (if any).
+// Only runs if every endpoint is local, such as apps/bench/mock_llm_server.py,
+// so it never costs API credits. World thread only. Returns false with the
+// reason in error if it did not start.
+bool StartChatBenchmark(Player* requester, uint32_t queries, std::string& error);
+
+// Submits the next batch of a running benchmark. Once per world update.
+void UpdateChatBenchmark();
+
+#endif // MOD_OLLAMA_CHAT_BENCH_H
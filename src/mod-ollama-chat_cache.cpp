@@ -0,0 +1,195 @@
+#include "mod-ollama-chat_cache.h"
+#include "mod-ollama-chat_config.h"
+#include "Log.h"
+#include "Random.h"
+#include <algorithm>
+#include <cctype>
+#include <functional>
+
+ResponseCache g_ResponseCache;
+
+// Stands in for the bot name in keys and stored replies.
+static const std::string BOT_NAME_MARKER = "\x01";
+
+static bool IsWordChar(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || (static_cast<unsigned char>(c) & 0x80);
+}
+
+std::string ReplaceBotName(const std::string& text, const std::string& from, const std::string& to)
+{
+    if (from.empty())
+        return text;
+
+    std::string result;
+    result.reserve(text.size());
+    size_t pos = 0;
+    while (true)
+    {
+        size_t found = text.find(from, pos);
+        if (found == std::string::npos)
+            break;
+        size_t end = found + from.size();
+        bool wordStart = found == 0 || !IsWordChar(text[found - 1]);
+        bool wordEnd = end == text.size() || !IsWordChar(text[end]);
+        result.append(text, pos, found - pos);
+        result += (wordStart && wordEnd) ? to : from;
+        pos = end;
+    }
+    result.append(text, pos, std::string::npos);
+    return result;
+}
+
+ResponseCache::ResponseCache()
+    : maxEntries(0), ttl(0), variantsPerKey(1), hits(0), misses(0)
+{
+}
+
+void ResponseCache::configure(size_t maxEntriesValue, uint32_t ttlSeconds, uint32_t variants)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    maxEntries = maxEntriesValue;
+    ttl = std::chrono::seconds(ttlSeconds);
+    variantsPerKey = std::max<uint32_t>(variants, 1);
+    evictOverflow();
+}
+
+bool ResponseCache::isEnabled() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return maxEntries > 0;
+}
+
+// Case and runs of whitespace do not change what the model is asked.
+static uint64_t HashNormalizedPrompt(const std::string& prompt, const std::string& botName)
+{
+    std::string masked = ReplaceBotName(prompt, botName, BOT_NAME_MARKER);
+    std::string normalized;
+    normalized.reserve(masked.size());
+    bool pendingSpace = false;
+    for (char c : masked)
+    {
+        if (std::isspace(static_cast<unsigned char>(c)))
+        {
+            pendingSpace = !normalized.empty();
+            continue;
+        }
+        if (pendingSpace)
+            normalized += ' ';
+        pendingSpace = false;
+        normalized += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    return std::hash<std::string>{}(normalized);
+}
+
+uint64_t ResponseCache::makeKey(const std::string& prompt, const std::string& botName, const std::string& systemPrompt)
+{
+    uint64_t key = HashNormalizedPrompt(prompt, botName);
+    if (!systemPrompt.empty())
+        key ^= HashNormalizedPrompt(systemPrompt, botName) * 0x9E3779B97F4A7C15ULL;
+    return key;
+}
+
+bool ResponseCache::lookup(uint64_t key, const std::string& botName, std::string& response)
+{
+    std::string variant;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries.find(key);
+        if (it != entries.end() && Clock::now() >= it->second.expires)
+        {
+            lru.erase(it->second.lruPos);
+            entries.erase(it);
+            it = entries.end();
+        }
+        // Entries still collecting variants count as misses so the API is asked again.
+        if (it == entries.end() || it->second.samples < variantsPerKey)
+        {
+            ++misses;
+            return false;
+        }
+
+        Entry& entry = it->second;
+        lru.splice(lru.begin(), lru, entry.lruPos);
+        uint32_t idx = entry.variants.size() == 1 ? 0 : urand(0, entry.variants.size() - 1);
+        variant = entry.variants[idx];
+    }
+
+    ++hits;
+    response = ReplaceBotName(variant, BOT_NAME_MARKER, botName);
+    if (g_DebugEnabled)
+    {
+        LOG_INFO("server.loading", "Response cache hit ({} hits / {} misses).", hits.load(), misses.load());
+    }
+    return true;
+}
+
+void ResponseCache::store(uint64_t key, const std::string& botName, const std::string& response)
+{
+    if (response.empty())
+        return;
+
+    std::string masked = ReplaceBotName(response, botName, BOT_NAME_MARKER);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (maxEntries == 0)
+        return;
+
+    Clock::time_point now = Clock::now();
+    auto it = entries.find(key);
+    if (it != entries.end() && now >= it->second.expires)
+    {
+        lru.erase(it->second.lruPos);
+        entries.erase(it);
+        it = entries.end();
+    }
+
+    if (it == entries.end())
+    {
+        lru.push_front(key);
+        Entry& entry = entries[key];
+        entry.expires = now + ttl;
+        entry.lruPos = lru.begin();
+        entry.variants.push_back(std::move(masked));
+        entry.samples = 1;
+        evictOverflow();
+        return;
+    }
+
+    Entry& entry = it->second;
+    lru.splice(lru.begin(), lru, entry.lruPos);
+    if (entry.samples >= variantsPerKey)
+        return;
+    // A repeated reply still counts as a sample, so a key whose replies are
+    // always the same does not keep missing.
+    ++entry.samples;
+    for (const std::string& existing : entry.variants)
+    {
+        if (existing == masked)
+            return;
+    }
+    entry.variants.push_back(std::move(masked));
+}
+
+void ResponseCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    lru.clear();
+    entries.clear();
+}
+
+size_t ResponseCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries.size();
+}
+
+// Drops least recently used entries beyond maxEntries. Caller holds mutex_.
+void ResponseCache::evictOverflow()
+{
+    while (entries.size() > maxEntries && !lru.empty())
+    {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef MOD_OLLAMA_CHAT_CACHE_H
+#define MOD_OLLAMA_CHAT_CACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Replaces whole-word occurrences of the name from with to.
+std::string ReplaceBotName(const std::string& text, const std::string& from, const std::string& to);
+
+// LRU/TTL cache of API replies keyed on a normalized prompt hash.
+// Each key collects up to a configured number of different replies before it
+// starts serving them, so bots sharing a prompt do not all say the same line.
+class ResponseCache {
+public:
+    ResponseCache();
+
+    // Applies the limits; a size of 0 disables the cache and drops all entries.
+    void configure(size_t maxEntries, uint32_t ttlSeconds, uint32_t variantsPerKey);
+    bool isEnabled() const;
+
+    // Builds the key for a prompt and its system prompt. The bot name is
+    // masked so that otherwise identical prompts of different bots share an entry.
+    static uint64_t makeKey(const std::string& prompt, const std::string& botName, const std::string& systemPrompt = "");
+
+    // On a hit, stores a random variant (with the bot name filled in) in response.
+    bool lookup(uint64_t key, const std::string& botName, std::string& response);
+    // Remembers a reply for the key, up to variantsPerKey different replies.
+    void store(uint64_t key, const std::string& botName, const std::string& response);
+    void clear();
+
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+    size_t size() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        std::vector<std::string> variants;
+        uint32_t samples = 0; // replies stored so far, duplicates included
+        Clock::time_point expires;
+        std::list<uint64_t>::iterator lruPos;
+    };
+
+    void evictOverflow();
+
+    mutable std::mutex mutex_;
+    size_t maxEntries;
+    std::chrono::seconds ttl;
+    uint32_t variantsPerKey;
+    std::list<uint64_t> lru; // most recently used first
+    std::unordered_map<uint64_t, Entry> entries;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+
+extern ResponseCache g_ResponseCache;
+
+#endif // MOD_OLLAMA_CHAT_CACHE_H
@@ -0,0 +1,67 @@
+#include "mod-ollama-chat_command.h"
+#include "mod-ollama-chat_bench.h"
+#include "mod-ollama-chat_config.h"
+#include "mod-ollama-chat_metrics.h"
+#include "WorldSession.h"
+#include <fmt/core.h>
+#include <algorithm>
+
+using namespace Acore::ChatCommands;
+
+// .ollama stats
+static bool HandleOllamaStatsCommand(ChatHandler* handler)
+{
+    handler->SendSysMessage("OpenRouter Chat statistics since startup:");
+    for (const std::string& line : FormatChatMetrics())
+        handler->SendSysMessage(line);
+    return true;
+}
+
+// Queries a benchmark sends when none are given, and the most it may send.
+static constexpr uint32_t BENCH_DEFAULT_QUERIES = 200;
+static constexpr uint32_t BENCH_MAX_QUERIES = 10000;
+
+// .ollama bench [queries]
+static bool HandleOllamaBenchCommand(ChatHandler* handler, Optional<uint32> queries)
+{
+    uint32_t count = std::min<uint32_t>(queries.value_or(BENCH_DEFAULT_QUERIES), BENCH_MAX_QUERIES);
+    std::string error;
+    if (!StartChatBenchmark(handler->GetSession() ? handler->GetSession()->GetPlayer() : nullptr, count, error))
+    {
+        handler->SendSysMessage(error);
+        handler->SetSentErrorMessage(true);
+        return false;
+    }
+    handler->SendSysMessage(fmt::format("Benchmark started with {} queries; results follow when the last reply is in.", count));
+    return true;
+}
+
+// .ollama reload
+static bool HandleOllamaReloadCommand(ChatHandler* handler)
+{
+    if (!ReloadOllamaChatConfig())
+    {
+        handler->SendSysMessage("Could not re-read the config files; the current settings stay in effect.");
+        handler->SetSentErrorMessage(true);
+        return false;
+    }
+    handler->SendSysMessage("OpenRouter Chat configuration reloaded. Queries already running finish with the old settings.");
+    return true;
+}
+
+OllamaChatCommandScript::OllamaChatCommandScript() : CommandScript("OllamaChatCommandScript") {}
+
+ChatCommandTable OllamaChatCommandScript::GetCommands() const
+{
+    static ChatCommandTable ollamaCommandTable =
+    {
+        { "stats", HandleOllamaStatsCommand, SEC_GAMEMASTER, Console::Yes },
+        { "bench", HandleOllamaBenchCommand, SEC_ADMINISTRATOR, Console::Yes },
+        { "reload", HandleOllamaReloadCommand, SEC_ADMINISTRATOR, Console::Yes },
+    };
+    static ChatCommandTable commandTable =
+    {
+        { "ollama", ollamaCommandTable },
+    };
+    return commandTable;
+}
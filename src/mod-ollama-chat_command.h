@@ -0,0 +1,15 @@
+#ifndef MOD_OLLAMA_CHAT_COMMAND_H
+#define MOD_OLLAMA_CHAT_COMMAND_H
+
+#include "ScriptMgr.h"
+#include "Chat.h"
+
+// GM commands under .ollama.
+class OllamaChatCommandScript : public CommandScript
+{
+public:
+    OllamaChatCommandScript();
+    Acore::ChatCommands::ChatCommandTable GetCommands() const override;
+};
+
+#endif // MOD_OLLAMA_CHAT_COMMAND_H
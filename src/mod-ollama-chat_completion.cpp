@@ -0,0 +1,123 @@
+#include "mod-ollama-chat_completion.h"
+#include "mod-ollama-chat_config.h"
+#include "Log.h"
+#include <chrono>
+
+CompletionQueue g_CompletionQueue;
+
+// Intrusive MPSC queue after Dmitry Vyukov: producers swap themselves in as
+// the new head and then link the previous head to them; the consumer walks
+// from the tail. The stub node keeps the list non-empty.
+CompletionQueue::CompletionQueue()
+    : head(&stub), tail(&stub), pendingCount(0)
+{
+}
+
+CompletionQueue::~CompletionQueue()
+{
+    clear();
+}
+
+void CompletionQueue::push(Completion completion)
+{
+    Node* node = new Node();
+    node->completion = std::move(completion);
+    ++pendingCount;
+    pushNode(node);
+}
+
+void CompletionQueue::pushNode(Node* node)
+{
+    node->next.store(nullptr, std::memory_order_relaxed);
+    Node* prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+// Returns the oldest node, or nullptr if the queue is empty or a producer is
+// between its two steps (its node is picked up on the next call).
+CompletionQueue::Node* CompletionQueue::popNode()
+{
+    Node* first = tail;
+    Node* next = first->next.load(std::memory_order_acquire);
+    if (first == &stub)
+    {
+        if (!next)
+            return nullptr;
+        tail = next;
+        first = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next)
+    {
+        tail = next;
+        return first;
+    }
+
+    if (first != head.load(std::memory_order_acquire))
+        return nullptr;
+
+    // first is the last node: put the stub behind it so it can be unlinked.
+    pushNode(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next)
+    {
+        tail = next;
+        return first;
+    }
+    return nullptr;
+}
+
+size_t CompletionQueue::drain(uint32 budgetMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budgetMs);
+    size_t ran = 0;
+    while (Node* node = popNode())
+    {
+        --pendingCount;
+        try {
+            node->completion();
+        } catch (const std::exception& ex) {
+            if (g_DebugEnabled) {
+                LOG_ERROR("server.loading", "Exception in query completion: {}", ex.what());
+            }
+        }
+        delete node;
+        ++ran;
+
+        if (std::chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    return ran;
+}
+
+void CompletionQueue::clear()
+{
+    while (Node* node = popNode())
+    {
+        --pendingCount;
+        delete node;
+    }
+}
+
+void PostToWorldThread(CompletionQueue::Completion completion)
+{
+    g_CompletionQueue.push(std::move(completion));
+}
+
+OllamaChatCompletionWorldScript::OllamaChatCompletionWorldScript() : WorldScript("OllamaChatCompletionWorldScript") {}
+
+void OllamaChatCompletionWorldScript::OnUpdate(uint32 /*diff*/)
+{
+    size_t ran = g_CompletionQueue.drain(g_CompletionBudgetMs);
+    if (g_DebugEnabled && ran > 0 && g_CompletionQueue.pending() > 0)
+    {
+        LOG_INFO("server.loading", "Delivered {} replies this tick, {} left for the next.", ran, g_CompletionQueue.pending());
+    }
+}
+
+// Replies that arrive after this point have nobody to deliver them to.
+void OllamaChatCompletionWorldScript::OnShutdown()
+{
+    g_CompletionQueue.clear();
+}
@@ -0,0 +1,58 @@
+#ifndef MOD_OLLAMA_CHAT_COMPLETION_H
+#define MOD_OLLAMA_CHAT_COMPLETION_H
+
+#include "ScriptMgr.h"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+// Lock-free multi-producer, single-consumer queue of finished replies.
+// Query workers and the HTTP I/O thread push; only the world thread pops,
+// so game objects are touched from the world update loop alone.
+class CompletionQueue {
+public:
+    using Completion = std::function<void()>;
+
+    CompletionQueue();
+    ~CompletionQueue();
+
+    // Thread-safe, never blocks.
+    void push(Completion completion);
+    // World thread only: runs queued completions until the queue is empty or
+    // the budget is used up (at least one completion runs per call).
+    size_t drain(uint32 budgetMs);
+    // World thread only: discards everything still queued.
+    void clear();
+
+    size_t pending() const { return pendingCount; }
+
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        Completion completion;
+    };
+
+    void pushNode(Node* node);
+    Node* popNode();
+
+    std::atomic<Node*> head; // producers
+    Node* tail;              // consumer
+    Node stub;
+    std::atomic<size_t> pendingCount;
+};
+
+extern CompletionQueue g_CompletionQueue;
+
+// Runs the completion on the world thread during the next update.
+void PostToWorldThread(CompletionQueue::Completion completion);
+
+// Drains the completion queue once per world update.
+class OllamaChatCompletionWorldScript : public WorldScript
+{
+public:
+    OllamaChatCompletionWorldScript();
+    void OnUpdate(uint32 diff) override;
+    void OnShutdown() override;
+};
+
+#endif // MOD_OLLAMA_CHAT_COMPLETION_H
@@ -1,11 +1,17 @@
 #include "mod-ollama-chat_config.h"
 #include "Config.h"
 #include "Log.h"
+#include "mod-ollama-chat_admission.h"
 #include "mod-ollama-chat_api.h"
+#include "mod-ollama-chat_cache.h"
+#include "mod-ollama-chat_history.h"
+#include "mod-ollama-chat_personality.h"
+#include "mod-ollama-chat_router.h"
+#include "mod-ollama-chat_template.h"
 #include <fmt/core.h>
 #include <sstream>
 #include <curl/curl.h>
-#include <fstream>
+#include <mutex>
 
 
 // Global configuration variable definitions...
@@ -15,21 +21,52 @@ float      g_GeneralDistance   = 600.0f;
 uint32_t   g_PlayerReplyChance = 90;
 uint32_t   g_BotReplyChance    = 10;
 uint32_t   g_MaxBotsToPick     = 2;
+uint32_t   g_ReplyRatePerPlayer  = 20;
+uint32_t   g_ReplyBurstPerPlayer = 5;
+uint32_t   g_ReplyRatePerZone    = 60;
+uint32_t   g_ReplyBurstPerZone   = 20;
+uint32_t   g_ReplyRateGlobal     = 0;
+uint32_t   g_ReplyBurstGlobal    = 50;
 
 // OpenRouter.ai configuration variables (replacing Ollama variables)
 std::string g_OpenRouterApiKey        = "";
 std::string g_OpenRouterUrl           = "https://openrouter.ai/api/v1/chat/completions";
 std::string g_OpenRouterModel         = "meta-llama/llama-2-7b-chat";
+std::string g_ChatEndpoints           = "";
 uint32_t    g_OpenRouterMaxTokens     = 150;
 float       g_OpenRouterTemperature   = 0.7f;
 float       g_OpenRouterTopP          = 0.9f;
 uint32_t    g_OpenRouterTopK          = 0;
 std::string g_OpenRouterSystemPrompt  = "";
+bool        g_OpenRouterCacheControl  = true;
 std::string g_OpenRouterSeed          = "";
 std::string g_OpenRouterSiteUrl       = "";
 std::string g_OpenRouterSiteName      = "";
 
 uint32_t    g_MaxConcurrentQueries = 0;
+uint32_t    g_MaxQueuedQueries     = 0;
+bool        g_UseCurlMulti         = false;
+uint32_t    g_CompletionBudgetMs   = 2;
+bool        g_SingleFlight         = false;
+std::string g_QueryClassQuotas     = "100,100,50,25";
+std::string g_QueryClassMaxQueueAge = "0,120,30,20";
+std::string g_QueryClassDeadline   = "0,180,60,45";
+bool        g_AdaptiveConcurrency  = true;
+uint32_t    g_MaxQueryRetries      = 2;
+uint32_t    g_QueryRetryBaseDelayMs = 500;
+uint32_t    g_CircuitBreakerFailures = 5;
+uint32_t    g_CircuitBreakerSeconds = 30;
+bool        g_BatchBotReplies      = false;
+std::string g_BatchPromptTemplate;
+
+bool        g_EnableStreaming      = false;
+uint32_t    g_StreamMaxChunks      = 0;
+uint32_t    g_StreamChunkLength    = 255;
+
+uint32_t    g_ResponseCacheSize    = 512;
+uint32_t    g_ResponseCacheTTL     = 900;
+uint32_t    g_ResponseCacheVariants = 3;
+bool        g_ResponseCachePlayerReplies = false;
 
 bool        g_Enable                          = true;
 bool        g_DisableRepliesInCombat          = true;
@@ -39,43 +76,73 @@ uint32_t    g_MaxRandomInterval               = 180;
 float       g_RandomChatterRealPlayerDistance = 40.0f;
 uint32_t    g_RandomChatterBotCommentChance   = 25;
 uint32_t    g_RandomChatterMaxBotsPerPlayer   = 2;
+uint32_t    g_RandomChatterBotsPerUpdate      = 5;
 
 bool       g_EnableRPPersonalities           = false;
 
 uint32_t g_MaxConversationHistory = 5;
 uint32_t g_ConversationHistorySaveInterval = 10;
+bool     g_LazyHistoryLoad = false;
+uint32_t g_HistoryIdleEvictMinutes = 30;
+bool     g_EnableHistorySummary = false;
+uint32_t g_HistorySummaryBatch = 5;
+std::string g_HistorySummaryPromptTemplate;
 
 std::string g_RandomChatterPromptTemplate;
+std::string g_RandomChatterSystemPromptTemplate;
 
-std::unordered_map<uint64_t, std::string> g_BotPersonalityList;
 std::unordered_map<std::string, std::string> g_PersonalityPrompts;
 std::vector<std::string> g_PersonalityKeys;
 
 std::string g_ChatPromptTemplate;
+std::string g_ChatSystemPromptTemplate;
 std::string g_ChatExtraInfoTemplate;
 
 bool g_EnableChatHistory = true;
 std::string g_ChatHistoryHeaderTemplate;
 std::string g_ChatHistoryLineTemplate;
 std::string g_ChatHistoryFooterTemplate;
+std::string g_ChatHistorySummaryTemplate;
 
 bool        g_EnableChatBotSnapshotTemplate  = false;
 std::string g_ChatBotSnapshotTemplate;
+uint32_t    g_ChatBotSnapshotMaxEntries      = 10;
+uint32_t    g_BotContextCacheTTL             = 60;
+uint32_t    g_PromptTokenBudget              = 0;
 
-bool        g_DebugEnabled = false;
+std::atomic<bool> g_DebugEnabled{false};
+uint32_t    g_MetricsLogInterval = 0;
 
 std::string g_DefaultPersonalityPrompt;
 
-// Conversation history store
-std::unordered_map<uint64_t, std::unordered_map<uint64_t, std::deque<std::pair<std::string, std::string>>>> g_BotConversationHistory;
-std::mutex g_ConversationHistoryMutex;
 time_t g_LastHistorySaveTime = 0;
 
 // Default blacklist commands; these are prefixes that indicate the message is a command.
-std::vector<std::string> g_BlacklistCommands = {
+static const std::vector<std::string> DEFAULT_BLACKLIST_COMMANDS = {
     ".playerbots",
     "playerbot",
 };
+std::vector<std::string> g_BlacklistCommands = DEFAULT_BLACKLIST_COMMANDS;
+
+// Swapped as a whole on every load; readers copy the pointer under the lock.
+static std::shared_ptr<const QueryRuntimeSettings> g_QueryRuntimeSettings = std::make_shared<QueryRuntimeSettings>();
+static std::mutex g_QueryRuntimeSettingsMutex;
+
+std::shared_ptr<const QueryRuntimeSettings> GetQueryRuntimeSettings()
+{
+    std::lock_guard<std::mutex> lock(g_QueryRuntimeSettingsMutex);
+    return g_QueryRuntimeSettings;
+}
+
+static void PublishQueryRuntimeSettings()
+{
+    auto settings = std::make_shared<QueryRuntimeSettings>();
+    settings->enableStreaming = g_EnableStreaming;
+    settings->streamMaxChunks = g_StreamMaxChunks;
+    settings->streamChunkLength = g_StreamChunkLength;
+    std::lock_guard<std::mutex> lock(g_QueryRuntimeSettingsMutex);
+    g_QueryRuntimeSettings = std::move(settings);
+}
 
 // Environment random chatter message templates (populated from config).
 std::vector<std::string> g_EnvCommentCreature;
@@ -108,77 +175,100 @@ static std::vector<std::string> SplitString(const std::string& str, char delim)
     return tokens;
 }
 
-// Load Bot Personalities from Database
-static void LoadBotPersonalityList()
-{    
-    // Let's make sure our user has sourced the required sql file to add the new table
-    QueryResult tableExists = CharacterDatabase.Query("SELECT * FROM information_schema.tables WHERE table_schema = 'acore_characters' AND table_name = 'mod_ollama_chat_personality' LIMIT 1");
-    if (!tableExists)
-    {
-        LOG_ERROR("server.loading", "[OpenRouter Chat] Please source the required database table first");
-        return;
-    }
-
-    QueryResult result = CharacterDatabase.Query("SELECT guid,personality FROM mod_ollama_chat_personality");
-
-    if (!result)
+// Parses one value per query priority class (DirectMention, RealPlayer, BotToBot,
+// RandomChatter). Falls back to the defaults if the list is malformed.
+static std::array<uint32_t, QUERY_PRIORITY_COUNT> ParsePriorityClassList(const std::string& value, const char* option,
+                                                                          const std::array<uint32_t, QUERY_PRIORITY_COUNT>& defaults)
+{
+    std::vector<std::string> tokens = SplitString(value, ',');
+    if (tokens.size() != QUERY_PRIORITY_COUNT)
     {
-        return;
+        LOG_ERROR("server.loading", "[OpenRouter Chat] {} needs {} comma-separated values, using the defaults.", option, QUERY_PRIORITY_COUNT);
+        return defaults;
     }
-    if (result->GetRowCount() == 0)
-    {
-        return;
-    }    
 
-    if(g_DebugEnabled)
+    std::array<uint32_t, QUERY_PRIORITY_COUNT> result;
+    for (size_t i = 0; i < QUERY_PRIORITY_COUNT; ++i)
     {
-        LOG_INFO("server.loading", "[OpenRouter Chat] Fetching Bot Personality List into array");
+        try {
+            result[i] = static_cast<uint32_t>(std::stoul(tokens[i]));
+        } catch (const std::exception&) {
+            LOG_ERROR("server.loading", "[OpenRouter Chat] Invalid value '{}' in {}, using the defaults.", tokens[i], option);
+            return defaults;
+        }
     }
-
-    do
-    {
-        uint64_t personalityBotGUID = result->Fetch()[0].Get<uint64_t>();
-        std::string personalityKey = result->Fetch()[1].Get<std::string>();
-        g_BotPersonalityList[personalityBotGUID] = personalityKey;
-    } while (result->NextRow());
+    return result;
 }
 
-std::string GetMultiLineConfigValue(const std::string& configFilePath, const std::string& key)
+// The endpoints named in OllamaChat.Endpoints, each configured by its own
+// OllamaChat.Endpoint.<Name>.* options, or the single OpenRouter endpoint
+// of OpenRouterUrl and OpenRouterModel if none are named.
+static std::vector<ChatEndpointPtr> LoadChatEndpoints()
 {
-    std::ifstream infile(configFilePath);
-    if (!infile) return "";
-
-    std::string line;
-    std::string value;
-    bool foundKey = false;
-    while (std::getline(infile, line))
+    std::vector<ChatEndpointPtr> endpoints;
+    uint32_t served = 0;
+    for (const std::string& name : SplitString(g_ChatEndpoints, ','))
     {
-        std::string trimmed = line;
-        trimmed.erase(0, trimmed.find_first_not_of(" \t\r\n"));
-        if (trimmed.empty() || trimmed[0] == '#')
+        std::string prefix = "OllamaChat.Endpoint." + name + ".";
+        auto endpoint = std::make_shared<ChatEndpoint>();
+        endpoint->name = name;
+        endpoint->url = sConfigMgr->GetOption<std::string>(prefix + "Url", "");
+        if (endpoint->url.empty())
+        {
+            LOG_ERROR("server.loading", "[OpenRouter Chat] Endpoint {} has no {}Url, ignoring it.", name, prefix);
             continue;
-        size_t pos = trimmed.find('=');
-        if (!foundKey && pos != std::string::npos) {
-            std::string possibleKey = trimmed.substr(0, pos);
-            possibleKey.erase(possibleKey.find_last_not_of(" \t\r\n") + 1);
-            if (possibleKey == key) {
-                foundKey = true;
-                std::string afterEq = trimmed.substr(pos + 1);
-                afterEq.erase(0, afterEq.find_first_not_of(" \t\r\n"));
-                value += afterEq;
-                continue;
-            }
         }
-        else if (foundKey) {
-            // New config key or section
-            if (trimmed.find('=') != std::string::npos && trimmed.find('[') == std::string::npos)
-                break;
-            if (!value.empty()) value += "\n";
-            value += trimmed;
+
+        bool openRouter = endpoint->url.find("openrouter.ai") != std::string::npos;
+        std::string type = sConfigMgr->GetOption<std::string>(prefix + "Type", openRouter ? "OpenRouter" : "OpenAI", false);
+        if (type == "OpenAI" || type == "openai")
+            endpoint->type = EndpointType::OpenAI;
+        else if (type != "OpenRouter" && type != "openrouter")
+            LOG_ERROR("server.loading", "[OpenRouter Chat] Unknown {}Type '{}', using OpenRouter.", prefix, type);
+
+        endpoint->model = sConfigMgr->GetOption<std::string>(prefix + "Model", g_OpenRouterModel, false);
+        endpoint->apiKey = sConfigMgr->GetOption<std::string>(prefix + "ApiKey",
+                                                              endpoint->type == EndpointType::OpenRouter ? g_OpenRouterApiKey : "", false);
+        endpoint->maxConcurrent = sConfigMgr->GetOption<uint32_t>(prefix + "MaxConcurrent", 0, false);
+
+        std::string classes = sConfigMgr->GetOption<std::string>(prefix + "Classes", "", false);
+        endpoint->classMask = ALL_QUERY_CLASSES;
+        if (!classes.empty() && !ParseQueryClassMask(classes, endpoint->classMask))
+        {
+            LOG_ERROR("server.loading", "[OpenRouter Chat] Invalid {}Classes '{}', the endpoint serves all classes.", prefix, classes);
+            endpoint->classMask = ALL_QUERY_CLASSES;
         }
+
+        PrepareEndpointRequests(*endpoint);
+        served |= endpoint->classMask;
+        endpoints.push_back(std::move(endpoint));
     }
 
-    return value;
+    if (endpoints.empty())
+    {
+        auto endpoint = std::make_shared<ChatEndpoint>();
+        endpoint->name = "default";
+        endpoint->url = g_OpenRouterUrl;
+        endpoint->model = g_OpenRouterModel;
+        endpoint->apiKey = g_OpenRouterApiKey;
+        endpoint->classMask = ALL_QUERY_CLASSES;
+        PrepareEndpointRequests(*endpoint);
+        endpoints.push_back(std::move(endpoint));
+        return endpoints;
+    }
+
+    // A class nobody serves would never be answered.
+    if (served != ALL_QUERY_CLASSES)
+    {
+        for (size_t cls = 0; cls < QUERY_PRIORITY_COUNT; ++cls)
+        {
+            if (!(served & (1u << cls)))
+                LOG_ERROR("server.loading", "[OpenRouter Chat] No endpoint serves {} queries, sending them to endpoint {}.",
+                          QueryPriorityName(static_cast<QueryPriority>(cls)), endpoints.front()->name);
+        }
+        endpoints.front()->classMask |= ALL_QUERY_CLASSES & ~served;
+    }
+    return endpoints;
 }
 
 void LoadOllamaChatConfig()
@@ -189,41 +279,76 @@ void LoadOllamaChatConfig()
     g_PlayerReplyChance               = sConfigMgr->GetOption<uint32_t>("OllamaChat.PlayerReplyChance", 90);
     g_BotReplyChance                  = sConfigMgr->GetOption<uint32_t>("OllamaChat.BotReplyChance", 10);
     g_MaxBotsToPick                   = sConfigMgr->GetOption<uint32_t>("OllamaChat.MaxBotsToPick", 2);
+    g_ReplyRatePerPlayer              = sConfigMgr->GetOption<uint32_t>("OllamaChat.ReplyRatePerPlayer", 20);
+    g_ReplyBurstPerPlayer             = sConfigMgr->GetOption<uint32_t>("OllamaChat.ReplyBurstPerPlayer", 5);
+    g_ReplyRatePerZone                = sConfigMgr->GetOption<uint32_t>("OllamaChat.ReplyRatePerZone", 60);
+    g_ReplyBurstPerZone               = sConfigMgr->GetOption<uint32_t>("OllamaChat.ReplyBurstPerZone", 20);
+    g_ReplyRateGlobal                 = sConfigMgr->GetOption<uint32_t>("OllamaChat.ReplyRateGlobal", 0);
+    g_ReplyBurstGlobal                = sConfigMgr->GetOption<uint32_t>("OllamaChat.ReplyBurstGlobal", 50);
     
     // OpenRouter.ai configuration (replacing Ollama configuration)
     g_OpenRouterApiKey                = sConfigMgr->GetOption<std::string>("OllamaChat.OpenRouterApiKey", "");
     g_OpenRouterUrl                   = sConfigMgr->GetOption<std::string>("OllamaChat.OpenRouterUrl", "https://openrouter.ai/api/v1/chat/completions");
     g_OpenRouterModel                 = sConfigMgr->GetOption<std::string>("OllamaChat.OpenRouterModel", "meta-llama/llama-2-7b-chat");
+    g_ChatEndpoints                   = sConfigMgr->GetOption<std::string>("OllamaChat.Endpoints", "");
     g_OpenRouterMaxTokens             = sConfigMgr->GetOption<uint32_t>("OllamaChat.OpenRouterMaxTokens", 150);
     g_OpenRouterTemperature           = sConfigMgr->GetOption<float>("OllamaChat.OpenRouterTemperature", 0.7f);
     g_OpenRouterTopP                  = sConfigMgr->GetOption<float>("OllamaChat.OpenRouterTopP", 0.9f);
     g_OpenRouterTopK                  = sConfigMgr->GetOption<uint32_t>("OllamaChat.OpenRouterTopK", 0);
     g_OpenRouterSystemPrompt          = sConfigMgr->GetOption<std::string>("OllamaChat.OpenRouterSystemPrompt", "");
+    g_OpenRouterCacheControl          = sConfigMgr->GetOption<bool>("OllamaChat.OpenRouterCacheControl", true);
     g_OpenRouterSeed                  = sConfigMgr->GetOption<std::string>("OllamaChat.OpenRouterSeed", "");
     g_OpenRouterSiteUrl               = sConfigMgr->GetOption<std::string>("OllamaChat.OpenRouterSiteUrl", "");
     g_OpenRouterSiteName              = sConfigMgr->GetOption<std::string>("OllamaChat.OpenRouterSiteName", "");
 
     g_MaxConcurrentQueries            = sConfigMgr->GetOption<uint32_t>("OllamaChat.MaxConcurrentQueries", 0);
+    g_MaxQueuedQueries                = sConfigMgr->GetOption<uint32_t>("OllamaChat.MaxQueuedQueries", 0);
+    g_UseCurlMulti                    = sConfigMgr->GetOption<bool>("OllamaChat.UseCurlMulti", false);
+    g_CompletionBudgetMs              = sConfigMgr->GetOption<uint32_t>("OllamaChat.CompletionBudgetMs", 2);
+    g_SingleFlight                    = sConfigMgr->GetOption<bool>("OllamaChat.SingleFlight", false);
+    g_QueryClassQuotas                = sConfigMgr->GetOption<std::string>("OllamaChat.QueryClassQuotas", "100,100,50,25");
+    g_QueryClassMaxQueueAge           = sConfigMgr->GetOption<std::string>("OllamaChat.QueryClassMaxQueueAge", "0,120,30,20");
+    g_QueryClassDeadline              = sConfigMgr->GetOption<std::string>("OllamaChat.QueryClassDeadline", "0,180,60,45");
+    g_AdaptiveConcurrency             = sConfigMgr->GetOption<bool>("OllamaChat.AdaptiveConcurrency", true);
+    g_MaxQueryRetries                 = sConfigMgr->GetOption<uint32_t>("OllamaChat.MaxQueryRetries", 2);
+    g_QueryRetryBaseDelayMs           = sConfigMgr->GetOption<uint32_t>("OllamaChat.QueryRetryBaseDelayMs", 500);
+    g_CircuitBreakerFailures          = sConfigMgr->GetOption<uint32_t>("OllamaChat.CircuitBreakerFailures", 5);
+    g_CircuitBreakerSeconds           = sConfigMgr->GetOption<uint32_t>("OllamaChat.CircuitBreakerSeconds", 30);
+    g_BatchBotReplies                 = sConfigMgr->GetOption<bool>("OllamaChat.BatchBotReplies", false);
+    g_BatchPromptTemplate             = sConfigMgr->GetOption<std::string>("OllamaChat.BatchPromptTemplate", "Several WoW players are reacting to the same chat message from {player_name}: '{player_message}'. Below are the instructions for each of the {bot_count} players ({bot_names}). Write one reply per player, each following only that player's own instructions. Answer with nothing but a JSON array of {bot_count} objects in the given order, each with a name field holding the player's name and a reply field holding that player's reply. {bot_prompts}");
+
+    g_EnableStreaming                 = sConfigMgr->GetOption<bool>("OllamaChat.EnableStreaming", false);
+    g_StreamMaxChunks                 = sConfigMgr->GetOption<uint32_t>("OllamaChat.StreamMaxChunks", 0);
+    g_StreamChunkLength               = sConfigMgr->GetOption<uint32_t>("OllamaChat.StreamChunkLength", 255);
+
+    g_ResponseCacheSize               = sConfigMgr->GetOption<uint32_t>("OllamaChat.ResponseCacheSize", 512);
+    g_ResponseCacheTTL                = sConfigMgr->GetOption<uint32_t>("OllamaChat.ResponseCacheTTL", 900);
+    g_ResponseCacheVariants           = sConfigMgr->GetOption<uint32_t>("OllamaChat.ResponseCacheVariants", 3);
+    g_ResponseCachePlayerReplies      = sConfigMgr->GetOption<bool>("OllamaChat.ResponseCachePlayerReplies", false);
 
     g_Enable                          = sConfigMgr->GetOption<bool>("OllamaChat.Enable", true);
     g_DisableRepliesInCombat          = sConfigMgr->GetOption<bool>("OllamaChat.DisableRepliesInCombat", true);
     g_EnableRandomChatter             = sConfigMgr->GetOption<bool>("OllamaChat.EnableRandomChatter", true);
 
     g_DebugEnabled                    = sConfigMgr->GetOption<bool>("OllamaChat.DebugEnabled", false);
+    g_MetricsLogInterval              = sConfigMgr->GetOption<uint32_t>("OllamaChat.MetricsLogInterval", 0);
 
     g_MinRandomInterval               = sConfigMgr->GetOption<uint32_t>("OllamaChat.MinRandomInterval", 45);
     g_MaxRandomInterval               = sConfigMgr->GetOption<uint32_t>("OllamaChat.MaxRandomInterval", 180);
     g_RandomChatterRealPlayerDistance = sConfigMgr->GetOption<float>("OllamaChat.RandomChatterRealPlayerDistance", 40.0f);
     g_RandomChatterBotCommentChance   = sConfigMgr->GetOption<uint32_t>("OllamaChat.RandomChatterBotCommentChance", 25);
     g_RandomChatterMaxBotsPerPlayer   = sConfigMgr->GetOption<uint32_t>("OllamaChat.RandomChatterMaxBotsPerPlayer", 2);
+    g_RandomChatterBotsPerUpdate      = sConfigMgr->GetOption<uint32_t>("OllamaChat.RandomChatterBotsPerUpdate", 5);
 
     g_MaxConcurrentQueries            = sConfigMgr->GetOption<uint32_t>("OllamaChat.MaxConcurrentQueries", 0);
 
     g_EnableRPPersonalities           = sConfigMgr->GetOption<bool>("OllamaChat.EnableRPPersonalities", false);
 
     g_RandomChatterPromptTemplate     = sConfigMgr->GetOption<std::string>("OllamaChat.RandomChatterPromptTemplate", "");
+    g_RandomChatterSystemPromptTemplate = sConfigMgr->GetOption<std::string>("OllamaChat.RandomChatterSystemPromptTemplate", "");
 
     g_ChatPromptTemplate              = sConfigMgr->GetOption<std::string>("OllamaChat.ChatPromptTemplate", "");
+    g_ChatSystemPromptTemplate        = sConfigMgr->GetOption<std::string>("OllamaChat.ChatSystemPromptTemplate", "");
     
     g_ChatExtraInfoTemplate           = sConfigMgr->GetOption<std::string>("OllamaChat.ChatExtraInfoTemplate", "");
 
@@ -231,18 +356,28 @@ void LoadOllamaChatConfig()
 
     g_MaxConversationHistory          = sConfigMgr->GetOption<uint32_t>("OllamaChat.MaxConversationHistory", 5);
     g_ConversationHistorySaveInterval = sConfigMgr->GetOption<uint32_t>("OllamaChat.ConversationHistorySaveInterval", 10);
+    g_LazyHistoryLoad                 = sConfigMgr->GetOption<bool>("OllamaChat.LazyHistoryLoad", false);
+    g_HistoryIdleEvictMinutes         = sConfigMgr->GetOption<uint32_t>("OllamaChat.HistoryIdleEvictMinutes", 30);
+    g_EnableHistorySummary            = sConfigMgr->GetOption<bool>("OllamaChat.EnableHistorySummary", false);
+    g_HistorySummaryBatch             = sConfigMgr->GetOption<uint32_t>("OllamaChat.HistorySummaryBatch", 5);
+    g_HistorySummaryPromptTemplate    = sConfigMgr->GetOption<std::string>("OllamaChat.HistorySummaryPromptTemplate", "");
 
     g_ChatHistoryHeaderTemplate       = sConfigMgr->GetOption<std::string>("OllamaChat.ChatHistoryHeaderTemplate", "");
     g_ChatHistoryLineTemplate         = sConfigMgr->GetOption<std::string>("OllamaChat.ChatHistoryLineTemplate", "");
     g_ChatHistoryFooterTemplate       = sConfigMgr->GetOption<std::string>("OllamaChat.ChatHistoryFooterTemplate", "");
+    g_ChatHistorySummaryTemplate      = sConfigMgr->GetOption<std::string>("OllamaChat.ChatHistorySummaryTemplate", "");
 
     g_EnableChatBotSnapshotTemplate   = sConfigMgr->GetOption<bool>("OllamaChat.EnableChatBotSnapshotTemplate", false);
     g_ChatBotSnapshotTemplate         = sConfigMgr->GetOption<std::string>("OllamaChat.ChatBotSnapshotTemplate", "");
+    g_ChatBotSnapshotMaxEntries       = sConfigMgr->GetOption<uint32_t>("OllamaChat.ChatBotSnapshotMaxEntries", 10);
+    g_BotContextCacheTTL              = sConfigMgr->GetOption<uint32_t>("OllamaChat.BotContextCacheTTL", 60);
+    g_PromptTokenBudget               = sConfigMgr->GetOption<uint32_t>("OllamaChat.PromptTokenBudget", 0);
 
     g_EnableChatHistory               = sConfigMgr->GetOption<bool>("OllamaChat.EnableChatHistory", true);
 
 
     // Load extra blacklist commands from config (comma-separated list)
+    g_BlacklistCommands = DEFAULT_BLACKLIST_COMMANDS;
     std::string extraBlacklist = sConfigMgr->GetOption<std::string>("OllamaChat.BlacklistCommands", "");
     if (!extraBlacklist.empty())
     {
@@ -258,7 +393,26 @@ void LoadOllamaChatConfig()
 
     LoadPersonalityTemplatesFromDB();
 
+    CompilePromptTemplates();
+    PublishQueryRuntimeSettings();
+    g_ChatEndpointRouter.configure(LoadChatEndpoints());
+    g_ChatEndpointRouter.setCircuitBreaker(g_CircuitBreakerFailures, g_CircuitBreakerSeconds);
+
+    g_queryManager.setAsyncDispatch(g_UseCurlMulti);
+    g_queryManager.setMaxQueuedQueries(g_MaxQueuedQueries);
+    g_queryManager.setSingleFlight(g_SingleFlight);
+    g_queryManager.setClassQuotas(ParsePriorityClassList(g_QueryClassQuotas, "OllamaChat.QueryClassQuotas", { 100, 100, 50, 25 }));
+    g_queryManager.setClassMaxQueueAge(ParsePriorityClassList(g_QueryClassMaxQueueAge, "OllamaChat.QueryClassMaxQueueAge", { 0, 120, 30, 20 }));
+    g_queryManager.setClassDeadline(ParsePriorityClassList(g_QueryClassDeadline, "OllamaChat.QueryClassDeadline", { 0, 180, 60, 45 }));
+    g_queryManager.setRetryPolicy(g_MaxQueryRetries, g_QueryRetryBaseDelayMs);
     g_queryManager.setMaxConcurrentQueries(g_MaxConcurrentQueries);
+    g_queryManager.setAdaptiveConcurrency(g_AdaptiveConcurrency);
+
+    g_ConversationHistory.setCapacity(g_MaxConversationHistory);
+    g_ConversationHistory.setSummaryBatch(g_EnableHistorySummary ? g_HistorySummaryBatch : 0);
+    g_ResponseCache.configure(g_ResponseCacheSize, g_ResponseCacheTTL, g_ResponseCacheVariants);
+    g_ChatAdmission.configure({ g_ReplyRatePerPlayer, g_ReplyBurstPerPlayer }, { g_ReplyRatePerZone, g_ReplyBurstPerZone },
+                              { g_ReplyRateGlobal, g_ReplyBurstGlobal });
 
     // Loads the environment random chatter message templates for each type.
     // Each config option is a pipe-separated list of string templates,
@@ -295,6 +449,7 @@ void LoadOllamaChatConfig()
     g_EnvCommentBagSlots        = LoadEnvCommentVector("OllamaChat.EnvCommentBagSlots", { "" });
     g_EnvCommentDungeon         = LoadEnvCommentVector("OllamaChat.EnvCommentDungeon", { "" });
     g_EnvCommentUnfinishedQuest = LoadEnvCommentVector("OllamaChat.EnvCommentUnfinishedQuest", { "" });
+    CompileEnvCommentTemplates();
 
     LOG_INFO("server.loading",
              "[mod-ollama-chat] Config loaded: Enabled = {}, SayDistance = {}, YellDistance = {}, "
@@ -308,6 +463,17 @@ void LoadOllamaChatConfig()
              g_RandomChatterBotCommentChance, g_MaxConcurrentQueries, extraBlacklist);
 }
 
+bool ReloadOllamaChatConfig()
+{
+    if (!sConfigMgr->Reload())
+    {
+        LOG_ERROR("server.loading", "[OpenRouter Chat] Could not re-read the config files, keeping the current settings.");
+        return false;
+    }
+    LoadOllamaChatConfig();
+    return true;
+}
+
 void LoadPersonalityTemplatesFromDB()
 {
     g_PersonalityPrompts.clear();
@@ -333,13 +499,12 @@ void LoadPersonalityTemplatesFromDB()
 void LoadBotConversationHistoryFromDB()
 {
     QueryResult result = CharacterDatabase.Query(
-        "SELECT bot_guid, player_guid, player_message, bot_reply FROM mod_ollama_chat_history ORDER BY timestamp ASC"
+        "SELECT bot_guid, player_guid, player_message, bot_reply FROM mod_ollama_chat_history ORDER BY timestamp ASC, id ASC"
     );
     if (!result)
         return;
 
-    std::lock_guard<std::mutex> lock(g_ConversationHistoryMutex);
-    g_BotConversationHistory.clear();
+    g_ConversationHistory.clear();
 
     do {
         uint64_t botGuid = (*result)[0].Get<uint64_t>();
@@ -347,12 +512,7 @@ void LoadBotConversationHistoryFromDB()
         std::string playerMsg = (*result)[2].Get<std::string>();
         std::string botReply = (*result)[3].Get<std::string>();
 
-        auto& playerHistory = g_BotConversationHistory[botGuid][playerGuid];
-        playerHistory.push_back({ playerMsg, botReply });
-        while (playerHistory.size() > g_MaxConversationHistory)
-        {
-            playerHistory.pop_front();
-        }
+        g_ConversationHistory.append(botGuid, playerGuid, playerMsg, botReply, false);
 
     } while (result->NextRow());
 
@@ -365,8 +525,26 @@ OllamaChatConfigWorldScript::OllamaChatConfigWorldScript() : WorldScript("Ollama
 void OllamaChatConfigWorldScript::OnStartup()
 {
     curl_global_init(CURL_GLOBAL_ALL);
+    InitOllamaHttpClient();
     LoadOllamaChatConfig();
-    LoadBotPersonalityList();
-    LoadBotConversationHistoryFromDB();
+    LoadBotPersonalitiesFromDB();
+    // In lazy mode each pair is loaded when it is first used.
+    if (!g_LazyHistoryLoad)
+        LoadBotConversationHistoryFromDB();
 
 }
+
+// .reload config re-reads the files first; pick up our part of them too.
+void OllamaChatConfigWorldScript::OnAfterConfigLoad(bool reload)
+{
+    if (reload)
+        LoadOllamaChatConfig();
+}
+
+void OllamaChatConfigWorldScript::OnShutdown()
+{
+    SaveBotPersonalityAssignments(true);
+    // Join the query workers before the globals they read are destroyed.
+    g_queryManager.shutdown();
+    CleanupOllamaHttpClient();
+}
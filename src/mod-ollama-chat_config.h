@@ -1,8 +1,10 @@
 #ifndef MOD_OLLAMA_CHAT_CONFIG_H
 #define MOD_OLLAMA_CHAT_CONFIG_H
 
+#include <atomic>
 #include <string>
 #include <cstdint>
+#include <memory>
 #include <vector>
 #include "ScriptMgr.h"  // Ensure WorldScript is defined
 
@@ -12,56 +14,97 @@ extern float            g_GeneralDistance;
 extern uint32_t         g_PlayerReplyChance;
 extern uint32_t         g_BotReplyChance;
 extern uint32_t         g_MaxBotsToPick;
+extern uint32_t         g_ReplyRatePerPlayer;
+extern uint32_t         g_ReplyBurstPerPlayer;
+extern uint32_t         g_ReplyRatePerZone;
+extern uint32_t         g_ReplyBurstPerZone;
+extern uint32_t         g_ReplyRateGlobal;
+extern uint32_t         g_ReplyBurstGlobal;
 
 // OpenRouter.ai configuration variables (replacing Ollama variables)
 extern std::string      g_OpenRouterApiKey;
 extern std::string      g_OpenRouterUrl;
 extern std::string      g_OpenRouterModel;
+extern std::string      g_ChatEndpoints;
 extern uint32_t         g_OpenRouterMaxTokens;
 extern float            g_OpenRouterTemperature;
 extern float            g_OpenRouterTopP;
 extern uint32_t         g_OpenRouterTopK;
 extern std::string      g_OpenRouterSystemPrompt;
+extern bool             g_OpenRouterCacheControl;
 extern std::string      g_OpenRouterSeed;
 extern std::string      g_OpenRouterSiteUrl;
 extern std::string      g_OpenRouterSiteName;
 
 extern uint32_t         g_MaxConcurrentQueries;
+extern uint32_t         g_MaxQueuedQueries;
+extern bool             g_UseCurlMulti;
+extern uint32_t         g_CompletionBudgetMs;
+extern bool             g_SingleFlight;
+extern std::string      g_QueryClassQuotas;
+extern std::string      g_QueryClassMaxQueueAge;
+extern std::string      g_QueryClassDeadline;
+extern bool             g_AdaptiveConcurrency;
+extern uint32_t         g_MaxQueryRetries;
+extern uint32_t         g_QueryRetryBaseDelayMs;
+extern uint32_t         g_CircuitBreakerFailures;
+extern uint32_t         g_CircuitBreakerSeconds;
+extern bool             g_BatchBotReplies;
+extern std::string      g_BatchPromptTemplate;
+
+extern bool             g_EnableStreaming;
+extern uint32_t         g_StreamMaxChunks;
+extern uint32_t         g_StreamChunkLength;
+
+extern uint32_t         g_ResponseCacheSize;
+extern uint32_t         g_ResponseCacheTTL;
+extern uint32_t         g_ResponseCacheVariants;
+extern bool             g_ResponseCachePlayerReplies;
 
 extern bool             g_Enable;
 extern bool             g_DisableRepliesInCombat;
 extern bool             g_EnableRandomChatter;
-extern bool             g_DebugEnabled;
+extern std::atomic<bool> g_DebugEnabled;  // read by every thread
+extern uint32_t         g_MetricsLogInterval;
 extern uint32_t         g_MinRandomInterval;
 extern uint32_t         g_MaxRandomInterval;
 extern float            g_RandomChatterRealPlayerDistance;
 extern uint32_t         g_RandomChatterBotCommentChance;
 extern uint32_t         g_RandomChatterMaxBotsPerPlayer;
+extern uint32_t         g_RandomChatterBotsPerUpdate;
 
 extern bool             g_EnableRPPersonalities;
 
-extern std::unordered_map<uint64_t, std::unordered_map<uint64_t, std::deque<std::pair<std::string, std::string>>>> g_BotConversationHistory;
-extern std::mutex       g_ConversationHistoryMutex;
 extern uint32_t         g_MaxConversationHistory;
 extern uint32_t         g_ConversationHistorySaveInterval;
+extern bool             g_LazyHistoryLoad;
+extern uint32_t         g_HistoryIdleEvictMinutes;
+extern bool             g_EnableHistorySummary;
+extern uint32_t         g_HistorySummaryBatch;
+extern std::string      g_HistorySummaryPromptTemplate;
 extern time_t           g_LastHistorySaveTime;
 
 extern std::string      g_ChatHistoryHeaderTemplate;
 extern std::string      g_ChatHistoryLineTemplate;
 extern std::string      g_ChatHistoryFooterTemplate;
+extern std::string      g_ChatHistorySummaryTemplate;
 extern bool             g_EnableChatHistory;
 
 extern std::string      g_RandomChatterPromptTemplate;
+extern std::string      g_RandomChatterSystemPromptTemplate;
 
-extern std::unordered_map<uint64_t, std::string> g_BotPersonalityList;
 extern std::unordered_map<std::string, std::string> g_PersonalityPrompts;
 extern std::vector<std::string> g_PersonalityKeys;
 
 extern std::string      g_ChatPromptTemplate;
+extern std::string      g_ChatSystemPromptTemplate;
 extern std::string      g_ChatExtraInfoTemplate;
 
 extern bool             g_EnableChatBotSnapshotTemplate;
 extern std::string      g_ChatBotSnapshotTemplate;
+extern uint32_t         g_ChatBotSnapshotMaxEntries;
+extern uint32_t         g_BotContextCacheTTL;
+extern uint32_t         g_PromptTokenBudget;
 
 extern std::vector<std::string> g_BlacklistCommands;
 
@@ -80,8 +123,22 @@ extern std::vector<std::string> g_EnvCommentBagSlots;
 extern std::vector<std::string> g_EnvCommentDungeon;
 extern std::vector<std::string> g_EnvCommentUnfinishedQuest;
 
+// Settings the query workers and the HTTP I/O thread read while a query
+// runs. Every (re)load publishes a new snapshot and a query keeps the one it
+// started with, so a reload never rewrites values another thread is reading.
+struct QueryRuntimeSettings {
+    bool enableStreaming = false;
+    uint32_t streamMaxChunks = 0;
+    uint32_t streamChunkLength = 255;
+};
+
+std::shared_ptr<const QueryRuntimeSettings> GetQueryRuntimeSettings();
+
 // Loads configuration
 void LoadOllamaChatConfig();
+// Re-reads the config files and applies them to the running module. World
+// thread only. Returns false if the files could not be read.
+bool ReloadOllamaChatConfig();
 
 void LoadPersonalityTemplatesFromDB();
 
@@ -92,6 +149,8 @@ class OllamaChatConfigWorldScript : public WorldScript
 public:
     OllamaChatConfigWorldScript();
     void OnStartup() override;
+    void OnAfterConfigLoad(bool reload) override;
+    void OnShutdown() override;
 };
 
 #endif // MOD_OLLAMA_CHAT_CONFIG_H
@@ -13,9 +13,9 @@
 #include "ChannelMgr.h"
 #include <sstream>
 #include <vector>
+#include <list>
 #include <fmt/core.h>
 #include <nlohmann/json.hpp>
-#include <thread>
 #include <algorithm>
 #include <random>
 #include <cctype>
@@ -23,9 +23,16 @@
 #include <ctime>
 #include "DatabaseEnv.h"
 #include "mod-ollama-chat_handler.h"
+#include "mod-ollama-chat_admission.h"
 #include "mod-ollama-chat_api.h"
 #include "mod-ollama-chat_personality.h"
 #include "mod-ollama-chat_config.h"
+#include "mod-ollama-chat_cache.h"
+#include "mod-ollama-chat_completion.h"
+#include "mod-ollama-chat_history.h"
+#include "mod-ollama-chat_playerindex.h"
+#include "mod-ollama-chat_template.h"
+#include "mod-ollama-chat_random.h"
 
 #include <iomanip>
 #include "SpellMgr.h"
@@ -46,7 +53,15 @@
 // Forward declarations for internal helper functions.
 static bool IsBotEligibleForChatChannelLocal(Player* bot, Player* player,
                                              ChatChannelSourceLocal source, Channel* channel = nullptr);
-static std::string GenerateBotPrompt(Player* bot, std::string playerMessage, Player* player);
+static std::vector<Player*> GatherChatListeners(Player* player, ChatChannelSourceLocal source);
+static std::string GenerateBotPrompt(Player* bot, std::string playerMessage, Player* player, std::string& systemPrompt);
+static void SayBotReply(uint64_t botGuid, ChatChannelSourceLocal sourceLocal, uint32_t channelId, const std::string& chunk);
+static void RecordBotReply(uint64_t botGuid, uint64_t senderGuid, const std::string& msg, const std::string& response);
+static void SubmitBatchedBotReplies(const std::vector<Player*>& bots, Player* player, const std::string& msg,
+                                    ChatChannelSourceLocal sourceLocal, uint32_t channelId, bool senderIsBot);
+static QueryPriority GetReplyPriority(bool senderIsBot, bool mentioned);
+static void ForgetBotPromptContext(uint64_t botGuid);
+static void SubmitHistorySummaries();
 
 const char* ChatChannelSourceLocalStr[] =
 {
@@ -134,102 +149,277 @@ void PlayerBotChatHandler::OnPlayerChat(Player* player, uint32_t type, uint32_t
     ProcessChat(player, type, lang, msg, sourceLocal, channel);
 }
 
-void AppendBotConversation(uint64_t botGuid, uint64_t playerGuid, const std::string& playerMessage, const std::string& botReply)
+void PlayerBotChatHandler::OnPlayerLogin(Player* player)
+{
+    g_PlayerNameIndex.add(player->GetGUID().GetRawValue(), player->GetName());
+}
+
+// A bot that leaves the world or the map no longer answers what was said there.
+void PlayerBotChatHandler::OnPlayerLogout(Player* player)
+{
+    g_queryManager.cancelQueriesFor(player->GetGUID().GetRawValue());
+    g_PlayerIndex.invalidate();
+    g_PlayerNameIndex.remove(player->GetGUID().GetRawValue());
+    ForgetBotPromptContext(player->GetGUID().GetRawValue());
+    ForgetRandomChatterPlayer(player->GetGUID().GetRawValue());
+}
+
+void PlayerBotChatHandler::OnPlayerMapChanged(Player* player)
+{
+    g_queryManager.cancelQueriesFor(player->GetGUID().GetRawValue());
+    g_PlayerIndex.invalidate();
+}
+
+// Rows per INSERT statement, keeps each statement well below max_allowed_packet.
+static constexpr size_t HISTORY_ROWS_PER_INSERT = 100;
+
+// Lazy history mode: pairs waiting for their stored history to be loaded.
+static std::mutex g_HistoryLoadRequestsMutex;
+static std::vector<std::pair<uint64_t, uint64_t>> g_HistoryLoadRequests;
+// World thread only.
+static QueryCallbackProcessor g_HistoryQueryProcessor;
+static time_t g_LastHistoryEvictionCheck = 0;
+
+// Marks the pair as used and, the first time, asks for its history to be loaded.
+static void TouchBotConversationHistory(uint64_t botGuid, uint64_t playerGuid)
 {
-    std::lock_guard<std::mutex> lock(g_ConversationHistoryMutex);
-    auto& playerHistory = g_BotConversationHistory[botGuid][playerGuid];
-    playerHistory.push_back({ playerMessage, botReply });
-    while (playerHistory.size() > g_MaxConversationHistory)
+    if (!g_LazyHistoryLoad)
+        return;
+
+    if (g_ConversationHistory.touch(botGuid, playerGuid, time(nullptr)))
     {
-        playerHistory.pop_front();
+        std::lock_guard<std::mutex> lock(g_HistoryLoadRequestsMutex);
+        g_HistoryLoadRequests.emplace_back(botGuid, playerGuid);
     }
-
 }
 
-void SaveBotConversationHistoryToDB()
+void UpdateBotConversationHistory()
 {
-    std::lock_guard<std::mutex> lock(g_ConversationHistoryMutex);
+    if (g_EnableHistorySummary)
+        SubmitHistorySummaries();
+
+    if (!g_LazyHistoryLoad)
+        return;
+
+    std::vector<std::pair<uint64_t, uint64_t>> requests;
+    {
+        std::lock_guard<std::mutex> lock(g_HistoryLoadRequestsMutex);
+        requests.swap(g_HistoryLoadRequests);
+    }
+    for (const auto& [botGuid, playerGuid] : requests)
+    {
+        g_HistoryQueryProcessor.AddCallback(CharacterDatabase.AsyncQuery(fmt::format(
+            "SELECT player_message, bot_reply FROM mod_ollama_chat_history WHERE bot_guid = {} AND player_guid = {} "
+            "ORDER BY timestamp DESC, id DESC LIMIT {}", botGuid, playerGuid, g_MaxConversationHistory))
+            .WithCallback([botGuid, playerGuid](QueryResult result) {
+                std::vector<std::pair<std::string, std::string>> turns;
+                if (result)
+                {
+                    do {
+                        turns.emplace_back((*result)[0].Get<std::string>(), (*result)[1].Get<std::string>());
+                    } while (result->NextRow());
+                }
+                // Rows arrive newest first.
+                std::reverse(turns.begin(), turns.end());
+                g_ConversationHistory.mergeLoaded(botGuid, playerGuid, std::move(turns));
+            }));
+    }
+    g_HistoryQueryProcessor.ProcessReadyCallbacks();
 
-    for (const auto& [botGuid, playerMap] : g_BotConversationHistory) {
-        for (const auto& [playerGuid, history] : playerMap) {
-            for (const auto& pair : history) {
-                const std::string& playerMessage = pair.first;
-                const std::string& botReply = pair.second;
+    time_t now = time(nullptr);
+    if (g_HistoryIdleEvictMinutes > 0 && difftime(now, g_LastHistoryEvictionCheck) >= 60)
+    {
+        g_LastHistoryEvictionCheck = now;
+        size_t evicted = g_ConversationHistory.evictIdle(now, g_HistoryIdleEvictMinutes * 60, g_LastHistorySaveTime);
+        if (g_DebugEnabled && evicted > 0)
+        {
+            LOG_INFO("server.loading", "Evicted the conversation history of {} idle bot/player pairs.", evicted);
+        }
+    }
+}
+
+void AppendBotConversation(uint64_t botGuid, uint64_t playerGuid, const std::string& playerMessage, const std::string& botReply)
+{
+    TouchBotConversationHistory(botGuid, playerGuid);
+    g_ConversationHistory.append(botGuid, playerGuid, playerMessage, botReply, g_ConversationHistorySaveInterval > 0);
+}
 
-                std::string escPlayerMsg = playerMessage;
-                CharacterDatabase.EscapeString(escPlayerMsg);
+// Batched INSERTs of the rows, then one DELETE per touched pair that trims
+// it to the N most recent entries. Pairs without new entries cannot have grown.
+std::vector<std::string> BuildHistorySaveStatements(std::vector<PendingHistoryRow>& rows)
+{
+    std::vector<std::string> statements;
+    std::string query;
+    size_t rowsInQuery = 0;
+    for (PendingHistoryRow& row : rows)
+    {
+        CharacterDatabase.EscapeString(row.playerMessage);
+        CharacterDatabase.EscapeString(row.botReply);
 
-                std::string escBotReply = botReply;
-                CharacterDatabase.EscapeString(escBotReply);
+        if (rowsInQuery == 0)
+        {
+            query = "INSERT IGNORE INTO mod_ollama_chat_history (bot_guid, player_guid, timestamp, player_message, bot_reply) VALUES ";
+        }
+        else
+        {
+            query += ", ";
+        }
+        query += fmt::format("({}, {}, FROM_UNIXTIME({}), '{}', '{}')",
+            row.botGuid, row.playerGuid, static_cast<int64_t>(row.timestamp), row.playerMessage, row.botReply);
 
-                CharacterDatabase.Execute(fmt::format(
-                    "INSERT IGNORE INTO mod_ollama_chat_history (bot_guid, player_guid, timestamp, player_message, bot_reply) "
-                    "VALUES ({}, {}, NOW(), '{}', '{}')",
-                    botGuid, playerGuid, escPlayerMsg, escBotReply));
-            }
+        if (++rowsInQuery == HISTORY_ROWS_PER_INSERT)
+        {
+            statements.push_back(std::move(query));
+            rowsInQuery = 0;
         }
     }
+    if (rowsInQuery > 0)
+    {
+        statements.push_back(std::move(query));
+    }
 
-    // Cleanup: keep only the N most recent entries per bot/player pair
-    std::string cleanupQuery = R"SQL(
-        WITH ranked_history AS (
-            SELECT
-                bot_guid,
-                player_guid,
-                timestamp,
-                ROW_NUMBER() OVER (
-                    PARTITION BY bot_guid, player_guid
-                    ORDER BY timestamp DESC
-                ) as rn
-            FROM mod_ollama_chat_history
-        )
-        DELETE FROM mod_ollama_chat_history
-        WHERE (bot_guid, player_guid, timestamp) IN (
-            SELECT bot_guid, player_guid, timestamp
-            FROM ranked_history
-            WHERE rn > {}
-        );
-    )SQL";
-    CharacterDatabase.Execute(fmt::format(cleanupQuery, g_MaxConversationHistory));
+    std::vector<std::pair<uint64_t, uint64_t>> touchedPairs;
+    touchedPairs.reserve(rows.size());
+    for (const PendingHistoryRow& row : rows)
+    {
+        touchedPairs.emplace_back(row.botGuid, row.playerGuid);
+    }
+    std::sort(touchedPairs.begin(), touchedPairs.end());
+    touchedPairs.erase(std::unique(touchedPairs.begin(), touchedPairs.end()), touchedPairs.end());
+
+    for (const auto& [botGuid, playerGuid] : touchedPairs)
+    {
+        // The derived table is needed because MySQL does not allow LIMIT in an
+        // IN subquery on the table being deleted from.
+        statements.push_back(fmt::format(
+            "DELETE FROM mod_ollama_chat_history WHERE bot_guid = {0} AND player_guid = {1} AND id NOT IN ("
+            "SELECT id FROM (SELECT id FROM mod_ollama_chat_history WHERE bot_guid = {0} AND player_guid = {1} "
+            "ORDER BY timestamp DESC, id DESC LIMIT {2}) AS kept)",
+            botGuid, playerGuid, g_MaxConversationHistory));
+    }
+    return statements;
+}
+
+// Writes the turns added since the last save. The statements are built
+// without holding any history lock and committed as one transaction, which
+// the database worker thread executes.
+void SaveBotConversationHistoryToDB()
+{
+    std::vector<PendingHistoryRow> rows = g_ConversationHistory.takePendingRows();
+    if (rows.empty())
+        return;
+
+    CharacterDatabaseTransaction trans = CharacterDatabase.BeginTransaction();
+    // Passed as char const* so chat text is never read as a format string.
+    for (const std::string& statement : BuildHistorySaveStatements(rows))
+        trans->Append(statement.c_str());
+
+    if(g_DebugEnabled)
+    {
+        LOG_INFO("server.loading", "Saving {} new conversation history entries.", rows.size());
+    }
+
+    CharacterDatabase.CommitTransaction(trans);
 }
 
 
-std::string GetBotHistoryPrompt(uint64_t botGuid, uint64_t playerGuid, std::string playerMessage)
+// Conversation history of a pair, kept in pieces so the prompt budget can
+// drop the oldest turns and the summary.
+struct BotHistoryPrompt
 {
+    std::string header;
+    std::string summary;               // rendered summary, empty without one
+    std::vector<std::string> lines;    // oldest first
+    std::string footer;
+
+    bool empty() const { return summary.empty() && lines.empty(); }
+
+    std::string join() const
+    {
+        if (empty())
+            return "";
+        std::string result = header + summary;
+        for (const std::string& line : lines)
+            result += line;
+        result += footer;
+        return result;
+    }
+};
+
+static BotHistoryPrompt GetBotHistoryPrompt(uint64_t botGuid, uint64_t playerGuid, const std::string& playerMessage)
+{
+    BotHistoryPrompt history;
     if(!g_EnableChatHistory)
     {
-        return "";
+        return history;
     }
     
-    std::lock_guard<std::mutex> lock(g_ConversationHistoryMutex);
-
-    std::string result;
-    const auto botIt = g_BotConversationHistory.find(botGuid);
-    if (botIt == g_BotConversationHistory.end())
-        return result;
-    const auto playerIt = botIt->second.find(playerGuid);
-    if (playerIt == botIt->second.end())
-        return result;
+    TouchBotConversationHistory(botGuid, playerGuid);
 
     Player* player = ObjectAccessor::FindPlayer(ObjectGuid(playerGuid));
     std::string playerName = player ? player->GetName() : "The player";
 
-    result += fmt::format(g_ChatHistoryHeaderTemplate, fmt::arg("player_name", playerName));
+    std::string summary;
+    bool hasHistory = g_ConversationHistory.forEachTurn(botGuid, playerGuid,
+        [&history, &playerName](std::string_view playerMessage, std::string_view botReply) {
+            history.lines.push_back(g_CompiledChatHistoryLine.render({ playerName, playerMessage, botReply }));
+        }, &summary);
+    if (!hasHistory)
+        return history;
+
+    history.header = g_CompiledChatHistoryHeader.render({ playerName });
+    if (!summary.empty())
+        history.summary = g_CompiledChatHistorySummary.render({ playerName, summary });
+    history.footer = g_CompiledChatHistoryFooter.render({ playerName, playerMessage });
+    return history;
+}
 
-    for (const auto& entry : playerIt->second) {
-        result += fmt::format(g_ChatHistoryLineTemplate,
-            fmt::arg("player_name", playerName),
-            fmt::arg("player_message", entry.first),
-            fmt::arg("bot_reply", entry.second)
-        );
-    }
+// Summarizes the turns pushed out of full histories, one low priority query
+// per bot/player pair. World thread only.
+static void SubmitHistorySummaries()
+{
+    // Hands the summary to the store once the query is done with, or the
+    // turns back if there is none. A query dropped from the queue never calls
+    // back, so this happens when its callback is destroyed, answered or not.
+    struct PendingHistorySummary
+    {
+        uint64_t botGuid;
+        uint64_t playerGuid;
+        std::string summary;
+        std::vector<std::pair<std::string, std::string>> turns;
 
-    result += fmt::format(g_ChatHistoryFooterTemplate,
-        fmt::arg("player_name", playerName),
-        fmt::arg("player_message", playerMessage)
-    );
+        ~PendingHistorySummary()
+        {
+            if (summary.empty())
+                g_ConversationHistory.finishSummary(botGuid, playerGuid, std::move(turns));
+            else
+                g_ConversationHistory.finishSummary(botGuid, playerGuid, std::move(summary));
+        }
+    };
 
-    return result;
+    for (HistorySummaryRequest& request : g_ConversationHistory.takeSummaryRequests())
+    {
+        Player* player = ObjectAccessor::FindPlayer(ObjectGuid(request.playerGuid));
+        std::string playerName = player ? player->GetName() : "The player";
+
+        std::string conversation;
+        for (const auto& [playerMessage, botReply] : request.turns)
+            g_CompiledChatHistoryLine.renderTo(conversation, { playerName, playerMessage, botReply });
+        std::string prompt = g_CompiledHistorySummaryPrompt.render({
+            playerName, request.summary.empty() ? "none" : request.summary, conversation });
+
+        auto pending = std::make_shared<PendingHistorySummary>();
+        pending->botGuid = request.botGuid;
+        pending->playerGuid = request.playerGuid;
+        pending->turns = std::move(request.turns);
+
+        QueryOptions options;
+        options.priority = QueryPriority::RandomChatter;
+        SubmitQuery(std::move(prompt), [pending](const std::string& response) {
+            if (!IsQueryErrorReply(response))
+                pending->summary = rtrim(response);
+        }, nullptr, std::move(options));
+    }
 }
 
 // --- Helper: Spells ---
@@ -324,20 +514,46 @@ std::vector<std::string> ChatHandler_GetGroupStatus(Player* bot)
     return info;
 }
 
+// Returns the nearest of the candidates in line of sight of the bot, at most
+// g_ChatBotSnapshotMaxEntries. Candidates are sorted by distance first, so
+// the costly LOS checks stop as soon as enough entries are found.
+template<class T>
+static std::vector<std::pair<float, T*>> ChatHandler_NearestInLOS(Player* bot, std::vector<std::pair<float, T*>> candidates)
+{
+    std::sort(candidates.begin(), candidates.end(),
+              [](auto const& a, auto const& b) { return a.first < b.first; });
+
+    std::vector<std::pair<float, T*>> nearest;
+    for (auto const& candidate : candidates)
+    {
+        if (g_ChatBotSnapshotMaxEntries > 0 && nearest.size() >= g_ChatBotSnapshotMaxEntries)
+            break;
+        T* obj = candidate.second;
+        if (!bot->IsWithinLOS(obj->GetPositionX(), obj->GetPositionY(), obj->GetPositionZ()))
+            continue;
+        nearest.push_back(candidate);
+    }
+    return nearest;
+}
+
 // --- Helper: Visible players ---
 std::vector<std::string> ChatHandler_GetVisiblePlayers(Player* bot, float radius = 40.0f)
 {
     std::vector<std::string> players;
     if (!bot || !bot->GetMap()) return players;
-    for (auto const& pair : ObjectAccessor::GetPlayers())
+
+    std::vector<Player*> inRange;
+    GetPlayersInRange(bot, radius, inRange);
+    std::vector<std::pair<float, Player*>> candidates;
+    for (Player* player : inRange)
     {
-        Player* player = pair.second;
         if (!player || player == bot) continue;
         if (!player->IsInWorld() || player->IsGameMaster()) continue;
-        if (player->GetMap() != bot->GetMap()) continue;
-        if (!bot->IsWithinDistInMap(player, radius)) continue;
-        if (!bot->IsWithinLOS(player->GetPositionX(), player->GetPositionY(), player->GetPositionZ())) continue;
-        float dist = bot->GetDistance(player);
+        candidates.emplace_back(bot->GetDistance(player), player);
+    }
+
+    for (auto const& [dist, player] : ChatHandler_NearestInLOS(bot, std::move(candidates)))
+    {
         std::string faction = (player->GetTeamId() == TEAM_ALLIANCE ? "Alliance" : "Horde");
         PlayerbotAI* ai = sPlayerbotsMgr->GetPlayerbotAI(player);
         std::string className = ai ? ai->GetChatHelper()->FormatClass(player->getClass()) : "Unknown";
@@ -355,46 +571,71 @@ std::vector<std::string> ChatHandler_GetVisiblePlayers(Player* bot, float radius
     return players;
 }
 
-// --- Helper: Visible locations/objects (creatures and gameobjects) ---
+// --- Helper: Visible locations/objects (creatures and gameobjects), nearest first ---
 std::vector<std::string> ChatHandler_GetVisibleLocations(Player* bot, float radius = 40.0f)
 {
     std::vector<std::string> visible;
     if (!bot || !bot->GetMap()) return visible;
-    Map* map = bot->GetMap();
-    for (auto const& pair : map->GetCreatureBySpawnIdStore())
+
+    std::vector<std::pair<float, std::string>> entries;
+
+    // Grid objects are creatures and gameobjects, so the unit search finds no players.
+    std::list<Unit*> units;
+    Acore::AnyUnitInObjectRangeCheck unitCheck(bot, radius, false);
+    Acore::UnitListSearcher<Acore::AnyUnitInObjectRangeCheck> unitSearcher(bot, units, unitCheck);
+    Cell::VisitGridObjects(bot, unitSearcher, radius);
+
+    std::vector<std::pair<float, Creature*>> creatures;
+    for (Unit* unit : units)
     {
-        Creature* c = pair.second;
+        Creature* c = unit->ToCreature();
         if (!c) continue;
-        if (c->GetGUID() == bot->GetGUID()) continue;
-        if (!bot->IsWithinDistInMap(c, radius)) continue;
-        if (!bot->IsWithinLOS(c->GetPositionX(), c->GetPositionY(), c->GetPositionZ())) continue;
         if (c->IsPet() || c->IsTotem()) continue;
+        creatures.emplace_back(bot->GetDistance(c), c);
+    }
+
+    for (auto const& [dist, c] : ChatHandler_NearestInLOS(bot, std::move(creatures)))
+    {
         std::string type;
         if (c->isDead()) type = "DEAD";
         else if (c->IsHostileTo(bot)) type = "ENEMY";
         else if (c->IsFriendlyTo(bot)) type = "FRIENDLY";
         else type = "NEUTRAL";
-        float dist = bot->GetDistance(c);
-        visible.push_back(
+        entries.emplace_back(dist,
             type + ": " + c->GetName() +
             ", Level: " + std::to_string(c->GetLevel()) +
             ", HP: " + std::to_string(c->GetHealth()) + "/" + std::to_string(c->GetMaxHealth()) +
             ", Distance: " + std::to_string(dist) + ")"
         );
     }
-    for (auto const& pair : map->GetGameObjectBySpawnIdStore())
+
+    std::list<GameObject*> gameObjects;
+    Acore::GameObjectInRangeCheck goCheck(bot->GetPositionX(), bot->GetPositionY(), bot->GetPositionZ(), radius);
+    Acore::GameObjectListSearcher<Acore::GameObjectInRangeCheck> goSearcher(bot, gameObjects, goCheck);
+    Cell::VisitGridObjects(bot, goSearcher, radius);
+
+    std::vector<std::pair<float, GameObject*>> objects;
+    for (GameObject* go : gameObjects)
     {
-        GameObject* go = pair.second;
-        if (!go) continue;
-        if (!bot->IsWithinDistInMap(go, radius)) continue;
-        if (!bot->IsWithinLOS(go->GetPositionX(), go->GetPositionY(), go->GetPositionZ())) continue;
-        float dist = bot->GetDistance(go);
-        visible.push_back(
+        objects.emplace_back(bot->GetDistance(go), go);
+    }
+
+    size_t creatureCount = entries.size();
+    for (auto const& [dist, go] : ChatHandler_NearestInLOS(bot, std::move(objects)))
+    {
+        entries.emplace_back(dist,
             go->GetName() +
             ", Type: " + std::to_string(go->GetGoType()) +
             ", Distance: " + std::to_string(dist) + ")"
         );
     }
+
+    // Both runs are sorted by distance already.
+    std::inplace_merge(entries.begin(), entries.begin() + creatureCount, entries.end(),
+                       [](auto const& a, auto const& b) { return a.first < b.first; });
+    visible.reserve(entries.size());
+    for (auto& entry : entries)
+        visible.push_back(std::move(entry.second));
     return visible;
 }
 
@@ -455,46 +696,160 @@ std::string ChatHandler_GetCombatSummary(Player* bot)
 }
 
 
-static std::string GenerateBotGameStateSnapshot(Player* bot)
+// Formatted facts about a bot that rarely change. An entry is reused until it
+// expires or one of the values it was built from changes (level, zone, area,
+// map, guild, group, number of known spells or quests).
+struct BotPromptContext
 {
-    // Prepare each section
-    std::string combat = ChatHandler_GetCombatSummary(bot);
+    uint32_t level = 0;
+    uint32_t zoneId = 0;
+    uint32_t areaId = 0;
+    uint32_t mapId = 0;
+    uint32_t guildId = 0;
+    ObjectGuid groupGuid;
+    size_t spellCount = 0;
+    size_t questCount = 0;
+    time_t expires = 0;
+
+    std::string areaName;
+    std::string zoneName;
+    std::string mapName;
+    std::string className;
+    std::string raceName;
+    std::string role;
+    std::string gender;
+    std::string faction;
+    std::string guildName;
+
+    // Only filled while the snapshot template is enabled.
+    bool hasSnapshotParts = false;
+    std::string spells;
+    std::string quests;
+};
 
-    std::string group;
-    std::vector<std::string> groupInfo = ChatHandler_GetGroupStatus(bot);
-    if (!groupInfo.empty()) {
-        group += "Group members:\n";
-        for (const auto& entry : groupInfo) group += " - " + entry + "\n";
+static std::mutex g_BotPromptContextMutex;
+static std::unordered_map<uint64_t, std::shared_ptr<const BotPromptContext>> g_BotPromptContexts;
+
+static std::shared_ptr<const BotPromptContext> GetBotPromptContext(Player* bot, PlayerbotAI* botAI)
+{
+    auto context = std::make_shared<BotPromptContext>();
+    context->level      = bot->GetLevel();
+    context->zoneId     = bot->GetZoneId();
+    context->areaId     = bot->GetAreaId();
+    context->mapId      = bot->GetMapId();
+    context->guildId    = bot->GetGuildId();
+    context->groupGuid  = bot->GetGroup() ? bot->GetGroup()->GetGUID() : ObjectGuid::Empty;
+    context->spellCount = bot->GetSpellMap().size();
+    context->questCount = bot->getQuestStatusMap().size();
+
+    uint64_t botGuid = bot->GetGUID().GetRawValue();
+    time_t now = time(nullptr);
+    if (g_BotContextCacheTTL > 0)
+    {
+        std::lock_guard<std::mutex> lock(g_BotPromptContextMutex);
+        auto it = g_BotPromptContexts.find(botGuid);
+        if (it != g_BotPromptContexts.end())
+        {
+            const BotPromptContext& cached = *it->second;
+            bool unchanged = cached.level == context->level && cached.zoneId == context->zoneId &&
+                             cached.areaId == context->areaId && cached.mapId == context->mapId &&
+                             cached.guildId == context->guildId && cached.groupGuid == context->groupGuid &&
+                             cached.spellCount == context->spellCount && cached.questCount == context->questCount;
+            if (unchanged && now < cached.expires && (cached.hasSnapshotParts || !g_EnableChatBotSnapshotTemplate))
+                return it->second;
+        }
     }
 
-    std::string spells = ChatHandler_GetBotSpellInfo(bot);
+    AreaTableEntry const* botCurrentArea = botAI->GetCurrentArea();
+    AreaTableEntry const* botCurrentZone = botAI->GetCurrentZone();
+    context->areaName   = botCurrentArea ? botAI->GetLocalizedAreaName(botCurrentArea): "UnknownArea";
+    context->zoneName   = botCurrentZone ? botAI->GetLocalizedAreaName(botCurrentZone): "UnknownZone";
+    context->mapName    = bot->GetMap() ? bot->GetMap()->GetMapName() : "UnknownMap";
+    context->className  = botAI->GetChatHelper()->FormatClass(bot->getClass());
+    context->raceName   = botAI->GetChatHelper()->FormatRace(bot->getRace());
+    context->role       = ChatHelper::FormatClass(bot, AiFactory::GetPlayerSpecTab(bot));
+    context->gender     = (bot->getGender() == 0 ? "Male" : "Female");
+    context->faction    = (bot->GetTeamId() == TEAM_ALLIANCE ? "Alliance" : "Horde");
+    context->guildName  = (bot->GetGuild() ? bot->GetGuild()->GetName() : "No Guild");
+
+    if (g_EnableChatBotSnapshotTemplate)
+    {
+        context->hasSnapshotParts = true;
+        context->spells = ChatHandler_GetBotSpellInfo(bot);
+        for (auto const& qs : bot->getQuestStatusMap())
+            context->quests += "Quest " + std::to_string(qs.first) + " status " + std::to_string(qs.second.Status) + "\n";
+    }
+    context->expires = now + g_BotContextCacheTTL;
 
-    std::string quests;
-    for (auto const& qs : bot->getQuestStatusMap())
-        quests += "Quest " + std::to_string(qs.first) + " status " + std::to_string(qs.second.Status) + "\n";
+    if (g_BotContextCacheTTL > 0)
+    {
+        std::lock_guard<std::mutex> lock(g_BotPromptContextMutex);
+        g_BotPromptContexts[botGuid] = context;
+    }
+    return context;
+}
+
+static void ForgetBotPromptContext(uint64_t botGuid)
+{
+    std::lock_guard<std::mutex> lock(g_BotPromptContextMutex);
+    g_BotPromptContexts.erase(botGuid);
+}
+
+// Pieces of the snapshot, kept apart so the prompt budget can drop the most
+// distant objects and players.
+struct BotSnapshotPrompt
+{
+    std::string combat;
+    std::string group;
+    std::vector<std::string> los;       // nearest first
+    std::vector<std::string> players;   // nearest first
+
+    std::string render(const BotPromptContext& context) const
+    {
+        std::string losText;
+        for (const auto& entry : los) losText += " - " + entry + "\n";
 
-    std::string los;
-    std::vector<std::string> losLocs = ChatHandler_GetVisibleLocations(bot);
-    if (!losLocs.empty()) {
-        for (const auto& entry : losLocs) los += " - " + entry + "\n";
+        std::string playersText;
+        for (const auto& entry : players) playersText += " - " + entry + "\n";
+
+        return g_CompiledChatBotSnapshot.render({ combat, group, context.spells, context.quests, losText, playersText });
     }
+};
 
-    std::string players;
-    std::vector<std::string> nearbyPlayers = ChatHandler_GetVisiblePlayers(bot);
-    if (!nearbyPlayers.empty()) {
-        for (const auto& entry : nearbyPlayers) players += " - " + entry + "\n";
+static BotSnapshotPrompt GenerateBotGameStateSnapshot(Player* bot)
+{
+    BotSnapshotPrompt snapshot;
+    snapshot.combat = ChatHandler_GetCombatSummary(bot);
+
+    std::vector<std::string> groupInfo = ChatHandler_GetGroupStatus(bot);
+    if (!groupInfo.empty()) {
+        snapshot.group += "Group members:\n";
+        for (const auto& entry : groupInfo) snapshot.group += " - " + entry + "\n";
     }
 
-    // Use template
-    return fmt::format(
-        g_ChatBotSnapshotTemplate,
-        fmt::arg("combat", combat),
-        fmt::arg("group", group),
-        fmt::arg("spells", spells),
-        fmt::arg("quests", quests),
-        fmt::arg("los", los),
-        fmt::arg("players", players)
-    );
+    snapshot.los = ChatHandler_GetVisibleLocations(bot);
+    snapshot.players = ChatHandler_GetVisiblePlayers(bot);
+    return snapshot;
+}
+
+// Drops entries, from the front or the back, until about excess tokens are
+// freed or none are left. Returns the tokens freed.
+static size_t ChatHandler_TrimPromptEntries(std::vector<std::string>& entries, size_t excess, bool fromFront)
+{
+    size_t freed = 0;
+    size_t dropped = 0;
+    while (freed < excess && dropped < entries.size())
+    {
+        const std::string& entry = fromFront ? entries[dropped] : entries[entries.size() - 1 - dropped];
+        // The list marker and line break of each entry cost a token each.
+        freed += EstimatePromptTokens(entry) + 2;
+        ++dropped;
+    }
+    if (fromFront)
+        entries.erase(entries.begin(), entries.begin() + dropped);
+    else
+        entries.resize(entries.size() - dropped);
+    return freed;
 }
 
 
@@ -523,41 +878,25 @@ void PlayerBotChatHandler::ProcessChat(Player* player, uint32_t /*type*/, uint32
         }
     }
              
-    PlayerbotAI* senderAI = sPlayerbotsMgr->GetPlayerbotAI(player);
-    bool senderIsBot = (senderAI && senderAI->IsBotAI());
-    
-    std::vector<Player*> eligibleBots;
-    if (channel != nullptr)
-    {
-        ChannelMgr* cMgr = ChannelMgr::forTeam(static_cast<TeamId>(player->GetTeamId()));
-        Channel* senderChannel = cMgr->GetChannel(channel->GetName(), player);
-        if (senderChannel)
-        {
-            auto const& allPlayers = ObjectAccessor::GetPlayers();
-            for (auto const& itr : allPlayers)
-            {
-                Player* candidate = itr.second;
-                if (!candidate->IsInWorld())
-                    continue;
-                ChannelMgr* candidateCM = ChannelMgr::forTeam(static_cast<TeamId>(candidate->GetTeamId()));
-                Channel* candidateChannel = candidateCM->GetChannel(channel->GetName(), candidate);
-                if (candidateChannel && candidateChannel->GetChannelId() == senderChannel->GetChannelId())
-                {
-                    eligibleBots.push_back(candidate);
-                }
-            }
-        }
-    }
-    else
+    // Meter the replies a flood may cause before any listener is gathered
+    // or prompt built. Channel messages count towards their channel, all
+    // others towards the sender's zone.
+    uint64_t senderGuid = player->GetGUID().GetRawValue();
+    uint64_t admissionScope = channel ? (uint64_t(1) << 63) | std::hash<std::string>{}(channel->GetName()) : player->GetZoneId();
+    uint32_t admitted = g_ChatAdmission.available(senderGuid, admissionScope);
+    if (admitted == 0)
     {
-        auto const& allPlayers = ObjectAccessor::GetPlayers();
-        for (auto const& itr : allPlayers)
+        if(g_DebugEnabled)
         {
-            Player* candidate = itr.second;
-            if (candidate->IsInWorld())
-                eligibleBots.push_back(candidate);
+            LOG_INFO("server.loading", "Reply limit reached for {} or their zone/channel, ignoring message.", player->GetName());
         }
+        return;
     }
+
+    PlayerbotAI* senderAI = sPlayerbotsMgr->GetPlayerbotAI(player);
+    bool senderIsBot = (senderAI && senderAI->IsBotAI());
+    
+    std::vector<Player*> eligibleBots = GatherChatListeners(player, sourceLocal);
     
     std::vector<Player*> candidateBots;
     for (Player* bot : eligibleBots)
@@ -570,40 +909,42 @@ void PlayerBotChatHandler::ProcessChat(Player* player, uint32_t /*type*/, uint32
     if (senderIsBot)
     {
         bool realPlayerNearby = false;
-        for (auto const& itr : ObjectAccessor::GetPlayers())
+        std::vector<Player*> realPlayers;
+        g_PlayerIndex.getRealPlayersOnMap(player->GetMap(), realPlayers);
+        for (Player* candidate : realPlayers)
         {
-            Player* candidate = itr.second;
             if (candidate == player)
                 continue;
-            if (!candidate->IsInWorld())
-                continue;
             if (player->GetDistance(candidate) > g_GeneralDistance)
                 continue;
-            if (!sPlayerbotsMgr->GetPlayerbotAI(candidate))
-            {
-                realPlayerNearby = true;
-                break;
-            }
+            realPlayerNearby = true;
+            break;
         }
         if (!realPlayerNearby)
             chance = 0;
     }
     
-    std::vector<Player*> finalCandidates;
+    // Listening bots addressed by name, in the order they were named.
+    std::vector<std::pair<size_t, uint64_t>> mentions;
+    g_PlayerNameIndex.findMentions(msg, mentions);
     std::vector<std::pair<size_t, Player*>> mentionedBots;
-    for (Player* bot : candidateBots)
+    for (const auto& mention : mentions)
     {
-        if (g_DisableRepliesInCombat && bot->IsInCombat())
-            continue;
-        uint32_t roll = urand(0, 99);
-        if (roll < chance)
-            finalCandidates.push_back(bot);
+        for (Player* bot : candidateBots)
+        {
+            if (bot->GetGUID().GetRawValue() == mention.second)
+            {
+                mentionedBots.emplace_back(mention.first, bot);
+                break;
+            }
+        }
     }
+
+    std::vector<Player*> finalCandidates;
+    Player* chosenBot = nullptr;
     if (!mentionedBots.empty())
     {
-        std::sort(mentionedBots.begin(), mentionedBots.end(),
-                  [](auto &a, auto &b) { return a.first < b.first; });
-        Player* chosenBot = mentionedBots.front().second;
+        chosenBot = mentionedBots.front().second;
         finalCandidates.clear();
         if (!senderIsBot)
         {
@@ -628,6 +969,8 @@ void PlayerBotChatHandler::ProcessChat(Player* player, uint32_t /*type*/, uint32
     {
         for (Player* bot : candidateBots)
         {
+            if (g_DisableRepliesInCombat && bot->IsInCombat())
+                continue;
             uint32_t roll = urand(0, 99);
             if (roll < chance)
                 finalCandidates.push_back(bot);
@@ -651,8 +994,18 @@ void PlayerBotChatHandler::ProcessChat(Player* player, uint32_t /*type*/, uint32
         uint32_t countToPick = urand(1, g_MaxBotsToPick);
         finalCandidates.resize(countToPick);
     }
-    
-    uint64_t senderGuid = player->GetGUID().GetRawValue();
+
+    uint32_t wanted = static_cast<uint32_t>(finalCandidates.size());
+    if (finalCandidates.size() > admitted)
+        finalCandidates.resize(admitted);
+    g_ChatAdmission.consume(senderGuid, admissionScope, static_cast<uint32_t>(finalCandidates.size()), wanted);
+
+    // Several bots reacting to the same message can share one request.
+    if (g_BatchBotReplies && finalCandidates.size() > 1)
+    {
+        SubmitBatchedBotReplies(finalCandidates, player, msg, sourceLocal, channelId, senderIsBot);
+        return;
+    }
     
     for (Player* bot : finalCandidates)
     {
@@ -661,86 +1014,323 @@ void PlayerBotChatHandler::ProcessChat(Player* player, uint32_t /*type*/, uint32
         {
             LOG_INFO("server.loading", "Bot {} (distance: {}) is set to respond.", bot->GetName(), distance);
         }
-        std::string prompt = GenerateBotPrompt(bot, msg, player);
+        std::string systemPrompt;
+        std::string prompt = GenerateBotPrompt(bot, msg, player, systemPrompt);
         uint64_t botGuid = bot->GetGUID().GetRawValue();
-        
-        std::thread([botGuid, senderGuid, prompt, sourceLocal, channelId = (channel ? channel->GetChannelId() : 0), msg]() {
-            try {
-                // Use the QueryManager to submit the query.
-                std::future<std::string> responseFuture = SubmitQuery(prompt);
-                std::string response = responseFuture.get();
-
-                // Reacquire pointers by GUID.
-                Player* botPtr = ObjectAccessor::FindPlayer(ObjectGuid(botGuid));
-                Player* senderPtr = ObjectAccessor::FindPlayer(ObjectGuid(senderGuid));
-                if (!botPtr)
-                {
-                    if(g_DebugEnabled)
-                    {
-                        LOG_ERROR("server.loading", "Failed to reacquire bot from GUID {}", botGuid);
-                    }
-                    return;
-                }
-                if (!senderPtr)
-                {
-                    if(g_DebugEnabled)
-                    {
-                        LOG_ERROR("server.loading", "Failed to reacquire sender from GUID {}", senderGuid);
-                    }
-                    return;
-                }
-                if (response.empty())
-                {
-                    if(g_DebugEnabled)
-                    {
-                        LOG_ERROR("server.loading", "Bot {} received empty response from Ollama API.", botPtr->GetName());
-                    }
-                    return;
-                }
-                PlayerbotAI* botAI = sPlayerbotsMgr->GetPlayerbotAI(botPtr);
-                if (!botAI)
-                {
-                    if(g_DebugEnabled)
-                    {
-                        LOG_ERROR("server.loading", "No PlayerbotAI found for bot {}", botPtr->GetName());
-                    }
-                    return;
-                }
-                // Route the response.
-                if (channelId != 0)
-                {
-                    ChatChannelId chanId = static_cast<ChatChannelId>(channelId);
-                    botAI->SayToChannel(response, chanId);
-                }
-                else
-                {
-                    switch (sourceLocal)
-                    {
-                        case SRC_GUILD_LOCAL: botAI->SayToGuild(response); break;
-                        case SRC_PARTY_LOCAL: botAI->SayToParty(response); break;
-                        case SRC_RAID_LOCAL:  botAI->SayToRaid(response); break;
-                        case SRC_SAY_LOCAL:   botAI->Say(response); break;
-                        case SRC_YELL_LOCAL:  botAI->Yell(response); break;
-                        default:              botAI->Say(response); break;
-                    }
-                }
-                AppendBotConversation(botGuid, senderGuid, msg, response);
-                float respDistance = senderPtr->GetDistance(botPtr);
+
+        // Every line the bot says arrives here: the whole reply at once, or
+        // sentence by sentence when streaming is enabled.
+        auto sayChunk = [botGuid, sourceLocal, channelId](const std::string& chunk) {
+            SayBotReply(botGuid, sourceLocal, channelId, chunk);
+        };
+
+        // The QueryManager invokes the callback with the full reply once it is complete.
+        QueryResponseCallback onResponse = [botGuid, senderGuid, msg](const std::string& response) {
+            RecordBotReply(botGuid, senderGuid, msg, response);
+        };
+
+        std::string botName = bot->GetName();
+        bool useCache = g_ResponseCachePlayerReplies && g_ResponseCache.isEnabled();
+        uint64_t cacheKey = ResponseCache::makeKey(prompt, botName, systemPrompt);
+        std::string cachedResponse;
+        if (useCache && g_ResponseCache.lookup(cacheKey, botName, cachedResponse))
+        {
+            // Posted like a fresh reply, so it is said on the world thread
+            // and after the player's own line has gone out.
+            PostToWorldThread([sayChunk = std::move(sayChunk), onResponse = std::move(onResponse),
+                               cachedResponse = std::move(cachedResponse)]() {
+                sayChunk(cachedResponse);
+                onResponse(cachedResponse);
+            });
+            continue;
+        }
+
+        if (useCache)
+        {
+            onResponse = [onResponse = std::move(onResponse), cacheKey, botName](const std::string& response) {
+                if (!response.empty() && !IsQueryErrorReply(response))
+                    g_ResponseCache.store(cacheKey, botName, response);
+                onResponse(response);
+            };
+        }
+        QueryOptions options;
+        options.dedupKey = cacheKey;
+        options.botName = botName;
+        options.priority = GetReplyPriority(senderIsBot, bot == chosenBot);
+        options.ownerGuid = botGuid;
+        options.systemPrompt = std::move(systemPrompt);
+        bool queued = SubmitQuery(std::move(prompt), std::move(onResponse), std::move(sayChunk), std::move(options));
+
+        if (!queued && g_DebugEnabled)
+        {
+            LOG_INFO("server.loading", "Query queue is full, bot {} will not respond.", bot->GetName());
+        }
+    }
+}
+
+// Says one line of a bot reply in the channel the message came from.
+static void SayBotReply(uint64_t botGuid, ChatChannelSourceLocal sourceLocal, uint32_t channelId, const std::string& chunk)
+{
+    try {
+        if (chunk.empty())
+            return;
+        Player* botPtr = ObjectAccessor::FindPlayer(ObjectGuid(botGuid));
+        if (!botPtr)
+        {
+            if(g_DebugEnabled)
+            {
+                LOG_ERROR("server.loading", "Failed to reacquire bot from GUID {}", botGuid);
+            }
+            return;
+        }
+        PlayerbotAI* botAI = sPlayerbotsMgr->GetPlayerbotAI(botPtr);
+        if (!botAI)
+        {
+            if(g_DebugEnabled)
+            {
+                LOG_ERROR("server.loading", "No PlayerbotAI found for bot {}", botPtr->GetName());
+            }
+            return;
+        }
+        // Route the response.
+        if (channelId != 0)
+        {
+            ChatChannelId chanId = static_cast<ChatChannelId>(channelId);
+            botAI->SayToChannel(chunk, chanId);
+        }
+        else
+        {
+            switch (sourceLocal)
+            {
+                case SRC_GUILD_LOCAL: botAI->SayToGuild(chunk); break;
+                case SRC_PARTY_LOCAL: botAI->SayToParty(chunk); break;
+                case SRC_RAID_LOCAL:  botAI->SayToRaid(chunk); break;
+                case SRC_SAY_LOCAL:   botAI->Say(chunk); break;
+                case SRC_YELL_LOCAL:  botAI->Yell(chunk); break;
+                default:              botAI->Say(chunk); break;
+            }
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        if(g_DebugEnabled)
+        {
+            LOG_ERROR("server.loading", "Exception in bot response callback: {}", ex.what());
+        }
+    }
+}
+
+// Adds a complete bot reply to the conversation history.
+static void RecordBotReply(uint64_t botGuid, uint64_t senderGuid, const std::string& msg, const std::string& response)
+{
+    try {
+        // Reacquire pointers by GUID.
+        Player* botPtr = ObjectAccessor::FindPlayer(ObjectGuid(botGuid));
+        Player* senderPtr = ObjectAccessor::FindPlayer(ObjectGuid(senderGuid));
+        if (!botPtr)
+        {
+            if(g_DebugEnabled)
+            {
+                LOG_ERROR("server.loading", "Failed to reacquire bot from GUID {}", botGuid);
+            }
+            return;
+        }
+        if (!senderPtr)
+        {
+            if(g_DebugEnabled)
+            {
+                LOG_ERROR("server.loading", "Failed to reacquire sender from GUID {}", senderGuid);
+            }
+            return;
+        }
+        if (response.empty())
+        {
+            if(g_DebugEnabled)
+            {
+                LOG_ERROR("server.loading", "Bot {} received empty response from Ollama API.", botPtr->GetName());
+            }
+            return;
+        }
+        AppendBotConversation(botGuid, senderGuid, msg, response);
+        float respDistance = senderPtr->GetDistance(botPtr);
+        if(g_DebugEnabled)
+        {
+            LOG_INFO("server.loading", "Bot {} (distance: {}) responded: {}", botPtr->GetName(), respDistance, response);
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        if(g_DebugEnabled)
+        {
+            LOG_ERROR("server.loading", "Exception in bot response callback: {}", ex.what());
+        }
+    }
+}
+
+// Picks the reply of each bot out of a batched completion: a JSON array of
+// {"name": ..., "reply": ...} objects, possibly wrapped in other text.
+// Replies are matched by name, falling back to the position in the array.
+static std::vector<std::string> ParseBatchedReplies(const std::string& response, const std::vector<std::string>& botNames)
+{
+    std::vector<std::string> replies(botNames.size());
+    size_t start = response.find('[');
+    size_t end = response.rfind(']');
+    if (start == std::string::npos || end == std::string::npos || end < start)
+        return replies;
+
+    nlohmann::json parsed = nlohmann::json::parse(response.substr(start, end - start + 1), nullptr, false);
+    if (parsed.is_discarded() || !parsed.is_array())
+        return replies;
+
+    auto sameName = [](const std::string& a, const std::string& b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        });
+    };
+
+    for (size_t i = 0; i < parsed.size(); ++i)
+    {
+        const nlohmann::json& item = parsed[i];
+        std::string name;
+        std::string reply;
+        if (item.is_string())
+            reply = item.get<std::string>();
+        else if (item.is_object())
+        {
+            if (item.contains("name") && item["name"].is_string())
+                name = item["name"].get<std::string>();
+            if (item.contains("reply") && item["reply"].is_string())
+                reply = item["reply"].get<std::string>();
+        }
+        if (reply.empty())
+            continue;
+
+        size_t target = i;
+        for (size_t b = 0; b < botNames.size() && !name.empty(); ++b)
+        {
+            if (sameName(botNames[b], name))
+            {
+                target = b;
+                break;
+            }
+        }
+        if (target < replies.size() && replies[target].empty())
+            replies[target] = reply;
+    }
+    return replies;
+}
+
+// Scheduling class of a reply: bots addressed by name by a real player go first.
+static QueryPriority GetReplyPriority(bool senderIsBot, bool mentioned)
+{
+    if (senderIsBot)
+        return QueryPriority::BotToBot;
+    return mentioned ? QueryPriority::DirectMention : QueryPriority::RealPlayer;
+}
+
+// Asks for the replies of all bots in one request and hands each bot its part.
+static void SubmitBatchedBotReplies(const std::vector<Player*>& bots, Player* player, const std::string& msg,
+                                    ChatChannelSourceLocal sourceLocal, uint32_t channelId, bool senderIsBot)
+{
+    std::vector<uint64_t> botGuids;
+    std::vector<std::string> botNames;
+    std::string botNameList;
+    std::string botPrompts;
+    for (Player* bot : bots)
+    {
+        botGuids.push_back(bot->GetGUID().GetRawValue());
+        botNames.push_back(bot->GetName());
+        botNameList += (botNameList.empty() ? "" : ", ") + bot->GetName();
+        // Each bot's instructions differ, so they stay with its part of the prompt.
+        std::string systemPrompt;
+        std::string botPrompt = GenerateBotPrompt(bot, msg, player, systemPrompt);
+        if (systemPrompt.empty())
+            botPrompts += fmt::format("### {}\n{}\n\n", bot->GetName(), botPrompt);
+        else
+            botPrompts += fmt::format("### {}\n{}\n{}\n\n", bot->GetName(), systemPrompt, botPrompt);
+    }
+
+    std::string prompt = g_CompiledBatchPrompt.render({
+        std::to_string(bots.size()), botNameList, player->GetName(), msg, botPrompts });
+
+    if(g_DebugEnabled)
+    {
+        LOG_INFO("server.loading", "Batching replies of {} bots into one request.", bots.size());
+    }
+
+    // A bot addressed by name replies alone, so nobody in a batch was.
+    QueryOptions options;
+    options.priority = GetReplyPriority(senderIsBot, false);
+
+    uint64_t senderGuid = player->GetGUID().GetRawValue();
+    bool queued = SubmitQuery(std::move(prompt), [botGuids, botNames, senderGuid, msg, sourceLocal, channelId](const std::string& response) {
+        // A failed request is reported by one bot rather than all of them.
+        if (IsQueryErrorReply(response))
+        {
+            SayBotReply(botGuids.front(), sourceLocal, channelId, response);
+            return;
+        }
+
+        std::vector<std::string> replies = ParseBatchedReplies(response, botNames);
+        for (size_t i = 0; i < botGuids.size(); ++i)
+        {
+            if (replies[i].empty())
+            {
                 if(g_DebugEnabled)
                 {
-                    LOG_INFO("server.loading", "Bot {} (distance: {}) responded: {}", botPtr->GetName(), respDistance, response);
+                    LOG_INFO("server.loading", "Batched response has no reply for bot {}.", botNames[i]);
                 }
+                continue;
             }
-            catch (const std::exception& ex)
+            SayBotReply(botGuids[i], sourceLocal, channelId, replies[i]);
+            RecordBotReply(botGuids[i], senderGuid, msg, replies[i]);
+        }
+    }, nullptr, options);
+
+    if (!queued && g_DebugEnabled)
+    {
+        LOG_INFO("server.loading", "Query queue is full, {} bots will not respond.", bots.size());
+    }
+}
+
+// Collects the players that can hear a message of the given source, looking
+// only at the sender's group, guild or surroundings.
+// IsBotEligibleForChatChannelLocal then applies the exact rules.
+static std::vector<Player*> GatherChatListeners(Player* player, ChatChannelSourceLocal source)
+{
+    std::vector<Player*> listeners;
+    float range = 0.0f;
+    switch (source)
+    {
+        case SRC_PARTY_LOCAL:
+        case SRC_RAID_LOCAL:
+            if (Group* group = player->GetGroup())
             {
-                if(g_DebugEnabled)
+                for (GroupReference* ref = group->GetFirstMember(); ref; ref = ref->next())
                 {
-                    LOG_ERROR("server.loading", "Exception in bot response thread: {}", ex.what());
+                    Player* member = ref->GetSource();
+                    if (member && member->IsInWorld())
+                        listeners.push_back(member);
                 }
             }
-        }).detach();
-
+            return listeners;
+        case SRC_GUILD_LOCAL:
+            if (player->GetGuildId())
+                g_PlayerIndex.getBotsInGuild(player->GetGuildId(), listeners);
+            return listeners;
+        case SRC_SAY_LOCAL:     range = g_SayDistance;     break;
+        case SRC_YELL_LOCAL:    range = g_YellDistance;    break;
+        case SRC_GENERAL_LOCAL: range = g_GeneralDistance; break;
+        default:
+            return listeners;
     }
+
+    // A range of 0 means no distance limit.
+    if (range > 0.0f && player->IsInWorld())
+        GetPlayersInRange(player, range, listeners);
+    else
+        g_PlayerIndex.getBots(listeners);
+    return listeners;
 }
 
 static bool IsBotEligibleForChatChannelLocal(Player* bot, Player* player, ChatChannelSourceLocal source, Channel* channel)
@@ -782,30 +1372,30 @@ static bool IsBotEligibleForChatChannelLocal(Player* bot, Player* player, ChatCh
     }
 }
 
-std::string GenerateBotPrompt(Player* bot, std::string playerMessage, Player* player)
+// Builds the reply prompt, and in systemPrompt the static instructions that
+// depend only on the bot's personality.
+std::string GenerateBotPrompt(Player* bot, std::string playerMessage, Player* player, std::string& systemPrompt)
 {  
     PlayerbotAI* botAI = sPlayerbotsMgr->GetPlayerbotAI(bot);
-
-    AreaTableEntry const* botCurrentArea = botAI->GetCurrentArea();
-    AreaTableEntry const* botCurrentZone = botAI->GetCurrentZone();
+    std::shared_ptr<const BotPromptContext> context = GetBotPromptContext(bot, botAI);
 
     uint64_t botGuid                = bot->GetGUID().GetRawValue();
     uint64_t playerGuid             = player->GetGUID().GetRawValue();
 
     std::string personality         = GetBotPersonality(bot);
     std::string personalityPrompt   = GetPersonalityPromptAddition(personality);
+    systemPrompt                    = g_CompiledChatSystemPrompt.render({ personalityPrompt });
     std::string botName             = bot->GetName();
-    uint32_t botLevel               = bot->GetLevel();
-    uint8_t botGenderByte           = bot->getGender();
-    std::string botAreaName         = botCurrentArea ? botAI->GetLocalizedAreaName(botCurrentArea): "UnknownArea";
-    std::string botZoneName         = botCurrentZone ? botAI->GetLocalizedAreaName(botCurrentZone): "UnknownZone";
-    std::string botMapName          = bot->GetMap() ? bot->GetMap()->GetMapName() : "UnknownMap";
-    std::string botClass            = botAI->GetChatHelper()->FormatClass(bot->getClass());
-    std::string botRace             = botAI->GetChatHelper()->FormatRace(bot->getRace());
-    std::string botRole             = ChatHelper::FormatClass(bot, AiFactory::GetPlayerSpecTab(bot));
-    std::string botGender           = (botGenderByte == 0 ? "Male" : "Female");
-    std::string botFaction          = (bot->GetTeamId() == TEAM_ALLIANCE ? "Alliance" : "Horde");
-    std::string botGuild            = (bot->GetGuild() ? bot->GetGuild()->GetName() : "No Guild");
+    uint32_t botLevel               = context->level;
+    const std::string& botAreaName  = context->areaName;
+    const std::string& botZoneName  = context->zoneName;
+    const std::string& botMapName   = context->mapName;
+    const std::string& botClass     = context->className;
+    const std::string& botRace      = context->raceName;
+    const std::string& botRole      = context->role;
+    const std::string& botGender    = context->gender;
+    const std::string& botFaction   = context->faction;
+    const std::string& botGuild     = context->guildName;
     std::string botGroupStatus      = (bot->GetGroup() ? "In a group" : "Solo");
     uint32_t botGold                = bot->GetMoney() / 10000;
 
@@ -822,47 +1412,76 @@ std::string GenerateBotPrompt(Player* bot, std::string playerMessage, Player* pl
     uint32_t playerGold             = player->GetMoney() / 10000;
     float playerDistance            = player->IsInWorld() && bot->IsInWorld() ? player->GetDistance(bot) : -1.0f;
 
-    std::string chatHistory         = GetBotHistoryPrompt(botGuid, playerGuid, playerMessage);
-
-    std::string extraInfo = fmt::format(
-        g_ChatExtraInfoTemplate,
-        fmt::arg("bot_race", botRace),
-        fmt::arg("bot_gender", botGender),
-        fmt::arg("bot_role", botRole),
-        fmt::arg("bot_faction", botFaction),
-        fmt::arg("bot_guild", botGuild),
-        fmt::arg("bot_group_status", botGroupStatus),
-        fmt::arg("bot_gold", botGold),
-        fmt::arg("player_race", playerRace),
-        fmt::arg("player_gender", playerGender),
-        fmt::arg("player_role", playerRole),
-        fmt::arg("player_faction", playerFaction),
-        fmt::arg("player_guild", playerGuild),
-        fmt::arg("player_group_status", playerGroupStatus),
-        fmt::arg("player_gold", playerGold),
-        fmt::arg("player_distance", playerDistance),
-        fmt::arg("bot_area", botAreaName),
-        fmt::arg("bot_zone", botZoneName),
-        fmt::arg("bot_map", botMapName)
-    );
-    
-    std::string prompt = fmt::format(
-        g_ChatPromptTemplate,
-        fmt::arg("bot_name", botName),
-        fmt::arg("bot_level", botLevel),
-        fmt::arg("bot_class", botClass),
-        fmt::arg("bot_personality", personalityPrompt),
-        fmt::arg("player_level", playerLevel),
-        fmt::arg("player_class", playerClass),
-        fmt::arg("player_name", playerName),
-        fmt::arg("player_message", playerMessage),
-        fmt::arg("extra_info", extraInfo)
-    );
+    BotHistoryPrompt history        = GetBotHistoryPrompt(botGuid, playerGuid, playerMessage);
 
+    std::string botGoldText         = std::to_string(botGold);
+    std::string playerGoldText      = std::to_string(playerGold);
+    std::string playerDistanceText  = fmt::format("{}", playerDistance);
+    std::string extraInfo = g_CompiledChatExtraInfo.render({
+        botRace, botGender, botRole, botFaction, botGuild, botGroupStatus, botGoldText,
+        playerRace, playerGender, playerRole, playerFaction, playerGuild, playerGroupStatus, playerGoldText,
+        playerDistanceText, botAreaName, botZoneName, botMapName });
+
+    std::string botLevelText        = std::to_string(botLevel);
+    std::string playerLevelText     = std::to_string(playerLevel);
+
+    BotSnapshotPrompt snapshot;
     if(g_EnableChatBotSnapshotTemplate)
     {
-        prompt += GenerateBotGameStateSnapshot(bot);
+        snapshot = GenerateBotGameStateSnapshot(bot);
     }
 
+    auto buildPrompt = [&]() {
+        std::string chatHistory = history.join();
+        std::string prompt = g_CompiledChatPrompt.render({
+            botName, botLevelText, botClass, personalityPrompt, playerLevelText, playerClass,
+            playerName, playerMessage, extraInfo, chatHistory });
+
+        // Templates without {chat_history} get the history after the prompt.
+        if (!g_CompiledChatPrompt.usesPlaceholder(CHAT_PROMPT_CHAT_HISTORY) && !chatHistory.empty())
+        {
+            prompt += "\n";
+            prompt += chatHistory;
+        }
+
+        if(g_EnableChatBotSnapshotTemplate)
+        {
+            prompt += snapshot.render(*context);
+        }
+        return prompt;
+    };
+
+    std::string prompt = buildPrompt();
+    if (g_PromptTokenBudget == 0)
+        return prompt;
+
+    // The system message counts against the budget too; only this prompt can be trimmed.
+    size_t systemTokens = EstimatePromptTokens(systemPrompt) + EstimatePromptTokens(g_OpenRouterSystemPrompt);
+    size_t budget = g_PromptTokenBudget > systemTokens ? g_PromptTokenBudget - systemTokens : 0;
+    size_t tokens = EstimatePromptTokens(prompt);
+    if (tokens <= budget)
+        return prompt;
+
+    // Least useful first: distant objects, distant players, the oldest turns,
+    // then the summary of older conversations.
+    size_t excess = tokens - budget;
+    size_t freed = ChatHandler_TrimPromptEntries(snapshot.los, excess, false);
+    if (freed < excess)
+        freed += ChatHandler_TrimPromptEntries(snapshot.players, excess - freed, false);
+    if (freed < excess)
+        freed += ChatHandler_TrimPromptEntries(history.lines, excess - freed, true);
+    if (freed < excess && !history.summary.empty())
+    {
+        freed += EstimatePromptTokens(history.summary);
+        history.summary.clear();
+    }
+
+    prompt = buildPrompt();
+    if (g_DebugEnabled)
+    {
+        size_t trimmed = EstimatePromptTokens(prompt);
+        LOG_INFO("server.loading", "Trimmed the prompt for bot {} from about {} to {} tokens (budget {}, {} of them system message).",
+                 botName, tokens, trimmed, g_PromptTokenBudget, systemTokens);
+    }
     return prompt;
 }
\ No newline at end of file
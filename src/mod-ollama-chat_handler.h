@@ -3,6 +3,9 @@
 
 #include "ScriptMgr.h"
 #include <string>
+#include <vector>
+
+struct PendingHistoryRow;
 
 enum ChatChannelSourceLocal
 {
@@ -21,6 +24,10 @@ std::string rtrim(const std::string& s);
 ChatChannelSourceLocal GetChannelSourceLocal(uint32_t type);
 
 void SaveBotConversationHistoryToDB();
+// The statements that save the rows, escaping their chat text in place.
+std::vector<std::string> BuildHistorySaveStatements(std::vector<PendingHistoryRow>& rows);
+// Lazy history mode: loads requested pairs and evicts idle ones. World thread only.
+void UpdateBotConversationHistory();
 
 class PlayerBotChatHandler : public PlayerScript
 {
@@ -29,6 +36,9 @@ public:
     void OnPlayerChat(Player* player, uint32_t type, uint32_t lang, std::string& msg) override;
     void OnPlayerChat(Player* player, uint32_t type, uint32_t lang, std::string& msg, Group* group) override;
     void OnPlayerChat(Player* player, uint32_t type, uint32_t lang, std::string& msg, Channel* channel) override;
+    void OnPlayerLogin(Player* player) override;
+    void OnPlayerLogout(Player* player) override;
+    void OnPlayerMapChanged(Player* player) override;
 
 private:
     void ProcessChat(Player* player, uint32_t type, uint32_t lang, std::string& msg, ChatChannelSourceLocal sourceLocal, Channel* channel = nullptr);
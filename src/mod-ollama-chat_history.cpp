@@ -0,0 +1,266 @@
+#include "mod-ollama-chat_history.h"
+#include <algorithm>
+#include <iterator>
+
+ConversationHistoryStore g_ConversationHistory;
+
+void ConversationHistoryStore::Turn::assign(std::string_view playerMessage, std::string_view botReply)
+{
+    // assign() and append() keep the buffer's capacity, so a reused slot
+    // only allocates when the new turn is longer than any it held before.
+    text.assign(playerMessage.data(), playerMessage.size());
+    text.append(botReply.data(), botReply.size());
+    replyOffset = static_cast<uint32_t>(playerMessage.size());
+}
+
+void ConversationHistoryStore::PairHistory::setCapacity(uint32_t newCapacity)
+{
+    if (ring.size() == newCapacity)
+        return;
+
+    // Keep the newest turns, oldest first.
+    std::vector<Turn> resized;
+    resized.reserve(newCapacity);
+    uint32_t keep = std::min(count, newCapacity);
+    for (uint32_t i = count - keep; i < count; ++i)
+    {
+        resized.push_back(std::move(ring[(start + i) % ring.size()]));
+    }
+    resized.resize(newCapacity);
+    ring.swap(resized);
+    start = 0;
+    count = keep;
+}
+
+void ConversationHistoryStore::PairHistory::push(std::string_view playerMessage, std::string_view botReply,
+                                                 uint32_t capacity, bool keepDropped)
+{
+    setCapacity(capacity);
+    if (ring.empty())
+        return;
+
+    if (keepDropped && count == ring.size())
+    {
+        const Turn& oldest = ring[start];
+        dropped.emplace_back(std::string(oldest.playerMessage()), std::string(oldest.botReply()));
+    }
+
+    if (count < ring.size())
+    {
+        ring[(start + count) % ring.size()].assign(playerMessage, botReply);
+        ++count;
+    }
+    else
+    {
+        ring[start].assign(playerMessage, botReply);
+        start = (start + 1) % ring.size();
+    }
+}
+
+void ConversationHistoryStore::setCapacity(uint32_t turns)
+{
+    capacity = turns;
+}
+
+void ConversationHistoryStore::append(uint64_t botGuid, uint64_t playerGuid, std::string_view playerMessage,
+                                      std::string_view botReply, bool recordPending)
+{
+    uint32_t batch = summaryBatch;
+    Shard& shard = shardFor(botGuid);
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    PairHistory& history = shard.pairs[{ botGuid, playerGuid }];
+    history.push(playerMessage, botReply, capacity, batch > 0);
+    if (batch > 0 && !history.summaryPending && history.dropped.size() >= batch)
+    {
+        history.summaryPending = true;
+        shard.summaryReady.emplace_back(botGuid, playerGuid);
+    }
+    if (recordPending)
+    {
+        shard.pending.push_back({ botGuid, playerGuid, time(nullptr), std::string(playerMessage), std::string(botReply) });
+    }
+}
+
+bool ConversationHistoryStore::forEachTurn(uint64_t botGuid, uint64_t playerGuid, const TurnVisitor& visit,
+                                           std::string* summary) const
+{
+    const Shard& shard = shardFor(botGuid);
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    auto it = shard.pairs.find({ botGuid, playerGuid });
+    if (it == shard.pairs.end() || it->second.count == 0)
+        return false;
+
+    const PairHistory& history = it->second;
+    for (uint32_t i = 0; i < history.count; ++i)
+    {
+        const Turn& turn = history.at(i);
+        visit(turn.playerMessage(), turn.botReply());
+    }
+    if (summary)
+        *summary = history.summary;
+    return true;
+}
+
+void ConversationHistoryStore::clear()
+{
+    for (Shard& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        shard.pairs.clear();
+        shard.summaryReady.clear();
+    }
+}
+
+std::vector<PendingHistoryRow> ConversationHistoryStore::takePendingRows()
+{
+    std::vector<PendingHistoryRow> rows;
+    for (Shard& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        if (rows.empty())
+        {
+            rows.swap(shard.pending);
+            continue;
+        }
+        rows.insert(rows.end(), std::make_move_iterator(shard.pending.begin()), std::make_move_iterator(shard.pending.end()));
+        shard.pending.clear();
+    }
+    return rows;
+}
+
+bool ConversationHistoryStore::touch(uint64_t botGuid, uint64_t playerGuid, time_t now)
+{
+    Shard& shard = shardFor(botGuid);
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    auto [it, inserted] = shard.pairs.try_emplace({ botGuid, playerGuid });
+    it->second.lastUsed = now;
+    if (inserted)
+        it->second.loaded = false;
+    return inserted;
+}
+
+void ConversationHistoryStore::mergeLoaded(uint64_t botGuid, uint64_t playerGuid, std::vector<std::pair<std::string, std::string>> turns)
+{
+    Shard& shard = shardFor(botGuid);
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    PairHistory& history = shard.pairs[{ botGuid, playerGuid }];
+
+    // Turns added while the query ran are newer than anything loaded, unless
+    // they were saved before it ran and are among the loaded ones already.
+    for (uint32_t i = 0; i < history.count; ++i)
+    {
+        const Turn& turn = history.at(i);
+        auto same = [&turn](const std::pair<std::string, std::string>& loaded) {
+            return loaded.first == turn.playerMessage() && loaded.second == turn.botReply();
+        };
+        if (std::none_of(turns.begin(), turns.end(), same))
+            turns.emplace_back(std::string(turn.playerMessage()), std::string(turn.botReply()));
+    }
+
+    PairHistory merged;
+    merged.lastUsed = history.lastUsed;
+    merged.summary = std::move(history.summary);
+    merged.dropped = std::move(history.dropped);
+    merged.summaryPending = history.summaryPending;
+    for (const auto& [playerMessage, botReply] : turns)
+    {
+        merged.push(playerMessage, botReply, capacity, false);
+    }
+    history = std::move(merged);
+}
+
+size_t ConversationHistoryStore::evictIdle(time_t now, uint32_t idleSeconds, time_t lastSave)
+{
+    size_t evicted = 0;
+    for (Shard& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        for (auto it = shard.pairs.begin(); it != shard.pairs.end();)
+        {
+            const PairHistory& history = it->second;
+            bool idle = difftime(now, history.lastUsed) >= idleSeconds;
+            if (history.loaded && idle && history.lastUsed < lastSave)
+            {
+                it = shard.pairs.erase(it);
+                ++evicted;
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    return evicted;
+}
+
+void ConversationHistoryStore::setSummaryBatch(uint32_t batch)
+{
+    summaryBatch = batch;
+}
+
+std::vector<HistorySummaryRequest> ConversationHistoryStore::takeSummaryRequests()
+{
+    std::vector<HistorySummaryRequest> requests;
+    for (Shard& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        for (const auto& key : shard.summaryReady)
+        {
+            // The pair may have been evicted or cleared since.
+            auto it = shard.pairs.find(key);
+            if (it == shard.pairs.end())
+                continue;
+
+            PairHistory& history = it->second;
+            requests.push_back({ key.first, key.second, history.summary, std::move(history.dropped) });
+            history.dropped.clear();
+        }
+        shard.summaryReady.clear();
+    }
+    return requests;
+}
+
+void ConversationHistoryStore::finishSummary(uint64_t botGuid, uint64_t playerGuid, std::string summary)
+{
+    uint32_t batch = summaryBatch;
+    Shard& shard = shardFor(botGuid);
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    auto it = shard.pairs.find({ botGuid, playerGuid });
+    if (it == shard.pairs.end())
+        return;
+
+    PairHistory& history = it->second;
+    if (!summary.empty())
+        history.summary = std::move(summary);
+    history.summaryPending = false;
+    // Turns dropped while the summary was being written start the next one.
+    if (batch > 0 && history.dropped.size() >= batch)
+    {
+        history.summaryPending = true;
+        shard.summaryReady.emplace_back(botGuid, playerGuid);
+    }
+}
+
+void ConversationHistoryStore::finishSummary(uint64_t botGuid, uint64_t playerGuid,
+                                             std::vector<std::pair<std::string, std::string>> turns)
+{
+    uint32_t batch = summaryBatch;
+    Shard& shard = shardFor(botGuid);
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    auto it = shard.pairs.find({ botGuid, playerGuid });
+    if (it == shard.pairs.end())
+        return;
+
+    PairHistory& history = it->second;
+    history.summaryPending = false;
+    if (batch == 0)
+        return;
+    turns.insert(turns.end(), std::make_move_iterator(history.dropped.begin()), std::make_move_iterator(history.dropped.end()));
+    // While the provider keeps failing, only the newest turns are kept.
+    size_t keep = static_cast<size_t>(batch) * MAX_SUMMARY_BACKLOG_BATCHES;
+    if (turns.size() > keep)
+        turns.erase(turns.begin(), turns.end() - keep);
+    history.dropped = std::move(turns);
+    // Not handed out again right away: the next turn pushed out of the ring
+    // starts the retry, so a failing provider is not asked every update.
+}
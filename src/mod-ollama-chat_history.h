@@ -0,0 +1,139 @@
+#ifndef MOD_OLLAMA_CHAT_HISTORY_H
+#define MOD_OLLAMA_CHAT_HISTORY_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A history turn added since the last save.
+struct PendingHistoryRow
+{
+    uint64_t botGuid;
+    uint64_t playerGuid;
+    time_t timestamp;
+    std::string playerMessage;
+    std::string botReply;
+};
+
+// Turns pushed out of a pair's history, to be folded into its summary.
+struct HistorySummaryRequest
+{
+    uint64_t botGuid;
+    uint64_t playerGuid;
+    std::string summary;    // the current summary, empty if there is none yet
+    std::vector<std::pair<std::string, std::string>> turns;
+};
+
+// In-memory conversation history of every bot/player pair.
+// Pairs are spread over shards by bot GUID, each with its own lock, so chat
+// threads talking to different bots do not wait for each other. Every pair
+// keeps its last turns in a fixed-capacity ring; a turn is stored as one
+// buffer holding both messages, and a slot's buffer is reused when the ring
+// wraps over it.
+class ConversationHistoryStore {
+public:
+    using TurnVisitor = std::function<void(std::string_view playerMessage, std::string_view botReply)>;
+
+    // Turns kept per pair. Rings of existing pairs adapt on their next append.
+    void setCapacity(uint32_t turns);
+
+    // Adds a turn, dropping the oldest one if the ring is full. With
+    // recordPending the turn is also queued for the next save.
+    void append(uint64_t botGuid, uint64_t playerGuid, std::string_view playerMessage,
+                std::string_view botReply, bool recordPending);
+    // Calls visit for every turn of the pair, oldest first, under the shard lock,
+    // and copies its rolling summary to summary if given. Returns false if the
+    // pair has no turns.
+    bool forEachTurn(uint64_t botGuid, uint64_t playerGuid, const TurnVisitor& visit,
+                     std::string* summary = nullptr) const;
+    void clear();
+
+    // Hands over the turns queued for saving since the last call.
+    std::vector<PendingHistoryRow> takePendingRows();
+
+    // Lazy loading: marks the pair as used. Returns true the first time, when
+    // its stored history should be loaded.
+    bool touch(uint64_t botGuid, uint64_t playerGuid, time_t now);
+    // Puts the loaded turns (oldest first) in front of the ones added since the
+    // pair was first used, skipping turns already present.
+    void mergeLoaded(uint64_t botGuid, uint64_t playerGuid, std::vector<std::pair<std::string, std::string>> turns);
+    // Drops loaded pairs unused for idleSeconds, unless they were used after
+    // lastSave and may still have unsaved turns. Returns the number dropped.
+    size_t evictIdle(time_t now, uint32_t idleSeconds, time_t lastSave);
+
+    // Rolling summary: turns a full ring pushes out are set aside, and once
+    // batch of them have gathered the pair is handed out by
+    // takeSummaryRequests(). 0 turns summaries off.
+    void setSummaryBatch(uint32_t batch);
+    // Pairs ready to be summarized. Each stays out of later calls until its
+    // finishSummary().
+    std::vector<HistorySummaryRequest> takeSummaryRequests();
+    // Stores the new summary of the pair; an empty one keeps the old summary.
+    void finishSummary(uint64_t botGuid, uint64_t playerGuid, std::string summary);
+    // The summary request failed: its turns go back in front of the ones
+    // dropped since, and the next request covers them.
+    void finishSummary(uint64_t botGuid, uint64_t playerGuid, std::vector<std::pair<std::string, std::string>> turns);
+
+private:
+    struct Turn {
+        std::string text;       // player message followed by the bot reply
+        uint32_t replyOffset = 0;
+
+        std::string_view playerMessage() const { return std::string_view(text).substr(0, replyOffset); }
+        std::string_view botReply() const { return std::string_view(text).substr(replyOffset); }
+        void assign(std::string_view playerMessage, std::string_view botReply);
+    };
+
+    struct PairHistory {
+        std::vector<Turn> ring;
+        uint32_t start = 0;     // index of the oldest turn
+        uint32_t count = 0;
+        bool loaded = true;     // false while a lazy load is outstanding
+        time_t lastUsed = 0;
+        std::string summary;
+        std::vector<std::pair<std::string, std::string>> dropped; // pushed out since the last summary request
+        bool summaryPending = false;
+
+        const Turn& at(uint32_t i) const { return ring[(start + i) % ring.size()]; }
+        // With keepDropped, a turn pushed out of a full ring goes to dropped.
+        void push(std::string_view playerMessage, std::string_view botReply, uint32_t capacity, bool keepDropped);
+        void setCapacity(uint32_t capacity);
+    };
+
+    struct PairKeyHash {
+        size_t operator()(const std::pair<uint64_t, uint64_t>& key) const
+        {
+            return std::hash<uint64_t>{}(key.first * 0x9E3779B97F4A7C15ULL ^ key.second);
+        }
+    };
+
+    struct Shard {
+        mutable std::mutex mutex_;
+        std::unordered_map<std::pair<uint64_t, uint64_t>, PairHistory, PairKeyHash> pairs;
+        std::vector<PendingHistoryRow> pending;
+        std::vector<std::pair<uint64_t, uint64_t>> summaryReady;
+    };
+
+    static constexpr size_t SHARD_COUNT = 16;
+    // Batches of turns a pair keeps for its summary while requests fail.
+    static constexpr size_t MAX_SUMMARY_BACKLOG_BATCHES = 4;
+
+    Shard& shardFor(uint64_t botGuid) { return shards[std::hash<uint64_t>{}(botGuid) % SHARD_COUNT]; }
+    const Shard& shardFor(uint64_t botGuid) const { return shards[std::hash<uint64_t>{}(botGuid) % SHARD_COUNT]; }
+
+    std::array<Shard, SHARD_COUNT> shards;
+    std::atomic<uint32_t> capacity{5};
+    std::atomic<uint32_t> summaryBatch{0};
+};
+
+extern ConversationHistoryStore g_ConversationHistory;
+
+#endif // MOD_OLLAMA_CHAT_HISTORY_H
@@ -0,0 +1,164 @@
+#include "mod-ollama-chat_httpmulti.h"
+#include "mod-ollama-chat_config.h"
+#include "Log.h"
+#include <chrono>
+
+// Upper bound for one curl_multi_poll call; also bounds how late new
+// transfers are picked up on cURL versions without curl_multi_wakeup.
+static constexpr int MULTI_POLL_TIMEOUT_MS = 100;
+// Pause when curl_multi_wait had no socket to wait on and returned at once.
+static constexpr int MULTI_IDLE_WAIT_MS = 10;
+
+HttpMultiClient::HttpMultiClient()
+    : multi(nullptr), stopping(false)
+{
+}
+
+HttpMultiClient::~HttpMultiClient()
+{
+    stop();
+}
+
+bool HttpMultiClient::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (multi)
+        return true;
+
+    multi = curl_multi_init();
+    if (!multi)
+    {
+        LOG_ERROR("server.loading", "[OpenRouter Chat] Failed to create cURL multi handle.");
+        return false;
+    }
+
+    // Requests to the same host share connections, multiplexed over HTTP/2 where possible.
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    stopping = false;
+    ioThread = std::thread(&HttpMultiClient::ioLoop, this);
+    return true;
+}
+
+void HttpMultiClient::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!multi)
+            return;
+        stopping = true;
+    }
+    wakeup();
+    if (ioThread.joinable())
+        ioThread.join();
+
+    std::vector<PendingTransfer> notStarted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        notStarted.swap(pending);
+    }
+    for (PendingTransfer& transfer : notStarted)
+        transfer.done(transfer.easy, CURLE_ABORTED_BY_CALLBACK);
+
+    for (auto& [easy, done] : active)
+    {
+        curl_multi_remove_handle(multi, easy);
+        done(easy, CURLE_ABORTED_BY_CALLBACK);
+    }
+    active.clear();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    curl_multi_cleanup(multi);
+    multi = nullptr;
+}
+
+bool HttpMultiClient::addTransfer(CURL* easy, TransferDone done)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!multi || stopping)
+            return false;
+        pending.push_back({ easy, std::move(done) });
+    }
+    wakeup();
+    return true;
+}
+
+void HttpMultiClient::wakeup()
+{
+#if LIBCURL_VERSION_NUM >= 0x074400 // 7.68.0
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (multi)
+        curl_multi_wakeup(multi);
+#else
+    idle_.notify_one();
+#endif
+}
+
+void HttpMultiClient::ioLoop()
+{
+    std::vector<PendingTransfer> toAdd;
+    while (!stopping)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            toAdd.swap(pending);
+        }
+        for (PendingTransfer& transfer : toAdd)
+        {
+            CURLMcode rc = curl_multi_add_handle(multi, transfer.easy);
+            if (rc != CURLM_OK)
+            {
+                if (g_DebugEnabled)
+                {
+                    LOG_INFO("server.loading", "Failed to add transfer to cURL multi handle: {}", curl_multi_strerror(rc));
+                }
+                transfer.done(transfer.easy, CURLE_FAILED_INIT);
+                continue;
+            }
+            active.emplace(transfer.easy, std::move(transfer.done));
+        }
+        toAdd.clear();
+
+        int running = 0;
+        curl_multi_perform(multi, &running);
+
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &queued))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            CURL* easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, easy);
+
+            auto it = active.find(easy);
+            if (it == active.end())
+                continue;
+            TransferDone done = std::move(it->second);
+            active.erase(it);
+            done(easy, result);
+        }
+
+#if LIBCURL_VERSION_NUM >= 0x074400 // 7.68.0
+        curl_multi_poll(multi, nullptr, 0, MULTI_POLL_TIMEOUT_MS, nullptr);
+#else
+        // curl_multi_wait returns at once when there is no socket to wait on,
+        // so an idle thread sleeps until a transfer is added or stop is called.
+        if (active.empty())
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            idle_.wait(lock, [this] { return stopping || !pending.empty(); });
+            continue;
+        }
+        int numfds = 0;
+        curl_multi_wait(multi, nullptr, 0, MULTI_POLL_TIMEOUT_MS, &numfds);
+        if (numfds == 0)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            idle_.wait_for(lock, std::chrono::milliseconds(MULTI_IDLE_WAIT_MS),
+                           [this] { return stopping || !pending.empty(); });
+        }
+#endif
+    }
+}
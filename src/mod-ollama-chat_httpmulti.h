@@ -0,0 +1,49 @@
+#ifndef MOD_OLLAMA_CHAT_HTTPMULTI_H
+#define MOD_OLLAMA_CHAT_HTTPMULTI_H
+
+#include <curl/curl.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Drives any number of concurrent cURL transfers from a single I/O thread
+// using the curl_multi interface.
+class HttpMultiClient {
+public:
+    // Called on the I/O thread once a transfer has finished or was aborted.
+    using TransferDone = std::function<void(CURL* easy, CURLcode result)>;
+
+    HttpMultiClient();
+    ~HttpMultiClient();
+
+    // Starts the I/O thread if it is not running yet.
+    bool start();
+    // Aborts all transfers (their callbacks receive CURLE_ABORTED_BY_CALLBACK) and joins the I/O thread.
+    void stop();
+
+    // Hands a fully configured easy handle to the I/O thread. Thread-safe.
+    bool addTransfer(CURL* easy, TransferDone done);
+
+private:
+    struct PendingTransfer {
+        CURL* easy;
+        TransferDone done;
+    };
+
+    void ioLoop();
+    void wakeup();
+
+    CURLM* multi;
+    std::thread ioThread;
+    std::atomic<bool> stopping;
+    std::mutex mutex_;
+    std::condition_variable idle_;  // wakes the I/O thread where curl_multi_wakeup is missing
+    std::vector<PendingTransfer> pending;
+    std::unordered_map<CURL*, TransferDone> active; // I/O thread only
+};
+
+#endif // MOD_OLLAMA_CHAT_HTTPMULTI_H
@@ -1,12 +1,16 @@
 #include "mod-ollama-chat_config.h"
+#include "mod-ollama-chat_completion.h"
 #include "mod-ollama-chat_handler.h"
 #include "mod-ollama-chat_random.h"
+#include "mod-ollama-chat_command.h"
 #include "Log.h"
 
 void Addmod_ollama_chatScripts()
 {
     new OllamaChatConfigWorldScript();
+    new OllamaChatCompletionWorldScript();
     LOG_INFO("server.loading", "Registering mod-ollama-chat scripts.");
     new PlayerBotChatHandler();
     new OllamaBotRandomChatter();
+    new OllamaChatCommandScript();
 }
@@ -0,0 +1,153 @@
+#include "mod-ollama-chat_metrics.h"
+#include "mod-ollama-chat_admission.h"
+#include "mod-ollama-chat_api.h"
+#include "mod-ollama-chat_cache.h"
+#include "mod-ollama-chat_completion.h"
+#include "mod-ollama-chat_config.h"
+#include "mod-ollama-chat_router.h"
+#include "Log.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include <chrono>
+
+ChatMetrics g_ChatMetrics;
+
+void LatencyHistogram::record(uint64_t micros)
+{
+    uint64_t ms = micros / 1000;
+    size_t bucket = std::lower_bound(BUCKET_BOUNDS_MS.begin(), BUCKET_BOUNDS_MS.end(), ms) - BUCKET_BOUNDS_MS.begin();
+    ++buckets[bucket];
+    totalMicros += micros;
+    ++samples;
+}
+
+double LatencyHistogram::averageMs() const
+{
+    uint64_t n = samples;
+    return n ? static_cast<double>(totalMicros) / n / 1000.0 : 0.0;
+}
+
+uint32_t LatencyHistogram::quantileMs(double q) const
+{
+    uint64_t n = samples;
+    if (n == 0)
+        return 0;
+    uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(q * n + 0.5), 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKET_BOUNDS_MS.size(); ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return BUCKET_BOUNDS_MS[i];
+    }
+    return UINT32_MAX;
+}
+
+const char* QueryErrorTypeName(QueryErrorType type)
+{
+    switch (type)
+    {
+        case QueryErrorType::Local:       return "Local";
+        case QueryErrorType::Network:     return "Network";
+        case QueryErrorType::Timeout:     return "Timeout";
+        case QueryErrorType::RateLimited: return "RateLimited";
+        case QueryErrorType::Auth:        return "Auth";
+        case QueryErrorType::ClientError: return "ClientError";
+        case QueryErrorType::ServerError: return "ServerError";
+        case QueryErrorType::ApiError:    return "ApiError";
+        case QueryErrorType::BadResponse: return "BadResponse";
+        default:                          return "Unknown";
+    }
+}
+
+static std::string FormatQuantile(uint32_t ms)
+{
+    return ms == UINT32_MAX ? fmt::format("> {} ms", LatencyHistogram::BUCKET_BOUNDS_MS.back()) : fmt::format("<= {} ms", ms);
+}
+
+static std::string FormatHistogram(const char* name, const LatencyHistogram& histogram)
+{
+    if (histogram.count() == 0)
+        return fmt::format("{}: no samples", name);
+    return fmt::format("{}: {} samples, avg {:.1f} ms, p50 {}, p95 {}, p99 {}", name, histogram.count(), histogram.averageMs(),
+                       FormatQuantile(histogram.quantileMs(0.50)), FormatQuantile(histogram.quantileMs(0.95)),
+                       FormatQuantile(histogram.quantileMs(0.99)));
+}
+
+std::vector<std::string> FormatChatMetrics()
+{
+    std::vector<std::string> lines;
+
+    std::string queued;
+    size_t queuedTotal = 0;
+    for (size_t cls = 0; cls < QUERY_PRIORITY_COUNT; ++cls)
+    {
+        QueryPriority priority = static_cast<QueryPriority>(cls);
+        size_t count = g_queryManager.getQueuedQueries(priority);
+        queuedTotal += count;
+        queued += fmt::format("{}{} {}", cls ? ", " : "", QueryPriorityName(priority), count);
+    }
+    lines.push_back(fmt::format("Queue: {} queued ({}), peak {}, {} running, {} replies awaiting delivery",
+                                queuedTotal, queued, g_queryManager.getPeakQueuedQueries(),
+                                g_queryManager.getActiveQueries(), g_CompletionQueue.pending()));
+
+    lines.push_back(fmt::format("Concurrency: limit {}, {} retries",
+                                g_queryManager.getConcurrencyLimit(), g_queryManager.getRetriedQueries()));
+    for (std::string& line : g_ChatEndpointRouter.describe())
+        lines.push_back(std::move(line));
+    lines.push_back(FormatHistogram("Queue wait", g_ChatMetrics.queueWait));
+    lines.push_back(FormatHistogram("HTTP total", g_ChatMetrics.total));
+    lines.push_back(FormatHistogram("HTTP first byte", g_ChatMetrics.firstByte));
+    lines.push_back(FormatHistogram("HTTP connect", g_ChatMetrics.connect) +
+                    fmt::format(", {} reused", g_ChatMetrics.reusedConnections.load()));
+    lines.push_back(FormatHistogram("TLS handshake", g_ChatMetrics.tlsHandshake));
+
+    lines.push_back(fmt::format("Tokens: {} prompt ({} cached), {} completion",
+                                g_ChatMetrics.promptTokens.load(), g_ChatMetrics.cachedPromptTokens.load(),
+                                g_ChatMetrics.completionTokens.load()));
+
+    uint64_t hits = g_ResponseCache.getHits();
+    uint64_t lookups = hits + g_ResponseCache.getMisses();
+    lines.push_back(fmt::format("Response cache: {} hits of {} lookups ({:.1f}%), {} entries",
+                                hits, lookups, lookups ? 100.0 * hits / lookups : 0.0, g_ResponseCache.size()));
+
+    std::string errors;
+    for (size_t type = 0; type < QUERY_ERROR_TYPE_COUNT; ++type)
+    {
+        uint64_t count = g_ChatMetrics.errors[type];
+        if (count > 0)
+            errors += fmt::format("{}{} {}", errors.empty() ? "" : ", ", QueryErrorTypeName(static_cast<QueryErrorType>(type)), count);
+    }
+    lines.push_back("Errors: " + (errors.empty() ? std::string("none") : errors));
+
+    std::string dropped;
+    for (size_t cls = 0; cls < QUERY_PRIORITY_COUNT; ++cls)
+    {
+        QueryPriority priority = static_cast<QueryPriority>(cls);
+        dropped += fmt::format("{}{} {}", cls ? ", " : "", QueryPriorityName(priority), g_queryManager.getDroppedQueries(priority));
+    }
+    lines.push_back(fmt::format("Dropped: {}; {} expired, {} past deadline, {} cancelled, {} rejected (queue full), {} coalesced",
+                                dropped, g_queryManager.getExpiredQueries(), g_queryManager.getDeadlineQueries(),
+                                g_queryManager.getCancelledQueries(),
+                                g_queryManager.getRejectedQueries(), g_queryManager.getCoalescedQueries()));
+    lines.push_back(fmt::format("Throttled: {} messages got no reply, {} replies cut from others",
+                                g_ChatAdmission.getThrottledMessages(), g_ChatAdmission.getThrottledReplies()));
+    return lines;
+}
+
+void LogChatMetrics()
+{
+    if (g_MetricsLogInterval == 0)
+        return;
+
+    static std::chrono::steady_clock::time_point lastLog = std::chrono::steady_clock::now();
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastLog < std::chrono::seconds(g_MetricsLogInterval))
+        return;
+    lastLog = now;
+
+    for (const std::string& line : FormatChatMetrics())
+    {
+        LOG_INFO("server.loading", "[OpenRouter Chat] {}", line);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef MOD_OLLAMA_CHAT_METRICS_H
+#define MOD_OLLAMA_CHAT_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Distribution of a duration over fixed millisecond buckets. Lock-free, so
+// query workers and the HTTP I/O thread record without waiting on each other.
+class LatencyHistogram {
+public:
+    static constexpr std::array<uint32_t, 12> BUCKET_BOUNDS_MS = { 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000 };
+
+    void record(uint64_t micros);
+
+    uint64_t count() const { return samples; }
+    double averageMs() const;
+    // Upper bound of the bucket holding the q-quantile, 0 without samples and
+    // UINT32_MAX if it lies past the last bound.
+    uint32_t quantileMs(double q) const;
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKET_BOUNDS_MS.size() + 1> buckets{};
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> totalMicros{0};
+};
+
+// Why a query got an error reply instead of an answer.
+enum class QueryErrorType : uint8_t {
+    Local = 0,      // no API key, or the request or cURL handle could not be set up
+    Network,        // connection, DNS or TLS failure
+    Timeout,
+    RateLimited,    // HTTP 429
+    Auth,           // HTTP 401, 402 or 403
+    ClientError,    // any other HTTP 4xx
+    ServerError,    // HTTP 5xx
+    ApiError,       // error object in the reply or the event stream
+    BadResponse,    // unparsable reply, or one without text
+    Count
+};
+
+constexpr size_t QUERY_ERROR_TYPE_COUNT = static_cast<size_t>(QueryErrorType::Count);
+const char* QueryErrorTypeName(QueryErrorType type);
+
+// Counters of the LLM pipeline since startup. The queue, cache and drop
+// counters live with their owners and are read when the stats are formatted.
+struct ChatMetrics {
+    LatencyHistogram queueWait;     // submission until a worker takes the query
+    LatencyHistogram connect;       // new connections only, DNS included
+    LatencyHistogram tlsHandshake;  // new connections only
+    LatencyHistogram firstByte;
+    LatencyHistogram total;
+    std::atomic<uint64_t> reusedConnections{0};
+    std::atomic<uint64_t> promptTokens{0};
+    std::atomic<uint64_t> cachedPromptTokens{0};
+    std::atomic<uint64_t> completionTokens{0};
+    std::array<std::atomic<uint64_t>, QUERY_ERROR_TYPE_COUNT> errors{};
+
+    void recordError(QueryErrorType type) { ++errors[static_cast<size_t>(type)]; }
+};
+
+extern ChatMetrics g_ChatMetrics;
+
+// Human readable summary, one line per group, for .ollama stats and the log.
+std::vector<std::string> FormatChatMetrics();
+
+// Logs the summary every MetricsLogInterval seconds. World thread only.
+void LogChatMetrics();
+
+#endif // MOD_OLLAMA_CHAT_METRICS_H
@@ -2,69 +2,175 @@
 #include "Player.h"
 #include "PlayerbotMgr.h"
 #include "Log.h"
+#include "DatabaseEnv.h"
 #include "mod-ollama-chat_config.h"
+#include <fmt/core.h>
+#include <chrono>
 #include <random>
 
-// Internal personality map
-std::string GetBotPersonality(Player* bot)
+BotPersonalityStore g_BotPersonalities;
+
+// Checked once by LoadBotPersonalitiesFromDB().
+static bool g_PersonalityTableExists = false;
+
+// Rows per INSERT statement of SaveBotPersonalityAssignments().
+static constexpr size_t PERSONALITY_ROWS_PER_INSERT = 100;
+
+bool BotPersonalityStore::find(uint64_t botGuid, std::string& personality) const
 {
-    uint64_t botGuid = bot->GetGUID().GetRawValue();
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = personalities.find(botGuid);
+    if (it == personalities.end())
+        return false;
+    personality = it->second;
+    return true;
+}
 
-    // If personality already assigned, return it
-    auto it = g_BotPersonalityList.find(botGuid);
-    if (it != g_BotPersonalityList.end())
+std::string BotPersonalityStore::assign(uint64_t botGuid, const std::string& personality, bool persist)
+{
     {
-        if(g_DebugEnabled)
-        {
-            LOG_INFO("server.loading", "Using existing personality '{}' for bot {}", it->second, bot->GetName());
-        }
-        return it->second;
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        auto [it, inserted] = personalities.try_emplace(botGuid, personality);
+        if (!inserted)
+            return it->second;
     }
 
-    // RP personalities disabled or config not loaded
-    if (!g_EnableRPPersonalities || g_PersonalityKeys.empty())
+    if (persist)
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pending.emplace_back(botGuid, personality);
+    }
+    return personality;
+}
+
+void BotPersonalityStore::load(uint64_t botGuid, std::string personality)
+{
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    personalities[botGuid] = std::move(personality);
+}
+
+std::vector<std::pair<uint64_t, std::string>> BotPersonalityStore::takePending()
+{
+    std::vector<std::pair<uint64_t, std::string>> rows;
+    std::lock_guard<std::mutex> lock(pendingMutex_);
+    rows.swap(pending);
+    return rows;
+}
+
+// Load Bot Personalities from Database
+void LoadBotPersonalitiesFromDB()
+{
+    // Let's make sure our user has sourced the required sql file to add the new table
+    QueryResult tableExists = CharacterDatabase.Query("SELECT * FROM information_schema.tables WHERE table_schema = 'acore_characters' AND table_name = 'mod_ollama_chat_personality' LIMIT 1");
+    g_PersonalityTableExists = static_cast<bool>(tableExists);
+    if (!g_PersonalityTableExists)
+    {
+        LOG_ERROR("server.loading", "[OpenRouter Chat] Please source the required database table first");
+        return;
+    }
+
+    QueryResult result = CharacterDatabase.Query("SELECT guid,personality FROM mod_ollama_chat_personality");
+
+    if (!result)
+    {
+        return;
+    }
+    if (result->GetRowCount() == 0)
     {
-        g_BotPersonalityList[botGuid] = "default";
-        return "default";
+        return;
     }
 
-    // Try to load from database if you have persistence
-    if (g_BotPersonalityList.find(botGuid) != g_BotPersonalityList.end())
+    if(g_DebugEnabled)
     {
-        // DB stores string keys now
-        std::string dbPersonality = g_BotPersonalityList[botGuid];
+        LOG_INFO("server.loading", "[OpenRouter Chat] Fetching Bot Personality List into array");
+    }
 
-        if (dbPersonality.empty())
+    do
+    {
+        uint64_t personalityBotGUID = result->Fetch()[0].Get<uint64_t>();
+        std::string personalityKey = result->Fetch()[1].Get<std::string>();
+        g_BotPersonalities.load(personalityBotGUID, std::move(personalityKey));
+    } while (result->NextRow());
+}
+
+// A login storm assigns hundreds of personalities within a few updates;
+// they are written as a few multi-row statements in one transaction, which
+// the database worker thread executes.
+void SaveBotPersonalityAssignments(bool force)
+{
+    static std::chrono::steady_clock::time_point lastSave;
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now - lastSave < std::chrono::seconds(1))
+        return;
+    lastSave = now;
+
+    std::vector<std::pair<uint64_t, std::string>> rows = g_BotPersonalities.takePending();
+    if (rows.empty() || !g_PersonalityTableExists)
+        return;
+
+    CharacterDatabaseTransaction trans = CharacterDatabase.BeginTransaction();
+
+    std::string query;
+    size_t rowsInQuery = 0;
+    for (auto& [botGuid, personality] : rows)
+    {
+        CharacterDatabase.EscapeString(personality);
+
+        if (rowsInQuery == 0)
         {
-            dbPersonality = "default";
+            query = "INSERT IGNORE INTO mod_ollama_chat_personality (guid, personality) VALUES ";
         }
+        else
+        {
+            query += ", ";
+        }
+        query += fmt::format("({}, '{}')", botGuid, personality);
 
-        g_BotPersonalityList[botGuid] = dbPersonality;
-
-        if(g_DebugEnabled)
+        if (++rowsInQuery == PERSONALITY_ROWS_PER_INSERT)
         {
-            LOG_INFO("server.loading", "Using database personality '{}' for bot {}", dbPersonality, bot->GetName());
+            trans->Append(query.c_str());
+            rowsInQuery = 0;
         }
-        return dbPersonality;
+    }
+    if (rowsInQuery > 0)
+    {
+        trans->Append(query.c_str());
     }
 
-    // Otherwise, assign randomly from config
-    uint32 newIdx = urand(0, g_PersonalityKeys.size() - 1);
-    std::string chosenPersonality = g_PersonalityKeys[newIdx];
-    g_BotPersonalityList[botGuid] = chosenPersonality;
+    CharacterDatabase.CommitTransaction(trans);
 
-    // Save to database if schema supports string (recommend TEXT or VARCHAR column for personality)
-    QueryResult tableExists = CharacterDatabase.Query(
-        "SELECT * FROM information_schema.tables WHERE table_schema = 'acore_characters' AND table_name = 'mod_ollama_chat_personality' LIMIT 1;");
-    if (!tableExists)
+    if(g_DebugEnabled)
     {
-        LOG_INFO("server.loading", "[Ollama Chat] Please source the required database table first");
+        LOG_INFO("server.loading", "Saved {} new bot personalities.", rows.size());
     }
-    else
+}
+
+// Internal personality map
+std::string GetBotPersonality(Player* bot)
+{
+    uint64_t botGuid = bot->GetGUID().GetRawValue();
+
+    // If personality already assigned, return it
+    std::string personality;
+    if (g_BotPersonalities.find(botGuid, personality))
     {
-        CharacterDatabase.Execute("INSERT INTO mod_ollama_chat_personality (guid, personality) VALUES ({}, '{}')", botGuid, chosenPersonality);
+        if(g_DebugEnabled)
+        {
+            LOG_INFO("server.loading", "Using existing personality '{}' for bot {}", personality, bot->GetName());
+        }
+        return personality;
     }
 
+    // RP personalities disabled or config not loaded
+    if (!g_EnableRPPersonalities || g_PersonalityKeys.empty())
+    {
+        return g_BotPersonalities.assign(botGuid, "default", false);
+    }
+
+    // Otherwise, assign randomly from config
+    uint32 newIdx = urand(0, g_PersonalityKeys.size() - 1);
+    std::string chosenPersonality = g_BotPersonalities.assign(botGuid, g_PersonalityKeys[newIdx], true);
+
     if(g_DebugEnabled)
     {
         LOG_INFO("server.loading", "Assigned new personality '{}' to bot {}", chosenPersonality, bot->GetName());
@@ -1,12 +1,49 @@
 #ifndef MOD_OLLAMA_CHAT_PERSONALITY_H
 #define MOD_OLLAMA_CHAT_PERSONALITY_H
 
+#include <mutex>
+#include <shared_mutex>
 #include <unordered_map>
 #include <string>
 #include <cstdint>
+#include <utility>
+#include <vector>
 
 class Player; // forward declaration
 
+// Personality key of every bot seen so far. Read for every prompt, written
+// once per bot, so readers share the lock. New assignments are queued and
+// saved in batches by SaveBotPersonalityAssignments().
+class BotPersonalityStore {
+public:
+    // Returns false if the bot has no personality yet.
+    bool find(uint64_t botGuid, std::string& personality) const;
+    // Gives the bot the personality unless another thread did first, and
+    // returns the one it ends up with. Only a new persisted assignment is
+    // queued for saving.
+    std::string assign(uint64_t botGuid, const std::string& personality, bool persist);
+    // Stores a personality loaded from the database.
+    void load(uint64_t botGuid, std::string personality);
+
+    // Hands over the assignments queued since the last call.
+    std::vector<std::pair<uint64_t, std::string>> takePending();
+
+private:
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<uint64_t, std::string> personalities;
+
+    std::mutex pendingMutex_;
+    std::vector<std::pair<uint64_t, std::string>> pending;
+};
+
+extern BotPersonalityStore g_BotPersonalities;
+
+// Loads the stored personalities and checks once whether their table exists.
+void LoadBotPersonalitiesFromDB();
+
+// Writes the queued personality assignments, at most once a second. World thread only.
+void SaveBotPersonalityAssignments(bool force = false);
+
 // Returns the personality key (as a string) assigned to the given bot.
 // Will randomly assign from the loaded config if not yet set.
 std::string GetBotPersonality(Player* bot);
@@ -0,0 +1,209 @@
+#include "mod-ollama-chat_playerindex.h"
+#include "Player.h"
+#include "PlayerbotMgr.h"
+#include "ObjectAccessor.h"
+#include "GridNotifiersImpl.h"
+#include "CellImpl.h"
+#include "Map.h"
+#include "GridNotifiers.h"
+#include <algorithm>
+#include <cctype>
+#include <list>
+
+PlayerIndex g_PlayerIndex;
+PlayerNameIndex g_PlayerNameIndex;
+
+void PlayerIndex::invalidate()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stale = true;
+}
+
+void PlayerIndex::refresh()
+{
+    if (!stale)
+        return;
+
+    bots.clear();
+    realPlayers.clear();
+    botsByGuild.clear();
+    for (auto const& itr : ObjectAccessor::GetPlayers())
+    {
+        Player* player = itr.second;
+        if (!player || !player->IsInWorld())
+            continue;
+        if (!sPlayerbotsMgr->GetPlayerbotAI(player))
+        {
+            realPlayers.push_back(player);
+            continue;
+        }
+        bots.push_back(player);
+        if (uint32_t guildId = player->GetGuildId())
+            botsByGuild[guildId].push_back(player);
+    }
+    stale = false;
+}
+
+void PlayerIndex::getBots(std::vector<Player*>& out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    out.insert(out.end(), bots.begin(), bots.end());
+}
+
+void PlayerIndex::getBotsInGuild(uint32_t guildId, std::vector<Player*>& out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    auto it = botsByGuild.find(guildId);
+    if (it != botsByGuild.end())
+        out.insert(out.end(), it->second.begin(), it->second.end());
+}
+
+void PlayerIndex::getRealPlayers(std::vector<Player*>& out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    out.insert(out.end(), realPlayers.begin(), realPlayers.end());
+}
+
+void PlayerIndex::getRealPlayersOnMap(Map const* map, std::vector<Player*>& out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    for (Player* player : realPlayers)
+    {
+        if (player->GetMap() == map)
+            out.push_back(player);
+    }
+}
+
+static unsigned char LowerAscii(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// Bytes of multi-byte UTF-8 letters count as part of a word, so "Bj" is not
+// found in "Björn".
+static bool IsWordByte(unsigned char c)
+{
+    return c >= 0x80 || std::isalnum(c);
+}
+
+void PlayerNameIndex::add(uint64_t guid, const std::string& name)
+{
+    if (name.empty())
+        return;
+
+    std::string lower = name;
+    for (char& c : lower)
+        c = static_cast<char>(LowerAscii(static_cast<unsigned char>(c)));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    names[guid] = std::move(lower);
+    stale = true;
+}
+
+void PlayerNameIndex::remove(uint64_t guid)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (names.erase(guid))
+        stale = true;
+}
+
+uint32_t PlayerNameIndex::child(uint32_t node, unsigned char c) const
+{
+    const std::vector<std::pair<unsigned char, uint32_t>>& next = nodes[node].next;
+    auto it = std::lower_bound(next.begin(), next.end(), c,
+                               [](const std::pair<unsigned char, uint32_t>& edge, unsigned char value) { return edge.first < value; });
+    return (it != next.end() && it->first == c) ? it->second : NO_NODE;
+}
+
+void PlayerNameIndex::rebuild()
+{
+    // The trie of all names.
+    nodes.assign(1, Node());
+    for (const auto& entry : names)
+    {
+        uint32_t node = 0;
+        for (char ch : entry.second)
+        {
+            unsigned char c = static_cast<unsigned char>(ch);
+            uint32_t next = child(node, c);
+            if (next == NO_NODE)
+            {
+                next = static_cast<uint32_t>(nodes.size());
+                nodes.emplace_back();
+                nodes[next].depth = nodes[node].depth + 1;
+                std::vector<std::pair<unsigned char, uint32_t>>& edges = nodes[node].next;
+                edges.insert(std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, uint32_t(0))), { c, next });
+            }
+            node = next;
+        }
+        nodes[node].guid = entry.first;
+    }
+
+    // Fail and output links, breadth first so a node's fail target is done
+    // before the node. Children of the root fail to the root.
+    std::vector<uint32_t> queue;
+    queue.reserve(nodes.size());
+    for (const auto& edge : nodes[0].next)
+        queue.push_back(edge.second);
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        uint32_t node = queue[i];
+        for (const auto& edge : nodes[node].next)
+        {
+            uint32_t fail = nodes[node].fail;
+            uint32_t target;
+            while ((target = child(fail, edge.first)) == NO_NODE && fail != 0)
+                fail = nodes[fail].fail;
+            Node& next = nodes[edge.second];
+            next.fail = (target == NO_NODE) ? 0 : target;
+            next.outputLink = nodes[next.fail].guid ? next.fail : nodes[next.fail].outputLink;
+            queue.push_back(edge.second);
+        }
+    }
+    stale = false;
+}
+
+void PlayerNameIndex::findMentions(const std::string& text, std::vector<std::pair<size_t, uint64_t>>& out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stale)
+        rebuild();
+    if (nodes.empty())
+        return;
+
+    // Names are single words, so whole-word matches cannot overlap and come
+    // out in the order they start.
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    uint32_t state = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        unsigned char c = LowerAscii(bytes[i]);
+        uint32_t next;
+        while ((next = child(state, c)) == NO_NODE && state != 0)
+            state = nodes[state].fail;
+        state = (next == NO_NODE) ? 0 : next;
+
+        for (uint32_t match = nodes[state].guid ? state : nodes[state].outputLink; match != NO_NODE; match = nodes[match].outputLink)
+        {
+            size_t start = i + 1 - nodes[match].depth;
+            bool wordStart = start == 0 || !IsWordByte(bytes[start - 1]);
+            bool wordEnd = i + 1 == text.size() || !IsWordByte(bytes[i + 1]);
+            if (wordStart && wordEnd)
+                out.emplace_back(start, nodes[match].guid);
+        }
+    }
+}
+
+void GetPlayersInRange(WorldObject const* center, float range, std::vector<Player*>& out)
+{
+    std::list<Player*> found;
+    // Dead players can still hear and reply.
+    Acore::AnyPlayerInObjectRangeCheck check(center, range, false);
+    Acore::PlayerListSearcher<Acore::AnyPlayerInObjectRangeCheck> searcher(center, found, check);
+    Cell::VisitWorldObjects(center, searcher, range);
+    out.insert(out.end(), found.begin(), found.end());
+}
@@ -0,0 +1,80 @@
+#ifndef MOD_OLLAMA_CHAT_PLAYERINDEX_H
+#define MOD_OLLAMA_CHAT_PLAYERINDEX_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Map;
+class Player;
+class WorldObject;
+
+// Snapshot of the online players, split into bots and real players, so chat
+// handling does not walk ObjectAccessor::GetPlayers() for every message.
+// It is rebuilt on first use after invalidate(), which runs every world
+// update and whenever a player logs out or changes map.
+class PlayerIndex {
+public:
+    void invalidate();
+
+    // The getters append to out.
+    void getBots(std::vector<Player*>& out);
+    void getBotsInGuild(uint32_t guildId, std::vector<Player*>& out);
+    void getRealPlayers(std::vector<Player*>& out);
+    void getRealPlayersOnMap(Map const* map, std::vector<Player*>& out);
+
+private:
+    void refresh(); // caller holds mutex_
+
+    std::mutex mutex_;
+    bool stale = true;
+    std::vector<Player*> bots;
+    std::vector<Player*> realPlayers;
+    std::unordered_map<uint32_t, std::vector<Player*>> botsByGuild;
+};
+
+extern PlayerIndex g_PlayerIndex;
+
+// Names of the online players, compiled into one Aho-Corasick automaton so a
+// chat line is matched against all of them in a single pass. Players are added
+// on login and removed on logout (whether they are bots is only known later,
+// so callers filter the matches); the automaton is rebuilt on the first match
+// after a change.
+class PlayerNameIndex {
+public:
+    void add(uint64_t guid, const std::string& name);
+    void remove(uint64_t guid);
+
+    // Appends the offset and GUID of every name said as a whole word in text,
+    // in the order they appear. Case is ignored.
+    void findMentions(const std::string& text, std::vector<std::pair<size_t, uint64_t>>& out);
+
+private:
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    struct Node {
+        std::vector<std::pair<unsigned char, uint32_t>> next;  // sorted by byte
+        uint32_t fail = 0;          // longest proper suffix that is also a prefix
+        uint32_t outputLink = NO_NODE;  // nearest node on the fail chain ending a name
+        uint32_t depth = 0;
+        uint64_t guid = 0;          // player whose name ends here, 0 = none
+    };
+
+    uint32_t child(uint32_t node, unsigned char c) const;
+    void rebuild(); // caller holds mutex_
+
+    std::mutex mutex_;
+    bool stale = false;
+    std::unordered_map<uint64_t, std::string> names;   // lower case
+    std::vector<Node> nodes;
+};
+
+extern PlayerNameIndex g_PlayerNameIndex;
+
+// Appends the players within range of center, using the map grid.
+void GetPlayersInRange(WorldObject const* center, float range, std::vector<Player*>& out);
+
+#endif // MOD_OLLAMA_CHAT_PLAYERINDEX_H
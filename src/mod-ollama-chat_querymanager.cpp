@@ -1,56 +1,713 @@
 #include "mod-ollama-chat_querymanager.h"
 #include "mod-ollama-chat_config.h"  // For g_MaxConcurrentQueries
-#include <thread>
+#include "mod-ollama-chat_cache.h"   // For ReplaceBotName
+#include "mod-ollama-chat_metrics.h"
+#include "mod-ollama-chat_router.h"
+#include "Log.h"
+#include "Random.h"
+#include <algorithm>
 
-// Constructor: initialize with the configuration value.
+// Workers used when MaxConcurrentQueries is 0. Queries are network bound,
+// so the pool is allowed to be larger than the number of cores.
+static uint32_t DefaultWorkerCount()
+{
+    return std::max(8u, std::thread::hardware_concurrency() * 2);
+}
+
+// In-flight transfers allowed in async mode when MaxConcurrentQueries is 0.
+// They only cost memory and sockets, not threads.
+static constexpr uint32_t DEFAULT_ASYNC_IN_FLIGHT = 256;
+
+// Queued queries allowed per worker (or per in-flight slot) when MaxQueuedQueries is 0.
+static constexpr size_t QUEUED_QUERIES_PER_WORKER = 16;
+
+// Longest backoff of a retry.
+static constexpr uint32_t MAX_RETRY_DELAY_MS = 10000;
+
+const char* QueryPriorityName(QueryPriority priority)
+{
+    switch (priority)
+    {
+        case QueryPriority::DirectMention: return "DirectMention";
+        case QueryPriority::RealPlayer:    return "RealPlayer";
+        case QueryPriority::BotToBot:      return "BotToBot";
+        case QueryPriority::RandomChatter: return "RandomChatter";
+        default:                           return "Unknown";
+    }
+}
+
+// Constructor: the pool is started once the configuration has been loaded.
 QueryManager::QueryManager()
-    : maxConcurrentQueries(g_MaxConcurrentQueries), currentQueries(0)
+    : asyncDispatch(false), runningAsync(false), workerCount(0), maxInFlight(0), inFlight(0),
+      maxQueuedQueries(0), generation(0), stopping(false), singleFlight(false), coalescedQueries(0),
+      queuedTasks(0), peakQueuedTasks(0), activeTotal(0), adaptiveConcurrency(false), adaptiveLimit(1.0),
+      maxRetries(0), retryBaseDelayMs(500), retriedQueries(0), cancelledQueries(0), expiredQueries(0), deadlineQueries(0), rejectedQueries(0)
 {
+    activePerClass.fill(0);
+    classQuota.fill(0);
+    classMaxQueueAge.fill(0);
+    classDeadline.fill(0);
+    for (std::atomic<uint64_t>& dropped : droppedQueries)
+        dropped = 0;
 }
 
-// Set maximum concurrent queries (0 means no limit).
+QueryManager::~QueryManager()
+{
+    shutdown();
+}
+
+void QueryManager::setAsyncDispatch(bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    asyncDispatch = enabled;
+}
+
+// Set maximum concurrent queries: the number of worker threads, or in async
+// mode the number of transfers the single dispatcher keeps in flight.
 void QueryManager::setMaxConcurrentQueries(int maxQueries) {
+    bool async;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        async = asyncDispatch;
+    }
+    if (async)
+        startWorkers(1, maxQueries > 0 ? static_cast<uint32_t>(maxQueries) : DEFAULT_ASYNC_IN_FLIGHT, true);
+    else
+        startWorkers(maxQueries > 0 ? static_cast<uint32_t>(maxQueries) : DefaultWorkerCount(), 0, false);
+}
+
+void QueryManager::setSingleFlight(bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    singleFlight = enabled;
+}
+
+void QueryManager::setClassQuotas(const std::array<uint32_t, QUERY_PRIORITY_COUNT>& percent) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        classQuota = percent;
+    }
+    cv_.notify_all();
+}
+
+void QueryManager::setClassMaxQueueAge(const std::array<uint32_t, QUERY_PRIORITY_COUNT>& seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    classMaxQueueAge = seconds;
+}
+
+void QueryManager::setClassDeadline(const std::array<uint32_t, QUERY_PRIORITY_COUNT>& seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    classDeadline = seconds;
+}
+
+void QueryManager::setAdaptiveConcurrency(bool enabled) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        adaptiveConcurrency = enabled;
+        adaptiveLimit = slotCount();
+    }
+    cv_.notify_all();
+}
+
+void QueryManager::setRetryPolicy(uint32_t retries, uint32_t baseDelayMs) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    maxRetries = retries;
+    retryBaseDelayMs = std::max<uint32_t>(baseDelayMs, 1);
+}
+
+// Queued queries of the bot are skipped when a worker reaches them; running
+// transfers notice the token in their progress callback and abort.
+void QueryManager::cancelQueriesFor(uint64_t ownerGuid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ownedQueries.find(ownerGuid);
+    if (it == ownedQueries.end())
+        return;
+    for (const std::weak_ptr<QueryControl>& weak : it->second)
+    {
+        std::shared_ptr<QueryControl> control = weak.lock();
+        if (control && !control->shared)
+            control->cancelled = true;
+    }
+    ownedQueries.erase(it);
+}
+
+size_t QueryManager::getQueuedQueries(QueryPriority priority) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return taskQueues[static_cast<size_t>(priority)].size();
+}
+
+uint32_t QueryManager::getActiveQueries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return activeTotal;
+}
+
+uint32_t QueryManager::getConcurrencyLimit() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return concurrencyLimit();
+}
+
+uint32_t QueryManager::getWorkerThreads() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<uint32_t>(workers.size()) + (runningAsync ? 1 : 0);
+}
+
+void QueryManager::setMaxQueuedQueries(int maxQueued) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    maxQueuedQueries = std::max(0, maxQueued);
+}
+
+size_t QueryManager::queueCapacity() const {
+    if (maxQueuedQueries > 0)
+        return static_cast<size_t>(maxQueuedQueries);
+    return std::max<size_t>(runningAsync ? maxInFlight : workerCount, 1) * QUEUED_QUERIES_PER_WORKER;
+}
+
+// Workers, or in-flight transfers in async mode.
+uint32_t QueryManager::slotCount() const {
+    return std::max<uint32_t>(runningAsync ? maxInFlight : workerCount, 1);
+}
+
+// Slots currently usable: all of them, or the adaptive share.
+uint32_t QueryManager::concurrencyLimit() const {
+    if (!adaptiveConcurrency)
+        return slotCount();
+    return std::clamp<uint32_t>(static_cast<uint32_t>(adaptiveLimit), 1, slotCount());
+}
+
+bool QueryManager::hasFreeSlot() const {
+    return activeTotal < concurrencyLimit();
+}
+
+// When a worker waiting for work has to look again without being notified.
+QueryManager::Clock::time_point QueryManager::nextWakeup() const {
+    // Retry-After pauses and open circuits of the endpoints.
+    Clock::time_point wakeup = g_ChatEndpointRouter.nextChange(Clock::now());
+    for (const QueryTask& task : retryTasks)
+        wakeup = std::min(wakeup, task.retryAt);
+    return wakeup;
+}
+
+// Number of slots a class may occupy at once.
+uint32_t QueryManager::classLimit(size_t cls) const {
+    uint32_t slots = concurrencyLimit();
+    uint32_t percent = classQuota[cls];
+    if (percent == 0 || percent >= 100)
+        return slots;
+    return std::max<uint32_t>(slots * percent / 100, 1);
+}
+
+bool QueryManager::hasRunnableTask() const {
+    if (!hasFreeSlot())
+        return false;
+    Clock::time_point now = Clock::now();
+    for (size_t cls = 0; cls < QUERY_PRIORITY_COUNT; ++cls)
+    {
+        if (!taskQueues[cls].empty() && activePerClass[cls] < classLimit(cls) &&
+            g_ChatEndpointRouter.canServe(static_cast<QueryPriority>(cls), now))
+            return true;
+    }
+    return false;
+}
+
+// Takes the oldest query of the most urgent class that is below its quota
+// and has an endpoint free for it. Cancelled and expired queries are dropped
+// on the way, before they cost a request.
+bool QueryManager::takeNextTask(QueryTask& task) {
+    Clock::time_point now = Clock::now();
+    dropStaleTasks(now);
+    for (size_t cls = 0; cls < QUERY_PRIORITY_COUNT; ++cls)
+    {
+        std::deque<QueryTask>& queue = taskQueues[cls];
+        while (!queue.empty() && activePerClass[cls] < classLimit(cls))
+        {
+            if (queue.front().control->shouldAbort())
+            {
+                bool cancelled = queue.front().control->cancelled;
+                if (cancelled)
+                    ++cancelledQueries;
+                else
+                    ++deadlineQueries;
+                dropTask(queue.front(), cancelled ? "cancelled" : "past its deadline");
+                queue.pop_front();
+                --queuedTasks;
+                continue;
+            }
+            // A retry moves on from the endpoint that failed it, if it can.
+            const ChatEndpoint* failed = queue.front().attempt > 0 ? queue.front().endpoint.get() : nullptr;
+            std::shared_ptr<ChatEndpoint> endpoint = g_ChatEndpointRouter.acquire(static_cast<QueryPriority>(cls), failed, now);
+            if (!endpoint)
+                break;
+
+            task = std::move(queue.front());
+            queue.pop_front();
+            --queuedTasks;
+            task.endpoint = std::move(endpoint);
+            task.started = now;
+            ++activePerClass[cls];
+            ++activeTotal;
+            if (task.attempt == 0)
+                g_ChatMetrics.queueWait.record(std::chrono::duration_cast<std::chrono::microseconds>(now - task.enqueued).count());
+            return true;
+        }
+    }
+    return false;
+}
+
+// Retries whose backoff has passed go ahead of the queries queued since.
+void QueryManager::promoteRetries(Clock::time_point now) {
+    for (size_t i = 0; i < retryTasks.size();)
+    {
+        if (retryTasks[i].retryAt > now)
+        {
+            ++i;
+            continue;
+        }
+        taskQueues[static_cast<size_t>(retryTasks[i].priority)].push_front(std::move(retryTasks[i]));
+        retryTasks[i] = std::move(retryTasks.back());
+        retryTasks.pop_back();
+    }
+}
+
+// A reply that arrives long after the conversation moved on is worse than none.
+void QueryManager::dropStaleTasks(Clock::time_point now) {
+    for (size_t cls = 0; cls < QUERY_PRIORITY_COUNT; ++cls)
+    {
+        if (classMaxQueueAge[cls] == 0)
+            continue;
+        std::chrono::seconds maxAge(classMaxQueueAge[cls]);
+        std::deque<QueryTask>& queue = taskQueues[cls];
+        while (!queue.empty() && now - queue.front().enqueued > maxAge)
+        {
+            ++expiredQueries;
+            dropTask(queue.front(), "expired in the queue");
+            queue.pop_front();
+            --queuedTasks;
+        }
+    }
+}
+
+// Full queue: drop the oldest query of a less urgent class to admit a new one.
+bool QueryManager::makeRoomFor(QueryPriority priority) {
+    for (size_t cls = QUERY_PRIORITY_COUNT; cls-- > static_cast<size_t>(priority) + 1;)
+    {
+        std::deque<QueryTask>& queue = taskQueues[cls];
+        if (queue.empty())
+            continue;
+        dropTask(queue.front(), "displaced by a more urgent query");
+        queue.pop_front();
+        --queuedTasks;
+        return true;
+    }
+    return false;
+}
+
+// Forgets a queued query and its followers without answering them; their
+// callbacks are destroyed uncalled. Caller holds mutex_.
+void QueryManager::dropTask(QueryTask& task, const char* reason) {
+    ++droppedQueries[static_cast<size_t>(task.priority)];
+    if (task.flight)
+    {
+        // Its followers are dropped with it; new queries must not join it.
+        auto it = flights.find(task.flightKey);
+        if (it != flights.end() && it->second == task.flight)
+            flights.erase(it);
+    }
+    if (g_DebugEnabled) {
+        LOG_INFO("server.loading", "Dropped {} query {}.", QueryPriorityName(task.priority), reason);
+    }
+}
+
+// (Re)start the pool. Workers of the previous generation finish the query
+// they are working on and then exit; they are joined on shutdown.
+void QueryManager::startWorkers(uint32_t count, uint32_t inFlightLimit, bool async) {
     std::lock_guard<std::mutex> lock(mutex_);
-    maxConcurrentQueries = maxQueries;
+    if (stopping)
+        return;
+
+    maxInFlight = inFlightLimit;
+    // A (re)configured pool starts at its full size.
+    adaptiveLimit = std::max<uint32_t>(async ? inFlightLimit : count, 1);
+    if (count == workerCount && async == runningAsync && !workers.empty())
+    {
+        cv_.notify_all();
+        return;
+    }
+
+    ++generation;
+    for (std::thread& worker : workers)
+        retiredWorkers.push_back(std::move(worker));
+    workers.clear();
+
+    workerCount = count;
+    runningAsync = async;
+    workers.reserve(count);
+    for (uint32_t i = 0; i < count; ++i)
+        workers.emplace_back(&QueryManager::workerLoop, this, generation);
+
+    cv_.notify_all();
 }
 
-// Submit a query and return a future for the result.
-std::future<std::string> QueryManager::submitQuery(const std::string& prompt) {
-    std::promise<std::string> promise;
-    std::future<std::string> future = promise.get_future();
+// Queue a query for the pool. The callbacks run on a worker (or the HTTP I/O) thread.
+// With single-flight enabled, a query whose dedup key is already in flight
+// does not queue a request of its own but gets the reply of that one.
+bool QueryManager::submitQuery(std::string prompt, QueryResponseCallback callback, QueryChunkCallback onChunk,
+                               QueryOptions options) {
+    std::shared_ptr<Flight> joined;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping || workers.empty())
+            return false;
 
-    bool shouldRunNow = false;
+        bool dedup = singleFlight && options.dedupKey != 0;
+        if (dedup)
+        {
+            // Joining a less urgent flight would inherit its place in the queue.
+            auto it = flights.find(options.dedupKey);
+            if (it != flights.end() && it->second->priority <= options.priority && !it->second->control->shouldAbort())
+            {
+                joined = it->second;
+                // The request now serves other bots too; its owner leaving must not cancel it.
+                joined->control->shared = true;
+            }
+        }
+
+        if (!joined)
+        {
+            Clock::time_point now = Clock::now();
+            dropStaleTasks(now);
+            if (queuedTasks >= queueCapacity() && !makeRoomFor(options.priority))
+            {
+                ++rejectedQueries;
+                return false;
+            }
+
+            QueryTask task;
+            task.priority = options.priority;
+            task.enqueued = now;
+            task.control = std::make_shared<QueryControl>();
+            uint32_t deadline = classDeadline[static_cast<size_t>(options.priority)];
+            if (deadline > 0)
+                task.control->deadline = now + std::chrono::seconds(deadline);
+            if (options.ownerGuid != 0)
+            {
+                std::vector<std::weak_ptr<QueryControl>>& owned = ownedQueries[options.ownerGuid];
+                owned.erase(std::remove_if(owned.begin(), owned.end(),
+                                           [](const std::weak_ptr<QueryControl>& weak) { return weak.expired(); }),
+                            owned.end());
+                owned.push_back(task.control);
+            }
+
+            if (dedup)
+            {
+                auto flight = std::make_shared<Flight>();
+                flight->leaderName = options.botName;
+                flight->priority = options.priority;
+                flight->control = task.control;
+                flights[options.dedupKey] = flight;
+                task.flightKey = options.dedupKey;
+                task.flight = flight;
+
+                uint64_t key = options.dedupKey;
+                if (onChunk)
+                {
+                    onChunk = [this, flight, onChunk = std::move(onChunk)](std::string chunk) {
+                        deliverFlightChunk(flight, onChunk, std::move(chunk));
+                    };
+                }
+                callback = [this, key, flight, callback = std::move(callback)](std::string result) {
+                    finishFlight(key, flight, callback, std::move(result));
+                };
+            }
+            task.prompt = std::move(prompt);
+            task.systemPrompt = std::move(options.systemPrompt);
+            task.callback = std::move(callback);
+            task.onChunk = std::move(onChunk);
+            taskQueues[static_cast<size_t>(task.priority)].push_back(std::move(task));
+            ++queuedTasks;
+            if (queuedTasks > peakQueuedTasks)
+                peakQueuedTasks = queuedTasks;
+        }
+    }
+
+    if (joined)
+    {
+        ++coalescedQueries;
+        if (g_DebugEnabled) {
+            LOG_INFO("server.loading", "Query for {} joined an identical query already in flight.", options.botName);
+        }
+        joinFlight(joined, { std::move(options.botName), std::move(callback), std::move(onChunk) });
+        return true;
+    }
 
+    cv_.notify_one();
+    return true;
+}
+
+// Invokes a reply callback; exceptions must not stop the other receivers.
+static void InvokeQueryCallback(const QueryResponseCallback& callback, std::string result) {
+    if (!callback)
+        return;
+    try {
+        callback(std::move(result));
+    } catch (const std::exception& ex) {
+        if (g_DebugEnabled) {
+            LOG_ERROR("server.loading", "Exception in query callback: {}", ex.what());
+        }
+    }
+}
+
+// Frees the slot of a finished transfer, then either queues the query for a
+// retry or says the reply: in one line if nothing was streamed, and to the callback.
+void QueryManager::finishQuery(QueryTask& task, std::string result, bool async) {
+    bool retry;
     {
         std::lock_guard<std::mutex> lock(mutex_);
-        if (maxConcurrentQueries == 0 || currentQueries < maxConcurrentQueries) {
-            ++currentQueries;
-            shouldRunNow = true;
-        } else {
-            taskQueue.push({ prompt, std::move(promise) });
+        size_t cls = static_cast<size_t>(task.priority);
+        if (activePerClass[cls] > 0)
+            --activePerClass[cls];
+        if (activeTotal > 0)
+            --activeTotal;
+        if (async && inFlight > 0)
+            --inFlight;
+
+        retry = recordOutcome(task, Clock::now()) && !stopping;
+        if (retry)
+        {
+            if (g_DebugEnabled) {
+                LOG_INFO("server.loading", "Retrying {} query after {} (attempt {}).", QueryPriorityName(task.priority),
+                         QueryErrorTypeName(task.control->failure), task.attempt);
+            }
+            task.control->failed = false;
+            task.control->retryAfter = 0;
+            retryTasks.push_back(std::move(task));
+            ++queuedTasks;
+            ++retriedQueries;
         }
     }
+    cv_.notify_all();
+    if (retry)
+        return;
+
+    if (task.onChunk && !task.control->streamed && !result.empty())
+        task.onChunk(result);
+    InvokeQueryCallback(task.callback, std::move(result));
+}
+
+// Feeds the outcome of a transfer to the endpoint router and the concurrency
+// limiter. Returns true if the query should be retried, with task.retryAt set.
+// Caller holds mutex_.
+bool QueryManager::recordOutcome(QueryTask& task, Clock::time_point now) {
+    QueryControl& control = *task.control;
+    // An aborted transfer (cancelled, expired, shut down) has no reply and no error.
+    bool aborted = !control.failed && control.shouldAbort();
+    ChatEndpointRouter::Outcome outcome = control.failed ? ChatEndpointRouter::Outcome::Failure :
+        aborted ? ChatEndpointRouter::Outcome::Aborted : ChatEndpointRouter::Outcome::Success;
+    g_ChatEndpointRouter.release(task.endpoint, outcome, control.failure, control.retryAfter, now - task.started, now);
+
+    if (!control.failed)
+    {
+        // Additive increase: one more slot after a window of successes.
+        if (adaptiveConcurrency && !aborted)
+            adaptiveLimit = std::min<double>(adaptiveLimit + 1.0 / std::max(adaptiveLimit, 1.0), slotCount());
+        return false;
+    }
+
+    QueryErrorType failure = control.failure;
+    bool overload = failure == QueryErrorType::ServerError || failure == QueryErrorType::Timeout ||
+                    failure == QueryErrorType::Network || failure == QueryErrorType::RateLimited;
 
-    if (shouldRunNow) {
-        std::thread(&QueryManager::processQuery, this, prompt, std::move(promise)).detach();
+    // Multiplicative decrease, once per second: the transfers in flight
+    // when the provider starts pushing back all fail at about the same time.
+    if (overload && adaptiveConcurrency && now - lastDecrease >= std::chrono::seconds(1))
+    {
+        adaptiveLimit = std::max(adaptiveLimit / 2.0, 1.0);
+        lastDecrease = now;
     }
 
-    return future;
+    // Chat completions have no side effects, so any of these may be sent
+    // again, unless part of the reply was said already. Nothing is retried
+    // once every endpoint of the class is down; the queued queries probe for
+    // recovery. A Retry-After pause holds the retry back only if there is no
+    // other endpoint to take it.
+    if (!overload || control.streamed || control.cancelled || task.attempt >= maxRetries ||
+        !g_ChatEndpointRouter.hasLiveEndpoint(task.priority, now))
+        return false;
+
+    uint32_t ceiling = static_cast<uint32_t>(std::min<uint64_t>(uint64_t(retryBaseDelayMs) << std::min<uint32_t>(task.attempt, 16), MAX_RETRY_DELAY_MS));
+    Clock::time_point retryAt = now + std::chrono::milliseconds(urand(ceiling / 2, ceiling));
+    if (retryAt >= control.deadline)
+        return false;
+
+    ++task.attempt;
+    task.retryAt = retryAt;
+    return true;
 }
 
-// Process the query by calling the API and then handling any queued tasks.
-void QueryManager::processQuery(const std::string& prompt, std::promise<std::string> promise) {
-    std::string result = QueryOllamaAPI(prompt);
-    promise.set_value(result);
+// Follower of a running flight: catch up on the lines said so far, or take
+// the finished reply if the flight completed meanwhile.
+void QueryManager::joinFlight(const std::shared_ptr<Flight>& flight, Flight::Follower follower) {
+    std::lock_guard<std::mutex> lock(flight->mutex);
+    if (follower.onChunk)
+    {
+        for (const std::string& chunk : flight->chunks)
+            follower.onChunk(ReplaceBotName(chunk, flight->leaderName, follower.botName));
+    }
+
+    if (flight->finished)
+    {
+        InvokeQueryCallback(follower.callback, ReplaceBotName(flight->result, flight->leaderName, follower.botName));
+        return;
+    }
+    flight->followers.push_back(std::move(follower));
+}
 
+void QueryManager::deliverFlightChunk(const std::shared_ptr<Flight>& flight, const QueryChunkCallback& onChunk, std::string chunk) {
+    std::lock_guard<std::mutex> lock(flight->mutex);
+    flight->chunks.push_back(chunk);
+    for (const Flight::Follower& follower : flight->followers)
     {
+        if (follower.onChunk)
+            follower.onChunk(ReplaceBotName(chunk, flight->leaderName, follower.botName));
+    }
+    onChunk(std::move(chunk));
+}
+
+void QueryManager::finishFlight(uint64_t key, const std::shared_ptr<Flight>& flight, const QueryResponseCallback& callback, std::string result) {
+    {
+        // Queries submitted from now on start a new request.
         std::lock_guard<std::mutex> lock(mutex_);
-        --currentQueries;
-        if (!taskQueue.empty() && (maxConcurrentQueries == 0 || currentQueries < maxConcurrentQueries)) {
-            QueryTask task = std::move(taskQueue.front());
-            taskQueue.pop();
-            ++currentQueries;
-            std::thread(&QueryManager::processQuery, this, task.prompt, std::move(task.promise)).detach();
+        auto it = flights.find(key);
+        if (it != flights.end() && it->second == flight)
+            flights.erase(it);
+    }
+
+    std::lock_guard<std::mutex> lock(flight->mutex);
+    flight->finished = true;
+    flight->result = result;
+    for (const Flight::Follower& follower : flight->followers)
+        InvokeQueryCallback(follower.callback, ReplaceBotName(result, flight->leaderName, follower.botName));
+    flight->followers.clear();
+    InvokeQueryCallback(callback, std::move(result));
+}
+
+void QueryManager::shutdown() {
+    std::vector<std::thread> toJoin;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping)
+            return;
+        stopping = true;
+        for (std::deque<QueryTask>& queue : taskQueues)
+            queue.clear();
+        retryTasks.clear();
+        queuedTasks = 0;
+        ownedQueries.clear();
+        flights.clear();
+        toJoin = std::move(retiredWorkers);
+        exitedWorkers.clear();
+        for (std::thread& worker : workers)
+            toJoin.push_back(std::move(worker));
+        workers.clear();
+    }
+    cv_.notify_all();
+
+    for (std::thread& worker : toJoin)
+    {
+        if (worker.joinable())
+            worker.join();
+    }
+}
+
+void QueryManager::reapRetiredWorkers() {
+    std::vector<std::thread> toJoin;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (exitedWorkers.empty())
+            return;
+        for (size_t i = 0; i < retiredWorkers.size();)
+        {
+            auto exited = std::find(exitedWorkers.begin(), exitedWorkers.end(), retiredWorkers[i].get_id());
+            if (exited == exitedWorkers.end())
+            {
+                ++i;
+                continue;
+            }
+            exitedWorkers.erase(exited);
+            toJoin.push_back(std::move(retiredWorkers[i]));
+            retiredWorkers[i] = std::move(retiredWorkers.back());
+            retiredWorkers.pop_back();
+        }
+    }
+
+    // They have left workerLoop, so this does not wait for a request.
+    for (std::thread& worker : toJoin)
+        worker.join();
+}
+
+// Worker thread: take queued queries until the pool is stopped or replaced.
+void QueryManager::workerLoop(uint32_t workerGeneration) {
+    while (true)
+    {
+        QueryTask task;
+        bool async;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true)
+            {
+                if (stopping)
+                    return;
+                if (generation != workerGeneration)
+                {
+                    exitedWorkers.push_back(std::this_thread::get_id());
+                    return;
+                }
+                promoteRetries(Clock::now());
+                if (hasRunnableTask() && takeNextTask(task))
+                    break;
+                // Backoffs, Retry-After pauses and an open circuit end without a notification.
+                Clock::time_point wakeup = nextWakeup();
+                if (wakeup == Clock::time_point::max())
+                    cv_.wait(lock);
+                else
+                    cv_.wait_until(lock, wakeup);
+            }
+            async = runningAsync;
+            if (async)
+                ++inFlight;
         }
+
+        if (async)
+            dispatchAsyncQuery(task);
+        else
+            processQuery(task);
+    }
+}
+
+// Async mode: start the transfer and return to the queue right away. The
+// task lives on in the transfer, in case it has to be retried.
+void QueryManager::dispatchAsyncQuery(QueryTask& task) {
+    auto held = std::make_shared<QueryTask>(std::move(task));
+    QueryChunkCallback onChunk;
+    if (held->onChunk)
+    {
+        onChunk = [held](std::string chunk) {
+            held->control->streamed = true;
+            held->onChunk(std::move(chunk));
+        };
+    }
+    QueryOllamaAPIAsync(held->endpoint, held->prompt, held->systemPrompt, [this, held](std::string result) {
+        finishQuery(*held, std::move(result), true);
+    }, std::move(onChunk), held->control);
+}
+
+// Process the query by calling the API and handing the reply to the callback.
+void QueryManager::processQuery(QueryTask& task) {
+    QueryChunkCallback onChunk;
+    if (task.onChunk)
+    {
+        onChunk = [&task](std::string chunk) {
+            task.control->streamed = true;
+            task.onChunk(std::move(chunk));
+        };
     }
+    std::string result = QueryOllamaAPI(*task.endpoint, task.prompt, task.systemPrompt, onChunk, task.control);
+    finishQuery(task, std::move(result), false);
 }
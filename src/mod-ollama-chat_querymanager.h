@@ -2,31 +2,238 @@
 #define MOD_OLLAMA_CHAT_QUERYMANAGER_H
 
 #include <string>
-#include <future>
+#include <functional>
 #include <mutex>
-#include <queue>
+#include <condition_variable>
+#include <deque>
 #include <thread>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include "mod-ollama-chat_metrics.h"
 
-std::string QueryOllamaAPI(const std::string& prompt);
+struct ChatEndpoint;
+
+// Invoked with the API reply once a submitted query has been processed.
+// The text is passed by value so it can be moved on to the world thread.
+// A query dropped before its transfer started (cancelled, expired, displaced
+// or shut down) is never answered: the callback is destroyed without being
+// called, along with those of the queries that joined it. Callers that must
+// settle every query do so from the destructor of what the callback owns.
+using QueryResponseCallback = std::function<void(std::string)>;
+// Invoked with each chat line of the reply as it arrives (streaming mode).
+// When set, it receives everything the bot should say, including error
+// replies, and the response callback only gets the full text for history.
+using QueryChunkCallback = std::function<void(std::string)>;
+
+// Scheduling classes, most urgent first.
+enum class QueryPriority : uint8_t {
+    DirectMention = 0,  // a real player addressed the bot by name
+    RealPlayer,         // a real player said something nearby
+    BotToBot,           // a bot reacting to another bot
+    RandomChatter,      // ambient chatter
+    Count
+};
+
+constexpr size_t QUERY_PRIORITY_COUNT = static_cast<size_t>(QueryPriority::Count);
+const char* QueryPriorityName(QueryPriority priority);
+
+// Optional per-query settings.
+struct QueryOptions {
+    uint64_t dedupKey = 0;   // queries with the same key may share one request (0 = never)
+    std::string botName;     // name swapped in when the query gets another bot's reply
+    QueryPriority priority = QueryPriority::RealPlayer;
+    uint64_t ownerGuid = 0;  // bot whose logout or teleport cancels the query (0 = none)
+    std::string systemPrompt; // static instructions sent ahead of the prompt as the system message
+};
+
+// Cancellation token and deadline of one query, checked before dispatch and
+// by the transfer while it runs. A transfer aborted mid-flight answers with
+// an empty reply; a query cancelled while still queued is dropped unanswered.
+struct QueryControl {
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> shared{false};   // other queries joined it; owner cancellation no longer applies
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+    // Set by the transfer: what went wrong, if anything, and the server's
+    // Retry-After in seconds. Read by the worker once the transfer is done.
+    bool failed = false;
+    QueryErrorType failure = QueryErrorType::Local;
+    uint32_t retryAfter = 0;
+    std::atomic<bool> streamed{false};  // a line was said already; a retry would repeat it
+
+    bool shouldAbort() const { return cancelled || std::chrono::steady_clock::now() > deadline; }
+};
+
+std::string QueryOllamaAPI(const ChatEndpoint& endpoint, const std::string& prompt, const std::string& systemPrompt,
+                           const QueryChunkCallback& onChunk = nullptr, const std::shared_ptr<QueryControl>& control = nullptr);
+void QueryOllamaAPIAsync(std::shared_ptr<ChatEndpoint> endpoint, const std::string& prompt, const std::string& systemPrompt,
+                         QueryResponseCallback callback, QueryChunkCallback onChunk = nullptr,
+                         std::shared_ptr<QueryControl> control = nullptr);
 
 class QueryManager {
 public:
     QueryManager();
+    ~QueryManager();
+
+    // Selects the curl_multi backend: one dispatcher thread hands queries to the
+    // HTTP I/O thread instead of every worker blocking on its own request.
+    // Takes effect on the next setMaxConcurrentQueries call.
+    void setAsyncDispatch(bool enabled);
+    // Starts or resizes the worker pool, or sets the number of in-flight
+    // transfers in async mode (0 picks a default based on the hardware).
     void setMaxConcurrentQueries(int maxQueries);
-    std::future<std::string> submitQuery(const std::string& prompt);
+    // Sets how many queries may wait for a free worker (0 derives it from the pool size).
+    void setMaxQueuedQueries(int maxQueued);
+    // Lets queries with the same dedup key share the request already in flight.
+    void setSingleFlight(bool enabled);
+    // Percentage of the concurrency slots each priority class may occupy (0 = no limit).
+    void setClassQuotas(const std::array<uint32_t, QUERY_PRIORITY_COUNT>& percent);
+    // Seconds a query of each class may wait in the queue before it is dropped (0 = no limit).
+    void setClassMaxQueueAge(const std::array<uint32_t, QUERY_PRIORITY_COUNT>& seconds);
+    // Seconds after submission at which a query of each class is abandoned, even mid-transfer (0 = none).
+    void setClassDeadline(const std::array<uint32_t, QUERY_PRIORITY_COUNT>& seconds);
+    // AIMD: the number of queries in flight halves on 429, 5xx and timeouts
+    // (at most once a second) and grows by one per window of successes, up
+    // to the configured maximum. Off keeps the maximum.
+    void setAdaptiveConcurrency(bool enabled);
+    // Retries a query that failed with 429, 5xx or a network error up to
+    // maxRetries times, after a jittered exponential backoff starting at
+    // baseDelayMs, if that fits its deadline. A retry goes to another
+    // endpoint of its class where there is one.
+    void setRetryPolicy(uint32_t maxRetries, uint32_t baseDelayMs);
+    // Cancels every queued or running query owned by the bot.
+    void cancelQueriesFor(uint64_t ownerGuid);
+    // Returns false without queuing anything if the queue is full.
+    bool submitQuery(std::string prompt, QueryResponseCallback callback, QueryChunkCallback onChunk = nullptr,
+                     QueryOptions options = {});
+    uint64_t getCoalescedQueries() const { return coalescedQueries; }
+    uint64_t getDroppedQueries(QueryPriority priority) const { return droppedQueries[static_cast<size_t>(priority)]; }
+    uint64_t getCancelledQueries() const { return cancelledQueries; }
+    uint64_t getExpiredQueries() const { return expiredQueries; }
+    uint64_t getDeadlineQueries() const { return deadlineQueries; }
+    uint64_t getRejectedQueries() const { return rejectedQueries; }
+    size_t getQueuedQueries(QueryPriority priority) const;
+    size_t getPeakQueuedQueries() const { return peakQueuedTasks; }
+    uint32_t getActiveQueries() const;
+    // Worker threads, plus the HTTP I/O thread in async mode.
+    uint32_t getWorkerThreads() const;
+    uint32_t getConcurrencyLimit() const;
+    uint64_t getRetriedQueries() const { return retriedQueries; }
+    // Joins the workers of replaced pools that have exited by now, so a
+    // reload does not leave their threads behind. World thread.
+    void reapRetiredWorkers();
+    // Drops queued work and joins all worker threads.
+    void shutdown();
 
 private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Flight;
+
     struct QueryTask {
         std::string prompt;
-        std::promise<std::string> promise;
+        std::string systemPrompt;
+        QueryResponseCallback callback;
+        QueryChunkCallback onChunk;
+        QueryPriority priority = QueryPriority::RealPlayer;
+        Clock::time_point enqueued;
+        uint64_t flightKey = 0;
+        std::shared_ptr<Flight> flight;     // set if this query leads a flight
+        std::shared_ptr<QueryControl> control;
+        uint32_t attempt = 0;
+        Clock::time_point retryAt;          // earliest start of a retry
+        Clock::time_point started;          // of the current attempt
+        // Where the current attempt runs; while waiting for a retry, the
+        // endpoint that failed it.
+        std::shared_ptr<ChatEndpoint> endpoint;
     };
 
-    void processQuery(const std::string& prompt, std::promise<std::string> promise);
+    // A request shared by every query submitted with its dedup key while it runs.
+    struct Flight {
+        struct Follower {
+            std::string botName;
+            QueryResponseCallback callback;
+            QueryChunkCallback onChunk;
+        };
+
+        std::mutex mutex;
+        std::string leaderName;
+        QueryPriority priority;
+        std::shared_ptr<QueryControl> control;   // the leader's
+        std::vector<std::string> chunks;    // lines said so far, replayed to late followers
+        std::vector<Follower> followers;
+        bool finished = false;
+        std::string result;
+    };
+
+    void joinFlight(const std::shared_ptr<Flight>& flight, Flight::Follower follower);
+    void deliverFlightChunk(const std::shared_ptr<Flight>& flight, const QueryChunkCallback& onChunk, std::string chunk);
+    void finishFlight(uint64_t key, const std::shared_ptr<Flight>& flight, const QueryResponseCallback& callback, std::string result);
+
+    void startWorkers(uint32_t count, uint32_t inFlight, bool async);
+    void workerLoop(uint32_t workerGeneration);
+    bool hasRunnableTask() const;
+    bool takeNextTask(QueryTask& task);
+    void dropStaleTasks(Clock::time_point now);
+    bool makeRoomFor(QueryPriority priority);
+    void dropTask(QueryTask& task, const char* reason);
+    void finishQuery(QueryTask& task, std::string result, bool async);
+    bool recordOutcome(QueryTask& task, Clock::time_point now);
+    void promoteRetries(Clock::time_point now);
+    uint32_t classLimit(size_t cls) const;
+    void processQuery(QueryTask& task);
+    void dispatchAsyncQuery(QueryTask& task);
+    bool hasFreeSlot() const;
+    Clock::time_point nextWakeup() const;
+    uint32_t slotCount() const;
+    uint32_t concurrencyLimit() const;
+    size_t queueCapacity() const;
 
-    int maxConcurrentQueries; // 0 means no limit
-    int currentQueries;
-    std::mutex mutex_;
-    std::queue<QueryTask> taskQueue;
+    bool asyncDispatch;         // requested mode
+    bool runningAsync;          // mode of the running workers
+    uint32_t workerCount;
+    uint32_t maxInFlight;       // async mode only
+    uint32_t inFlight;          // async mode only
+    int maxQueuedQueries; // 0 means derived from workerCount
+    uint32_t generation;
+    bool stopping;
+    bool singleFlight;
+    std::atomic<uint64_t> coalescedQueries;
+    std::unordered_map<uint64_t, std::shared_ptr<Flight>> flights;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::array<std::deque<QueryTask>, QUERY_PRIORITY_COUNT> taskQueues;
+    size_t queuedTasks;
+    std::atomic<size_t> peakQueuedTasks;
+    std::array<uint32_t, QUERY_PRIORITY_COUNT> activePerClass;
+    uint32_t activeTotal;
+    // Failed queries waiting for their backoff; they go back to the front
+    // of their class queue when it has passed.
+    std::vector<QueryTask> retryTasks;
+    bool adaptiveConcurrency;
+    double adaptiveLimit;
+    Clock::time_point lastDecrease;
+    uint32_t maxRetries;
+    uint32_t retryBaseDelayMs;
+    std::atomic<uint64_t> retriedQueries;
+    std::array<uint32_t, QUERY_PRIORITY_COUNT> classQuota;       // percent of the slots
+    std::array<uint32_t, QUERY_PRIORITY_COUNT> classMaxQueueAge; // seconds
+    std::array<uint32_t, QUERY_PRIORITY_COUNT> classDeadline;    // seconds
+    std::array<std::atomic<uint64_t>, QUERY_PRIORITY_COUNT> droppedQueries;
+    std::atomic<uint64_t> cancelledQueries;
+    std::atomic<uint64_t> expiredQueries;   // waited longer than their class allows
+    std::atomic<uint64_t> deadlineQueries;  // still queued when their deadline passed
+    std::atomic<uint64_t> rejectedQueries;  // queue full, nothing less urgent to displace
+    // Controls of the queries each bot owns, for cancelQueriesFor.
+    std::unordered_map<uint64_t, std::vector<std::weak_ptr<QueryControl>>> ownedQueries;
+    std::vector<std::thread> workers;
+    std::vector<std::thread> retiredWorkers;
+    std::vector<std::thread::id> exitedWorkers;  // retired workers that left workerLoop
 };
 
 #endif // MOD_OLLAMA_CHAT_QUERYMANAGER_H
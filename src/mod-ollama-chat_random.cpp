@@ -7,17 +7,25 @@
 #include "PlayerbotMgr.h"
 #include "ObjectAccessor.h"
 #include "Chat.h"
-#include "fmt/core.h"
 #include "mod-ollama-chat_api.h"
+#include "mod-ollama-chat_bench.h"
 #include "mod-ollama-chat_personality.h"
+#include "mod-ollama-chat_cache.h"
+#include "mod-ollama-chat_playerindex.h"
+#include "mod-ollama-chat_template.h"
+#include "mod-ollama-chat_metrics.h"
 #include "GridNotifiersImpl.h"
 #include "CellImpl.h"
 #include "Map.h"
 #include "GridNotifiers.h"
+#include <algorithm>
 #include <vector>
 #include <random>
-#include <thread>
 #include <ctime>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
 #include "Item.h"
 #include "Bag.h"
 #include "SpellMgr.h"
@@ -28,11 +36,100 @@
 
 OllamaBotRandomChatter::OllamaBotRandomChatter() : WorldScript("OllamaBotRandomChatter") {}
 
-std::unordered_map<uint64_t, time_t> nextRandomChatTime;
+// How often the surroundings of a real player are searched for bots, and how
+// long a due bot that may not chatter yet waits before it is looked at again.
+static constexpr time_t RANDOM_CHATTER_SCAN_INTERVAL = 30;
+
+// Next chatter time of every bot found near a real player, in a min-heap so
+// that an update only looks at the bots that are due. Rescheduling does not
+// look for the old heap entry; stale entries are skipped when they come up.
+// World thread only.
+class RandomChatterSchedule {
+public:
+    // Schedules the bot unless it is scheduled already.
+    void add(uint64_t guid, time_t due)
+    {
+        if (dueTimes.try_emplace(guid, due).second)
+            heap.emplace(due, guid);
+    }
+
+    void reschedule(uint64_t guid, time_t due)
+    {
+        dueTimes[guid] = due;
+        heap.emplace(due, guid);
+    }
+
+    void remove(uint64_t guid) { dueTimes.erase(guid); }
+
+    // Takes the next bot due at now out of the schedule.
+    bool popDue(time_t now, uint64_t& guid)
+    {
+        while (!heap.empty() && heap.top().first <= now)
+        {
+            auto [due, next] = heap.top();
+            heap.pop();
+            auto it = dueTimes.find(next);
+            if (it == dueTimes.end() || it->second != due)
+                continue;
+            dueTimes.erase(it);
+            guid = next;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    std::unordered_map<uint64_t, time_t> dueTimes;
+    std::priority_queue<std::pair<time_t, uint64_t>, std::vector<std::pair<time_t, uint64_t>>,
+                        std::greater<std::pair<time_t, uint64_t>>> heap;
+};
+
+// Per real player: when to search its surroundings next, and how many bots
+// were considered for chatter near it in the current scan interval.
+struct RealPlayerChatter
+{
+    time_t nextScan = 0;
+    time_t windowEnd = 0;
+    uint32_t botsConsidered = 0;
+};
+
+static RandomChatterSchedule g_RandomChatterSchedule;
+static std::unordered_map<uint64_t, RealPlayerChatter> g_RealPlayerChatter;
+
+// Logouts may be reported off the world thread; they are applied on the next update.
+static std::mutex g_RandomChatterLogoutsMutex;
+static std::vector<uint64_t> g_RandomChatterLogouts;
+
+void ForgetRandomChatterPlayer(uint64_t guid)
+{
+    std::lock_guard<std::mutex> lock(g_RandomChatterLogoutsMutex);
+    g_RandomChatterLogouts.push_back(guid);
+}
+
+static void SubmitRandomChatter(Player* bot, PlayerbotAI* ai);
 
-void OllamaBotRandomChatter::OnUpdate(uint32 diff)
+void OllamaBotRandomChatter::OnUpdate(uint32 /*diff*/)
 {
-    if (!g_Enable || !g_EnableRandomChatter)
+    // The player index is valid for one world update.
+    g_PlayerIndex.invalidate();
+
+    std::vector<uint64_t> logouts;
+    {
+        std::lock_guard<std::mutex> lock(g_RandomChatterLogoutsMutex);
+        logouts.swap(g_RandomChatterLogouts);
+    }
+    for (uint64_t guid : logouts)
+    {
+        g_RandomChatterSchedule.remove(guid);
+        g_RealPlayerChatter.erase(guid);
+    }
+
+    // .ollama bench runs even with the module disabled.
+    UpdateChatBenchmark();
+    // A reload may have replaced the query pool, even one that disabled the module.
+    g_queryManager.reapRetiredWorkers();
+
+    if (!g_Enable)
         return;
 
     if (g_ConversationHistorySaveInterval > 0)
@@ -45,496 +142,518 @@ void OllamaBotRandomChatter::OnUpdate(uint32 diff)
         }
     }
 
-    static uint32_t timer = 0;
-    if (timer <= diff)
-    {
-        timer = 30000; // ~30-second check
-        HandleRandomChatter();
-    }
-    else
-    {
-        timer -= diff;
-    }
+    UpdateBotConversationHistory();
+    SaveBotPersonalityAssignments();
+    LogChatMetrics();
+
+    if (!g_EnableRandomChatter)
+        return;
+
+    HandleRandomChatter();
 }
 
+// Each update handles at most RandomChatterBotsPerUpdate real player
+// surroundings and due bots, so the work is spread over the updates. Half of
+// it (rounded down) is kept for due bots, so a burst of scans cannot hold
+// them back; what the scans leave over goes to due bots as well.
 void OllamaBotRandomChatter::HandleRandomChatter()
 {
-    auto const& allPlayers = ObjectAccessor::GetPlayers();
+    time_t now = time(nullptr);
+    uint32_t budget = g_RandomChatterBotsPerUpdate > 0 ? g_RandomChatterBotsPerUpdate : UINT32_MAX;
+    uint32_t scanBudget = g_RandomChatterBotsPerUpdate > 0 ? budget - budget / 2 : UINT32_MAX;
 
-    // Find all real players
+    // Bots near a real player enter the schedule the first time they are seen.
     std::vector<Player*> realPlayers;
-    for (auto const& itr : allPlayers)
-    {
-        Player* player = itr.second;
-        if (!player->IsInWorld()) continue;
-        if (!sPlayerbotsMgr->GetPlayerbotAI(player))
-            realPlayers.push_back(player);
-    }
-
-    std::unordered_set<uint64_t> processedBotsThisTick;
-
-    // For each real player, process up to N bots in range
+    g_PlayerIndex.getRealPlayers(realPlayers);
     for (Player* realPlayer : realPlayers)
     {
-        // Gather all bots within range of this real player
-        std::vector<Player*> botsInRange;
-        for (auto const& itr : allPlayers)
+        if (scanBudget == 0)
+            break;
+
+        RealPlayerChatter& state = g_RealPlayerChatter[realPlayer->GetGUID().GetRawValue()];
+        if (now < state.nextScan)
+            continue;
+        state.nextScan = now + RANDOM_CHATTER_SCAN_INTERVAL;
+        --scanBudget;
+        --budget;
+
+        std::vector<Player*> nearbyPlayers;
+        GetPlayersInRange(realPlayer, g_RandomChatterRealPlayerDistance, nearbyPlayers);
+        for (Player* bot : nearbyPlayers)
         {
-            Player* bot = itr.second;
-            PlayerbotAI* ai = sPlayerbotsMgr->GetPlayerbotAI(bot);
-            if (!ai) continue;
+            if (!sPlayerbotsMgr->GetPlayerbotAI(bot)) continue;
             if (!bot->IsInWorld() || bot->IsBeingTeleported()) continue;
-            if (bot->GetDistance(realPlayer) > g_RandomChatterRealPlayerDistance) continue;
-            if (processedBotsThisTick.count(bot->GetGUID().GetRawValue())) continue; // No double-processing
-            botsInRange.push_back(bot);
+            g_RandomChatterSchedule.add(bot->GetGUID().GetRawValue(), now + urand(g_MinRandomInterval, g_MaxRandomInterval));
         }
+    }
 
-        std::shuffle(botsInRange.begin(), botsInRange.end(), std::mt19937(std::random_device()()));
-
-        uint32_t botsToProcess = std::min((uint32_t)botsInRange.size(), g_RandomChatterMaxBotsPerPlayer);
-        for (uint32_t i = 0; i < botsToProcess; ++i)
+    uint64_t guid;
+    while (budget > 0 && g_RandomChatterSchedule.popDue(now, guid))
+    {
+        --budget;
+
+        // Bots that left or are no longer near a real player drop out of the
+        // schedule until a scan finds them again.
+        Player* bot = ObjectAccessor::FindPlayer(ObjectGuid(guid));
+        PlayerbotAI* ai = bot ? sPlayerbotsMgr->GetPlayerbotAI(bot) : nullptr;
+        if (!ai || !bot->IsInWorld() || bot->IsBeingTeleported())
+            continue;
+
+        std::vector<Player*> nearbyPlayers;
+        GetPlayersInRange(bot, g_RandomChatterRealPlayerDistance, nearbyPlayers);
+        bool realPlayerNearby = false;
+        RealPlayerChatter* listener = nullptr;
+        time_t retry = now + RANDOM_CHATTER_SCAN_INTERVAL;
+        for (Player* player : nearbyPlayers)
         {
-            Player* bot = botsInRange[i];
-            if (g_DisableRepliesInCombat && bot->IsInCombat())
+            if (sPlayerbotsMgr->GetPlayerbotAI(player)) continue;
+            realPlayerNearby = true;
+
+            // At most RandomChatterMaxBotsPerPlayer bots per scan interval are
+            // considered for each real player.
+            RealPlayerChatter& state = g_RealPlayerChatter[player->GetGUID().GetRawValue()];
+            if (now >= state.windowEnd)
             {
-                continue;
+                state.windowEnd = now + RANDOM_CHATTER_SCAN_INTERVAL;
+                state.botsConsidered = 0;
             }
-            
-            PlayerbotAI* ai = sPlayerbotsMgr->GetPlayerbotAI(bot);
-            uint64_t guid = bot->GetGUID().GetRawValue();
-
-            processedBotsThisTick.insert(guid);
-
-            time_t now = time(nullptr);
-
-            if (nextRandomChatTime.find(guid) == nextRandomChatTime.end())
+            if (state.botsConsidered < g_RandomChatterMaxBotsPerPlayer)
             {
-                nextRandomChatTime[guid] = now + urand(g_MinRandomInterval, g_MaxRandomInterval);
-                continue;
+                listener = &state;
+                break;
             }
+            retry = std::min(retry, state.windowEnd);
+        }
+        if (!realPlayerNearby)
+            continue;
 
-            if (now < nextRandomChatTime[guid])
-                continue;
+        if (!listener || (g_DisableRepliesInCombat && bot->IsInCombat()))
+        {
+            g_RandomChatterSchedule.reschedule(guid, retry);
+            continue;
+        }
+        ++listener->botsConsidered;
 
-            if(urand(0, 99) > g_RandomChatterBotCommentChance)
-                continue;
+        if(urand(0, 99) > g_RandomChatterBotCommentChance)
+        {
+            g_RandomChatterSchedule.reschedule(guid, now + RANDOM_CHATTER_SCAN_INTERVAL);
+            continue;
+        }
 
-            std::string environmentInfo;
-            std::vector<std::string> candidateComments;
+        SubmitRandomChatter(bot, ai);
+        g_RandomChatterSchedule.reschedule(guid, now + urand(g_MinRandomInterval, g_MaxRandomInterval));
+    }
+}
 
-            // Check for nearby creature within g_SayDistance
-            {
-                Unit* unitInRange = nullptr;
-                Acore::AnyUnitInObjectRangeCheck creatureCheck(bot, g_SayDistance);
-                Acore::UnitSearcher<Acore::AnyUnitInObjectRangeCheck> creatureSearcher(bot, unitInRange, creatureCheck);
-                Cell::VisitGridObjects(bot, creatureSearcher, g_SayDistance);
-                if (unitInRange && unitInRange->GetTypeId() == TYPEID_UNIT)
-                    if (!g_EnvCommentCreature.empty()) {
-                        uint32_t idx = g_EnvCommentCreature.size() == 1 ? 0 : urand(0, g_EnvCommentCreature.size() - 1);
-                        std::string templ = g_EnvCommentCreature[idx];
-                        candidateComments.push_back(fmt::format(templ, fmt::arg("creature_name", unitInRange->ToCreature()->GetName())));
-                    }
+// A random entry of a compiled comment list, or null if the list is empty.
+static const PromptTemplate* PickEnvComment(const std::vector<PromptTemplate>& comments)
+{
+    if (comments.empty())
+        return nullptr;
+    return &comments[comments.size() == 1 ? 0 : urand(0, comments.size() - 1)];
+}
+
+// Picks something about the bot or its surroundings to talk about and asks for the line.
+static void SubmitRandomChatter(Player* bot, PlayerbotAI* ai)
+{
+    std::string environmentInfo;
+    std::vector<std::string> candidateComments;
 
+    // Check for nearby creature within g_SayDistance
+    {
+        Unit* unitInRange = nullptr;
+        Acore::AnyUnitInObjectRangeCheck creatureCheck(bot, g_SayDistance);
+        Acore::UnitSearcher<Acore::AnyUnitInObjectRangeCheck> creatureSearcher(bot, unitInRange, creatureCheck);
+        Cell::VisitGridObjects(bot, creatureSearcher, g_SayDistance);
+        if (unitInRange && unitInRange->GetTypeId() == TYPEID_UNIT)
+            if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentCreature)) {
+                candidateComments.push_back(comment->render({ unitInRange->ToCreature()->GetName() }));
             }
 
-            // Check for nearby game object within g_SayDistance
-            {
-                Acore::GameObjectInRangeCheck goCheck(bot->GetPositionX(), bot->GetPositionY(), bot->GetPositionZ(), g_SayDistance);
-                GameObject* goInRange = nullptr;
-                Acore::GameObjectSearcher<Acore::GameObjectInRangeCheck> goSearcher(bot, goInRange, goCheck);
-                Cell::VisitGridObjects(bot, goSearcher, g_SayDistance);
-                if (goInRange)
-                {
-                    if (!g_EnvCommentGameObject.empty()) {
-                        uint32_t idx = g_EnvCommentGameObject.size() == 1 ? 0 : urand(0, g_EnvCommentGameObject.size() - 1);
-                        std::string templ = g_EnvCommentGameObject[idx];
-                        std::string gameObjectName = goInRange->GetName();
-                        candidateComments.push_back(fmt::format(templ, fmt::arg("object_name", gameObjectName)));
-                    }
-                }
+    }
 
+    // Check for nearby game object within g_SayDistance
+    {
+        Acore::GameObjectInRangeCheck goCheck(bot->GetPositionX(), bot->GetPositionY(), bot->GetPositionZ(), g_SayDistance);
+        GameObject* goInRange = nullptr;
+        Acore::GameObjectSearcher<Acore::GameObjectInRangeCheck> goSearcher(bot, goInRange, goCheck);
+        Cell::VisitGridObjects(bot, goSearcher, g_SayDistance);
+        if (goInRange)
+        {
+            if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentGameObject)) {
+                candidateComments.push_back(comment->render({ goInRange->GetName() }));
             }
+        }
 
-            // Check for a random equipped item
-            {
-                std::vector<Item*> equippedItems;
-                for (uint8_t slot = EQUIPMENT_SLOT_START; slot < EQUIPMENT_SLOT_END; ++slot)
-                {
-                    if (Item* item = bot->GetItemByPos(slot))
-                        equippedItems.push_back(item);
-                }
-                if (!equippedItems.empty())
-                {
-                    uint32_t eqIdx = equippedItems.size() == 1 ? 0 : urand(0, equippedItems.size() - 1);
-                    Item* randomEquipped = equippedItems[eqIdx];
-                    if (!g_EnvCommentEquippedItem.empty()) {
-                        uint32_t tempIdx = g_EnvCommentEquippedItem.size() == 1 ? 0 : urand(0, g_EnvCommentEquippedItem.size() - 1);
-                        std::string templ = g_EnvCommentEquippedItem[tempIdx];
-                        candidateComments.push_back(fmt::format(templ, fmt::arg("item_name", randomEquipped->GetTemplate()->Name1)));
-                    }
-                }
+    }
 
+    // Check for a random equipped item
+    {
+        std::vector<Item*> equippedItems;
+        for (uint8_t slot = EQUIPMENT_SLOT_START; slot < EQUIPMENT_SLOT_END; ++slot)
+        {
+            if (Item* item = bot->GetItemByPos(slot))
+                equippedItems.push_back(item);
+        }
+        if (!equippedItems.empty())
+        {
+            uint32_t eqIdx = equippedItems.size() == 1 ? 0 : urand(0, equippedItems.size() - 1);
+            Item* randomEquipped = equippedItems[eqIdx];
+            if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentEquippedItem)) {
+                candidateComments.push_back(comment->render({ randomEquipped->GetTemplate()->Name1 }));
             }
+        }
+
+    }
 
-            // Check for a random bag item (iterating over bag slots 0 to 4)
+    // Check for a random bag item (iterating over bag slots 0 to 4)
+    {
+        std::vector<Item*> bagItems;
+        for (uint32_t bagSlot = 0; bagSlot < 5; ++bagSlot)
+        {
+            if (Bag* bag = bot->GetBagByPos(bagSlot))
             {
-                std::vector<Item*> bagItems;
-                for (uint32_t bagSlot = 0; bagSlot < 5; ++bagSlot)
-                {
-                    if (Bag* bag = bot->GetBagByPos(bagSlot))
-                    {
-                        for (uint32_t i = 0; i < bag->GetBagSize(); ++i)
-                        {
-                            if (Item* bagItem = bag->GetItemByPos(i))
-                                bagItems.push_back(bagItem);
-                        }
-                    }
-                }
-                if (!bagItems.empty())
+                for (uint32_t i = 0; i < bag->GetBagSize(); ++i)
                 {
-                    uint32_t bagIdx = bagItems.size() == 1 ? 0 : urand(0, bagItems.size() - 1);
-                    Item* randomBagItem = bagItems[bagIdx];
-                    if (!g_EnvCommentBagItem.empty()) {
-                        uint32_t tempIdx = g_EnvCommentBagItem.size() == 1 ? 0 : urand(0, g_EnvCommentBagItem.size() - 1);
-                        std::string templ = g_EnvCommentBagItem[tempIdx];
-                        candidateComments.push_back(fmt::format(templ,
-                            fmt::arg("item_count", randomBagItem->GetCount()),
-                            fmt::arg("item_description", ai->GetChatHelper()->FormatItem(randomBagItem->GetTemplate(), randomBagItem->GetCount()))
-                        ));
-                    }
-                    if (!g_EnvCommentBagItemSell.empty()) {
-                        uint32_t tempIdx = g_EnvCommentBagItemSell.size() == 1 ? 0 : urand(0, g_EnvCommentBagItemSell.size() - 1);
-                        std::string templ = g_EnvCommentBagItemSell[tempIdx];
-                        candidateComments.push_back(fmt::format(templ,
-                            fmt::arg("item_count", randomBagItem->GetCount()),
-                            fmt::arg("item_description", ai->GetChatHelper()->FormatItem(randomBagItem->GetTemplate(), randomBagItem->GetCount()))
-                        ));
-                    }
+                    if (Item* bagItem = bag->GetItemByPos(i))
+                        bagItems.push_back(bagItem);
                 }
-
             }
+        }
+        if (!bagItems.empty())
+        {
+            uint32_t bagIdx = bagItems.size() == 1 ? 0 : urand(0, bagItems.size() - 1);
+            Item* randomBagItem = bagItems[bagIdx];
+            std::string itemCount = std::to_string(randomBagItem->GetCount());
+            std::string itemDescription = ai->GetChatHelper()->FormatItem(randomBagItem->GetTemplate(), randomBagItem->GetCount());
+            if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentBagItem)) {
+                candidateComments.push_back(comment->render({ itemCount, itemDescription }));
+            }
+            if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentBagItemSell)) {
+                candidateComments.push_back(comment->render({ itemCount, itemDescription }));
+            }
+        }
 
-            // Check for a random known spell
-            {
-                // Build a vector of valid "active" spells for this bot.
-                struct NamedSpell
-                {
-                    uint32 id;
-                    std::string name;
-                    std::string effect;
-                    std::string cost;
-                };
-                std::vector<NamedSpell> validSpells;
-                for (const auto& spellPair : bot->GetSpellMap())
-                {
-                    uint32 spellId = spellPair.first;
-                    const SpellInfo* spellInfo = sSpellMgr->GetSpellInfo(spellId);
-                    if (!spellInfo) continue;
-                    if (spellInfo->Attributes & SPELL_ATTR0_PASSIVE)
-                        continue;
-                    if (spellInfo->SpellFamilyName == SPELLFAMILY_GENERIC)
-                        continue;
-                    if (bot->HasSpellCooldown(spellId))
-                        continue;
-
-                    std::string effectText;
-                    for (int i = 0; i < MAX_SPELL_EFFECTS; ++i)
-                    {
-                        if (!spellInfo->Effects[i].IsEffect())
-                            continue;
-                        switch (spellInfo->Effects[i].Effect)
-                        {
-                            case SPELL_EFFECT_SCHOOL_DAMAGE: effectText = "Deals damage"; break;
-                            case SPELL_EFFECT_HEAL: effectText = "Heals the target"; break;
-                            case SPELL_EFFECT_APPLY_AURA: effectText = "Applies an effect"; break;
-                            case SPELL_EFFECT_DISPEL: effectText = "Dispels magic"; break;
-                            case SPELL_EFFECT_THREAT: effectText = "Generates threat"; break;
-                            default: continue;
-                        }
-                        if (!effectText.empty())
-                            break;
-                    }
-                    if (effectText.empty())
-                        continue;
-
-                    const char* name = spellInfo->SpellName[0];
-                    if (!name || !*name)
-                        continue;
-
-                    std::string costText;
-                    if (spellInfo->ManaCost || spellInfo->ManaCostPercentage)
-                    {
-                        switch (spellInfo->PowerType)
-                        {
-                            case POWER_MANA: costText = std::to_string(spellInfo->ManaCost) + " mana"; break;
-                            case POWER_RAGE: costText = std::to_string(spellInfo->ManaCost) + " rage"; break;
-                            case POWER_FOCUS: costText = std::to_string(spellInfo->ManaCost) + " focus"; break;
-                            case POWER_ENERGY: costText = std::to_string(spellInfo->ManaCost) + " energy"; break;
-                            case POWER_RUNIC_POWER: costText = std::to_string(spellInfo->ManaCost) + " runic power"; break;
-                            default: costText = std::to_string(spellInfo->ManaCost) + " unknown resource"; break;
-                        }
-                    }
-                    else
-                    {
-                        costText = "no cost";
-                    }
+    }
 
-                    validSpells.push_back({spellId, name, effectText, costText});
-                }
+    // Check for a random known spell
+    {
+        // Build a vector of valid "active" spells for this bot.
+        struct NamedSpell
+        {
+            uint32 id;
+            std::string name;
+            std::string effect;
+            std::string cost;
+        };
+        std::vector<NamedSpell> validSpells;
+        for (const auto& spellPair : bot->GetSpellMap())
+        {
+            uint32 spellId = spellPair.first;
+            const SpellInfo* spellInfo = sSpellMgr->GetSpellInfo(spellId);
+            if (!spellInfo) continue;
+            if (spellInfo->Attributes & SPELL_ATTR0_PASSIVE)
+                continue;
+            if (spellInfo->SpellFamilyName == SPELLFAMILY_GENERIC)
+                continue;
+            if (bot->HasSpellCooldown(spellId))
+                continue;
 
-                if (!validSpells.empty())
+            std::string effectText;
+            for (int i = 0; i < MAX_SPELL_EFFECTS; ++i)
+            {
+                if (!spellInfo->Effects[i].IsEffect())
+                    continue;
+                switch (spellInfo->Effects[i].Effect)
                 {
-                    uint32_t spellIdx = validSpells.size() == 1 ? 0 : urand(0, validSpells.size() - 1);
-                    const NamedSpell& randomSpell = validSpells[spellIdx];
-                    if (!g_EnvCommentSpell.empty())
-                    {
-                        uint32_t tempIdx = g_EnvCommentSpell.size() == 1 ? 0 : urand(0, g_EnvCommentSpell.size() - 1);
-                        std::string templ = g_EnvCommentSpell[tempIdx];
-                        candidateComments.push_back(fmt::format(
-                            templ,
-                            fmt::arg("spell_name", randomSpell.name),
-                            fmt::arg("spell_effect", randomSpell.effect),
-                            fmt::arg("spell_cost", randomSpell.cost)
-                        ));
-                    }
+                    case SPELL_EFFECT_SCHOOL_DAMAGE: effectText = "Deals damage"; break;
+                    case SPELL_EFFECT_HEAL: effectText = "Heals the target"; break;
+                    case SPELL_EFFECT_APPLY_AURA: effectText = "Applies an effect"; break;
+                    case SPELL_EFFECT_DISPEL: effectText = "Dispels magic"; break;
+                    case SPELL_EFFECT_THREAT: effectText = "Generates threat"; break;
+                    default: continue;
                 }
-
+                if (!effectText.empty())
+                    break;
             }
+            if (effectText.empty())
+                continue;
 
+            const char* name = spellInfo->SpellName[0];
+            if (!name || !*name)
+                continue;
 
-            // Check for an area to quest in.
+            std::string costText;
+            if (spellInfo->ManaCost || spellInfo->ManaCostPercentage)
             {
-                std::vector<std::string> questAreas;
-                for (auto const& qkv : sObjectMgr->GetQuestTemplates())
+                switch (spellInfo->PowerType)
                 {
-                    Quest const* qt = qkv.second;
-                    if (!qt) continue;
-                    int32 qlevel = qt->GetQuestLevel();
-                    int32 plevel = bot->GetLevel();
-                    if (qlevel < plevel - 2 || qlevel > plevel + 2)
-                        continue;
-                    uint32 zone = qt->GetZoneOrSort();
-                    if (zone == 0) continue;
-                    if (auto const* area = sAreaTableStore.LookupEntry(zone))
-                    {
-                        if (!g_EnvCommentQuestArea.empty()) {
-                            uint32_t idx = g_EnvCommentQuestArea.size() == 1 ? 0 : urand(0, g_EnvCommentQuestArea.size() - 1);
-                            std::string templ = g_EnvCommentQuestArea[idx];
-                            questAreas.push_back(fmt::format(templ, fmt::arg("quest_area", area->area_name[LocaleConstant::LOCALE_enUS])));
-                        }
-
-                    }
-                }
-                if (!questAreas.empty())
-                {
-                    uint32_t qIdx = questAreas.size() == 1 ? 0 : urand(0, questAreas.size() - 1);
-                    candidateComments.push_back(questAreas[qIdx]);
+                    case POWER_MANA: costText = std::to_string(spellInfo->ManaCost) + " mana"; break;
+                    case POWER_RAGE: costText = std::to_string(spellInfo->ManaCost) + " rage"; break;
+                    case POWER_FOCUS: costText = std::to_string(spellInfo->ManaCost) + " focus"; break;
+                    case POWER_ENERGY: costText = std::to_string(spellInfo->ManaCost) + " energy"; break;
+                    case POWER_RUNIC_POWER: costText = std::to_string(spellInfo->ManaCost) + " runic power"; break;
+                    default: costText = std::to_string(spellInfo->ManaCost) + " unknown resource"; break;
                 }
+            }
+            else
+            {
+                costText = "no cost";
+            }
 
+            validSpells.push_back({spellId, name, effectText, costText});
+        }
 
+        if (!validSpells.empty())
+        {
+            uint32_t spellIdx = validSpells.size() == 1 ? 0 : urand(0, validSpells.size() - 1);
+            const NamedSpell& randomSpell = validSpells[spellIdx];
+            if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentSpell))
+            {
+                candidateComments.push_back(comment->render({ randomSpell.name, randomSpell.effect, randomSpell.cost }));
             }
+        }
 
-            // Check for Vendor nearby
-            {
-                Unit* unit = nullptr;
-                Acore::AnyUnitInObjectRangeCheck check(bot, g_SayDistance);
-                Acore::UnitSearcher<Acore::AnyUnitInObjectRangeCheck> searcher(bot, unit, check);
-                Cell::VisitGridObjects(bot, searcher, g_SayDistance);
+    }
 
-                if (unit && unit->GetTypeId() == TYPEID_UNIT)
-                {
-                    Creature* vendor = unit->ToCreature();
-                    if (vendor->HasNpcFlag(UNIT_NPC_FLAG_VENDOR))
-                    {
-                        if (!g_EnvCommentVendor.empty()) {
-                            uint32_t idx = g_EnvCommentVendor.size() == 1 ? 0 : urand(0, g_EnvCommentVendor.size() - 1);
-                            std::string templ = g_EnvCommentVendor[idx];
-                            candidateComments.push_back(fmt::format(templ, fmt::arg("vendor_name", vendor->GetName())));
-                        }
-                    }
-                }
-            }
 
-            // Check for Questgiver nearby
+    // Check for an area to quest in.
+    {
+        std::vector<std::string> questAreas;
+        for (auto const& qkv : sObjectMgr->GetQuestTemplates())
+        {
+            Quest const* qt = qkv.second;
+            if (!qt) continue;
+            int32 qlevel = qt->GetQuestLevel();
+            int32 plevel = bot->GetLevel();
+            if (qlevel < plevel - 2 || qlevel > plevel + 2)
+                continue;
+            uint32 zone = qt->GetZoneOrSort();
+            if (zone == 0) continue;
+            if (auto const* area = sAreaTableStore.LookupEntry(zone))
             {
-                Unit* unit = nullptr;
-                Acore::AnyUnitInObjectRangeCheck check(bot, g_SayDistance);
-                Acore::UnitSearcher<Acore::AnyUnitInObjectRangeCheck> searcher(bot, unit, check);
-                Cell::VisitGridObjects(bot, searcher, g_SayDistance);
-
-                if (unit && unit->GetTypeId() == TYPEID_UNIT)
-                {
-                    Creature* giver = unit->ToCreature();
-                    if (giver->HasNpcFlag(UNIT_NPC_FLAG_QUESTGIVER))
-                    {
-                        auto bounds = sObjectMgr->GetCreatureQuestRelationBounds(giver->GetEntry());
-                        int n       = std::distance(bounds.first, bounds.second);
-                        if (!g_EnvCommentQuestgiver.empty()) {
-                            uint32_t idx = g_EnvCommentQuestgiver.size() == 1 ? 0 : urand(0, g_EnvCommentQuestgiver.size() - 1);
-                            std::string templ = g_EnvCommentQuestgiver[idx];
-                            candidateComments.push_back(fmt::format(templ,
-                                fmt::arg("questgiver_name", giver->GetName()),
-                                fmt::arg("quest_count", n)
-                            ));
-                        }
-                    }
+                if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentQuestArea)) {
+                    questAreas.push_back(comment->render({ area->area_name[LocaleConstant::LOCALE_enUS] }));
                 }
+
             }
+        }
+        if (!questAreas.empty())
+        {
+            uint32_t qIdx = questAreas.size() == 1 ? 0 : urand(0, questAreas.size() - 1);
+            candidateComments.push_back(questAreas[qIdx]);
+        }
+
+
+    }
 
-            // Check for Free bag slots (manual count)
+    // Check for Vendor nearby
+    {
+        Unit* unit = nullptr;
+        Acore::AnyUnitInObjectRangeCheck check(bot, g_SayDistance);
+        Acore::UnitSearcher<Acore::AnyUnitInObjectRangeCheck> searcher(bot, unit, check);
+        Cell::VisitGridObjects(bot, searcher, g_SayDistance);
+
+        if (unit && unit->GetTypeId() == TYPEID_UNIT)
+        {
+            Creature* vendor = unit->ToCreature();
+            if (vendor->HasNpcFlag(UNIT_NPC_FLAG_VENDOR))
             {
-                int freeSlots = 0;
-                for (uint8 i = INVENTORY_SLOT_ITEM_START; i < INVENTORY_SLOT_ITEM_END; ++i)
-                    if (!bot->GetItemByPos(i))
-                        ++freeSlots;
-                for (uint8 b = INVENTORY_SLOT_BAG_START; b < INVENTORY_SLOT_BAG_END; ++b)
-                    if (Bag* bag = bot->GetBagByPos(b))
-                        freeSlots += bag->GetFreeSlots();
-
-                if (!g_EnvCommentBagSlots.empty()) {
-                    uint32_t idx = g_EnvCommentBagSlots.size() == 1 ? 0 : urand(0, g_EnvCommentBagSlots.size() - 1);
-                    std::string templ = g_EnvCommentBagSlots[idx];
-                    candidateComments.push_back(fmt::format(templ, fmt::arg("bag_slots", freeSlots)));
+                if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentVendor)) {
+                    candidateComments.push_back(comment->render({ vendor->GetName() }));
                 }
             }
+        }
+    }
+
+    // Check for Questgiver nearby
+    {
+        Unit* unit = nullptr;
+        Acore::AnyUnitInObjectRangeCheck check(bot, g_SayDistance);
+        Acore::UnitSearcher<Acore::AnyUnitInObjectRangeCheck> searcher(bot, unit, check);
+        Cell::VisitGridObjects(bot, searcher, g_SayDistance);
 
-            // Check for Dungeon context
+        if (unit && unit->GetTypeId() == TYPEID_UNIT)
+        {
+            Creature* giver = unit->ToCreature();
+            if (giver->HasNpcFlag(UNIT_NPC_FLAG_QUESTGIVER))
             {
-                if (bot->GetMap() && bot->GetMap()->IsDungeon())
-                {
-                    std::string name = bot->GetMap()->GetMapName();
-                    if (!g_EnvCommentDungeon.empty()) {
-                        uint32_t idx = g_EnvCommentDungeon.size() == 1 ? 0 : urand(0, g_EnvCommentDungeon.size() - 1);
-                        std::string templ = g_EnvCommentDungeon[idx];
-                        candidateComments.push_back(fmt::format(templ, fmt::arg("dungeon_name", name)));
-                    }
+                auto bounds = sObjectMgr->GetCreatureQuestRelationBounds(giver->GetEntry());
+                int n       = std::distance(bounds.first, bounds.second);
+                if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentQuestgiver)) {
+                    candidateComments.push_back(comment->render({ giver->GetName(), std::to_string(n) }));
                 }
             }
+        }
+    }
 
-            // Check for Random incomplete quest in log
-            {
-                std::vector<std::string> unfinished;
-                for (auto const& qs : bot->getQuestStatusMap())
-                {
-                    if (qs.second.Status == QUEST_STATUS_INCOMPLETE)
-                    {
-                        if (auto* qt = sObjectMgr->GetQuestTemplate(qs.first))
-                            if (!g_EnvCommentUnfinishedQuest.empty()) {
-                                uint32_t idx = g_EnvCommentUnfinishedQuest.size() == 1 ? 0 : urand(0, g_EnvCommentUnfinishedQuest.size() - 1);
-                                std::string templ = g_EnvCommentUnfinishedQuest[idx];
-                                unfinished.push_back(fmt::format(templ, fmt::arg("quest_name", qt->GetTitle())));
-                            }
-                    }
-                }
-                if (!unfinished.empty())
-                {
-                    uint32_t uIdx = unfinished.size() == 1 ? 0 : urand(0, unfinished.size() - 1);
-                    candidateComments.push_back(unfinished[uIdx]);
-                }
+    // Check for Free bag slots (manual count)
+    {
+        int freeSlots = 0;
+        for (uint8 i = INVENTORY_SLOT_ITEM_START; i < INVENTORY_SLOT_ITEM_END; ++i)
+            if (!bot->GetItemByPos(i))
+                ++freeSlots;
+        for (uint8 b = INVENTORY_SLOT_BAG_START; b < INVENTORY_SLOT_BAG_END; ++b)
+            if (Bag* bag = bot->GetBagByPos(b))
+                freeSlots += bag->GetFreeSlots();
+
+        if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentBagSlots)) {
+            candidateComments.push_back(comment->render({ std::to_string(freeSlots) }));
+        }
+    }
 
+    // Check for Dungeon context
+    {
+        if (bot->GetMap() && bot->GetMap()->IsDungeon())
+        {
+            std::string name = bot->GetMap()->GetMapName();
+            if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentDungeon)) {
+                candidateComments.push_back(comment->render({ name }));
             }
+        }
+    }
 
-            if (!candidateComments.empty())
-            {
-                uint32_t index = candidateComments.size() == 1 ? 0 : urand(0, candidateComments.size() - 1);
-                environmentInfo = candidateComments[index];
-            }
-            else
+    // Check for Random incomplete quest in log
+    {
+        std::vector<std::string> unfinished;
+        for (auto const& qs : bot->getQuestStatusMap())
+        {
+            if (qs.second.Status == QUEST_STATUS_INCOMPLETE)
             {
-                environmentInfo = "";
+                if (auto* qt = sObjectMgr->GetQuestTemplate(qs.first))
+                    if (const PromptTemplate* comment = PickEnvComment(g_CompiledEnvCommentUnfinishedQuest)) {
+                        unfinished.push_back(comment->render({ qt->GetTitle() }));
+                    }
             }
+        }
+        if (!unfinished.empty())
+        {
+            uint32_t uIdx = unfinished.size() == 1 ? 0 : urand(0, unfinished.size() - 1);
+            candidateComments.push_back(unfinished[uIdx]);
+        }
 
+    }
+
+    if (!candidateComments.empty())
+    {
+        uint32_t index = candidateComments.size() == 1 ? 0 : urand(0, candidateComments.size() - 1);
+        environmentInfo = candidateComments[index];
+    }
+    else
+    {
+        environmentInfo = "";
+    }
 
-            auto prompt = [bot, &environmentInfo]()
-            {
-                PlayerbotAI* botAI = sPlayerbotsMgr->GetPlayerbotAI(bot);
-                if (!botAI)
-                    return std::string("Error, no bot AI");
-
-                std::string personality         = GetBotPersonality(bot);
-                std::string personalityPrompt   = GetPersonalityPromptAddition(personality);
-                std::string botName             = bot->GetName();
-                uint32_t botLevel               = bot->GetLevel();
-                std::string botClass            = botAI->GetChatHelper()->FormatClass(bot->getClass());
-                std::string botRace             = botAI->GetChatHelper()->FormatRace(bot->getRace());
-                std::string botRole             = ChatHelper::FormatClass(bot, AiFactory::GetPlayerSpecTab(bot));
-                std::string botGender           = (bot->getGender() == 0 ? "Male" : "Female");
-                std::string botFaction          = (bot->GetTeamId() == TEAM_ALLIANCE ? "Alliance" : "Horde");
-
-                AreaTableEntry const* botCurrentArea = botAI->GetCurrentArea();
-                AreaTableEntry const* botCurrentZone = botAI->GetCurrentZone();
-                std::string botAreaName = botCurrentArea ? botAI->GetLocalizedAreaName(botCurrentArea) : "UnknownArea";
-                std::string botZoneName = botCurrentZone ? botAI->GetLocalizedAreaName(botCurrentZone) : "UnknownZone";
-                std::string botMapName  = bot->GetMap() ? bot->GetMap()->GetMapName() : "UnknownMap";
-
-                std::string prompt = fmt::format(
-                    g_RandomChatterPromptTemplate,
-                    fmt::arg("bot_name", botName),
-                    fmt::arg("bot_level", botLevel),
-                    fmt::arg("bot_class", botClass),
-                    fmt::arg("bot_race", botRace),
-                    fmt::arg("bot_gender", botGender),
-                    fmt::arg("bot_role", botRole),
-                    fmt::arg("bot_faction", botFaction),
-                    fmt::arg("bot_area", botAreaName),
-                    fmt::arg("bot_zone", botZoneName),
-                    fmt::arg("bot_map", botMapName),
-                    fmt::arg("bot_personality", personalityPrompt),
-                    fmt::arg("environment_info", environmentInfo)
-                );
-
-                return prompt;
-
-            }();
 
+    std::string systemPrompt;
+    auto prompt = [bot, &environmentInfo, &systemPrompt]()
+    {
+        PlayerbotAI* botAI = sPlayerbotsMgr->GetPlayerbotAI(bot);
+        if (!botAI)
+            return std::string("Error, no bot AI");
+
+        std::string personality         = GetBotPersonality(bot);
+        std::string personalityPrompt   = GetPersonalityPromptAddition(personality);
+        systemPrompt                    = g_CompiledRandomChatterSystemPrompt.render({ personalityPrompt });
+        std::string botName             = bot->GetName();
+        uint32_t botLevel               = bot->GetLevel();
+        std::string botClass            = botAI->GetChatHelper()->FormatClass(bot->getClass());
+        std::string botRace             = botAI->GetChatHelper()->FormatRace(bot->getRace());
+        std::string botRole             = ChatHelper::FormatClass(bot, AiFactory::GetPlayerSpecTab(bot));
+        std::string botGender           = (bot->getGender() == 0 ? "Male" : "Female");
+        std::string botFaction          = (bot->GetTeamId() == TEAM_ALLIANCE ? "Alliance" : "Horde");
+
+        AreaTableEntry const* botCurrentArea = botAI->GetCurrentArea();
+        AreaTableEntry const* botCurrentZone = botAI->GetCurrentZone();
+        std::string botAreaName = botCurrentArea ? botAI->GetLocalizedAreaName(botCurrentArea) : "UnknownArea";
+        std::string botZoneName = botCurrentZone ? botAI->GetLocalizedAreaName(botCurrentZone) : "UnknownZone";
+        std::string botMapName  = bot->GetMap() ? bot->GetMap()->GetMapName() : "UnknownMap";
+
+        std::string botLevelText = std::to_string(botLevel);
+        std::string prompt = g_CompiledRandomChatterPrompt.render({
+            botName, botLevelText, botClass, botRace, botGender, botRole, botFaction,
+            botAreaName, botZoneName, botMapName, personalityPrompt, environmentInfo });
+
+        return prompt;
+
+    }();
+
+    if(g_DebugEnabled)
+    {
+        LOG_INFO("server.loading", "Random Message Prompt: {} ", prompt);
+    }
+
+    uint64_t botGuid = bot->GetGUID().GetRawValue();
+
+    // The channel is chosen up front so that all streamed lines go to the same place.
+    bool sayInGeneral = false;
+    if (!bot->GetGroup())
+    {
+        std::vector<std::string> channels = {"General", "Say"};
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        std::uniform_int_distribution<size_t> dist(0, channels.size() - 1);
+        sayInGeneral = channels[dist(gen)] == "General";
+    }
+
+    auto sayChatter = [botGuid, sayInGeneral](const std::string& response)
+    {
+        if (response.empty()) return;
+        Player* botPtr = ObjectAccessor::FindPlayer(ObjectGuid(botGuid));
+        if (!botPtr) return;
+        PlayerbotAI* botAI = sPlayerbotsMgr->GetPlayerbotAI(botPtr);
+        if (!botAI) return;
+        if (botPtr->GetGroup())
+        {
+            botAI->SayToParty(response);
+        }
+        else if (!sayInGeneral)
+        {
+            if(g_DebugEnabled)
+            {
+                LOG_INFO("server.loading", "Bot Random Chatter Say: {}", response);
+            }
+            botAI->Say(response);
+        }
+        else
+        {
             if(g_DebugEnabled)
             {
-                LOG_INFO("server.loading", "Random Message Prompt: {} ", prompt);
+                LOG_INFO("server.loading", "Bot Random Chatter General: {}", response);
             }
+            botAI->SayToChannel(response, ChatChannelId::GENERAL);
+        }
+    };
 
-            uint64_t botGuid = bot->GetGUID().GetRawValue();
+    // Many bots end up with the same prompt; serve those from the response
+    // cache, or let them share the request that is already in flight.
+    std::string botName = bot->GetName();
+    uint64_t cacheKey = ResponseCache::makeKey(prompt, botName, systemPrompt);
+    std::string cachedResponse;
+    bool useCache = g_ResponseCache.isEnabled();
 
-            std::thread([botGuid, prompt]()
+    if (useCache && g_ResponseCache.lookup(cacheKey, botName, cachedResponse))
+    {
+        sayChatter(cachedResponse);
+    }
+    else
+    {
+        // Random chatter keeps no history; the full reply is only needed for the cache.
+        QueryResponseCallback storeInCache = nullptr;
+        if (useCache)
+        {
+            storeInCache = [cacheKey, botName](const std::string& response)
             {
-                Player* botPtr = ObjectAccessor::FindPlayer(ObjectGuid(botGuid));
-                if (!botPtr) return;
-                std::string response = QueryOllamaAPI(prompt);
-                if (response.empty()) return;
-                botPtr = ObjectAccessor::FindPlayer(ObjectGuid(botGuid));
-                if (!botPtr) return;
-                PlayerbotAI* botAI = sPlayerbotsMgr->GetPlayerbotAI(botPtr);
-                if (!botAI) return;
-                if (botPtr->GetGroup())
-                {
-                    botAI->SayToParty(response);
-                }
-                else
-                {
-                    std::vector<std::string> channels = {"General", "Say"};
-                    std::random_device rd;
-                    std::mt19937 gen(rd());
-                    std::uniform_int_distribution<size_t> dist(0, channels.size() - 1);
-                    std::string selectedChannel = channels[dist(gen)];
-                    if (selectedChannel == "Say")
-                    {
-                        if(g_DebugEnabled)
-                        {
-                            LOG_INFO("server.loading", "Bot Random Chatter Say: {}", response);
-                        }
-                        botAI->Say(response);
-                    }
-                    else if (selectedChannel == "General")
-                    {
-                        if(g_DebugEnabled)
-                        {
-                            LOG_INFO("server.loading", "Bot Random Chatter General: {}", response);
-                        }
-                        botAI->SayToChannel(response, ChatChannelId::GENERAL);
-                    }
-                }
-            }).detach();
-
-            nextRandomChatTime[guid] = now + urand(g_MinRandomInterval, g_MaxRandomInterval);
+                if (!IsQueryErrorReply(response))
+                    g_ResponseCache.store(cacheKey, botName, response);
+            };
         }
+        QueryOptions options;
+        options.dedupKey = cacheKey;
+        options.botName = botName;
+        options.priority = QueryPriority::RandomChatter;
+        options.ownerGuid = botGuid;
+        options.systemPrompt = std::move(systemPrompt);
+        SubmitQuery(std::move(prompt), std::move(storeInCache), std::move(sayChatter), std::move(options));
     }
 }
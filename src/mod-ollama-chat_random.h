@@ -2,6 +2,7 @@
 #define MOD_OLLAMA_CHAT_RANDOM_H
 
 #include "ScriptMgr.h"
+#include <cstdint>
 
 class OllamaBotRandomChatter : public WorldScript
 {
@@ -13,4 +14,7 @@ private:
     void HandleRandomChatter();
 };
 
+// Drops a logged out player from the random chatter schedule. Thread-safe.
+void ForgetRandomChatterPlayer(uint64_t guid);
+
 #endif // MOD_OLLAMA_CHAT_RANDOM_H
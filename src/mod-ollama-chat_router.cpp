@@ -0,0 +1,256 @@
+#include "mod-ollama-chat_router.h"
+#include "Log.h"
+#include "Random.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+
+ChatEndpointRouter g_ChatEndpointRouter;
+
+// Weight of the newest sample in an endpoint's latency and failure averages.
+static constexpr double LATENCY_SMOOTHING = 0.2;
+
+// How much a failure rate of 1 multiplies an endpoint's score by, on top of 1.
+static constexpr double FAILURE_PENALTY = 10.0;
+
+// Longest Retry-After pause we accept.
+static constexpr uint32_t MAX_RETRY_AFTER_SECONDS = 120;
+
+void ChatEndpointRouter::configure(std::vector<ChatEndpointPtr> newEndpoints)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    endpoints = std::move(newEndpoints);
+}
+
+void ChatEndpointRouter::setCircuitBreaker(uint32_t failures, uint32_t openSeconds)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    breakerFailures = failures;
+    breakerOpenSeconds = openSeconds;
+    for (const ChatEndpointPtr& endpoint : endpoints)
+    {
+        endpoint->consecutiveFailures = 0;
+        if (failures == 0)
+            endpoint->down = false;
+    }
+}
+
+// Up, or down long enough that a probe may go out, and neither paused nor full.
+bool ChatEndpointRouter::isUsable(const ChatEndpoint& endpoint, Clock::time_point now) const
+{
+    if (now < endpoint.pausedUntil)
+        return false;
+    if (endpoint.down && (now < endpoint.downUntil || endpoint.probing))
+        return false;
+    return endpoint.maxConcurrent == 0 || endpoint.inFlight < endpoint.maxConcurrent;
+}
+
+// Expected cost of a query on an endpoint. One without a successful reply yet
+// is taken to be as fast as the others on average; failures only make it
+// worse, so an endpoint failing fast does not draw the traffic.
+static double EndpointScore(const ChatEndpoint& endpoint, double defaultLatencyMs)
+{
+    double latencyMs = endpoint.latencyMs > 0.0 ? endpoint.latencyMs : defaultLatencyMs;
+    return latencyMs * (endpoint.inFlight + 1) * (1.0 + FAILURE_PENALTY * endpoint.failureRate);
+}
+
+ChatEndpointPtr ChatEndpointRouter::acquire(QueryPriority priority, const ChatEndpoint* avoid, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<size_t> usable;
+    usable.reserve(endpoints.size());
+    for (size_t i = 0; i < endpoints.size(); ++i)
+    {
+        if (endpoints[i]->serves(priority) && isUsable(*endpoints[i], now))
+            usable.push_back(i);
+    }
+    if (usable.size() > 1 && avoid)
+        usable.erase(std::remove_if(usable.begin(), usable.end(), [&](size_t i) { return endpoints[i].get() == avoid; }),
+                     usable.end());
+    if (usable.empty())
+        return nullptr;
+
+    // Two random choices: close to the best pick, without every worker
+    // piling onto the same endpoint between two latency samples.
+    size_t chosen = usable.front();
+    if (usable.size() > 1)
+    {
+        double sampledMs = 0.0;
+        uint32_t sampled = 0;
+        for (size_t i : usable)
+        {
+            if (endpoints[i]->latencyMs > 0.0)
+            {
+                sampledMs += endpoints[i]->latencyMs;
+                ++sampled;
+            }
+        }
+        // Before any sample, only the load and failures tell them apart.
+        double defaultLatencyMs = sampled > 0 ? sampledMs / sampled : 1.0;
+
+        uint32_t first = urand(0, usable.size() - 1);
+        uint32_t second = urand(0, usable.size() - 2);
+        if (second >= first)
+            ++second;
+        chosen = EndpointScore(*endpoints[usable[first]], defaultLatencyMs) <= EndpointScore(*endpoints[usable[second]], defaultLatencyMs)
+                     ? usable[first] : usable[second];
+    }
+
+    ChatEndpoint& endpoint = *endpoints[chosen];
+    ++endpoint.inFlight;
+    if (endpoint.down)
+        endpoint.probing = true;
+    return endpoints[chosen];
+}
+
+bool ChatEndpointRouter::canServe(QueryPriority priority, Clock::time_point now) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const ChatEndpointPtr& endpoint : endpoints)
+    {
+        if (endpoint->serves(priority) && isUsable(*endpoint, now))
+            return true;
+    }
+    return false;
+}
+
+bool ChatEndpointRouter::hasLiveEndpoint(QueryPriority priority, Clock::time_point now) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const ChatEndpointPtr& endpoint : endpoints)
+    {
+        if (endpoint->serves(priority) && (!endpoint->down || (now >= endpoint->downUntil && !endpoint->probing)))
+            return true;
+    }
+    return false;
+}
+
+ChatEndpointRouter::Clock::time_point ChatEndpointRouter::nextChange(Clock::time_point now) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point wakeup = Clock::time_point::max();
+    for (const ChatEndpointPtr& endpoint : endpoints)
+    {
+        if (endpoint->pausedUntil > now)
+            wakeup = std::min(wakeup, endpoint->pausedUntil);
+        if (endpoint->down && endpoint->downUntil > now)
+            wakeup = std::min(wakeup, endpoint->downUntil);
+    }
+    return wakeup;
+}
+
+void ChatEndpointRouter::release(const ChatEndpointPtr& endpoint, Outcome outcome, QueryErrorType failure, uint32_t retryAfter,
+                                 Clock::duration elapsed, Clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ChatEndpoint& e = *endpoint;
+    if (e.inFlight > 0)
+        --e.inFlight;
+    if (outcome == Outcome::Aborted)
+    {
+        // Says nothing about the endpoint, but a probe has to be sent again.
+        e.probing = false;
+        return;
+    }
+
+    if (outcome == Outcome::Success)
+    {
+        ++e.succeeded;
+        e.failureRate -= LATENCY_SMOOTHING * e.failureRate;
+        double ms = std::chrono::duration<double, std::milli>(elapsed).count();
+        e.latencyMs = e.latencyMs == 0.0 ? ms : e.latencyMs + LATENCY_SMOOTHING * (ms - e.latencyMs);
+        e.consecutiveFailures = 0;
+        if (e.down)
+        {
+            e.down = false;
+            e.probing = false;
+            LOG_INFO("server.loading", "[OpenRouter Chat] Endpoint {} answered again, sending queries.", e.name);
+        }
+        return;
+    }
+
+    ++e.failed;
+    e.failureRate += LATENCY_SMOOTHING * (1.0 - e.failureRate);
+    if (failure == QueryErrorType::RateLimited && retryAfter > 0)
+        e.pausedUntil = std::max(e.pausedUntil, now + std::chrono::seconds(std::min(retryAfter, MAX_RETRY_AFTER_SECONDS)));
+
+    if (breakerFailures == 0)
+        return;
+    // A rejected key or an unknown model fails every query just the same.
+    bool outage = failure == QueryErrorType::ServerError || failure == QueryErrorType::Timeout || failure == QueryErrorType::Network ||
+                  failure == QueryErrorType::Auth || failure == QueryErrorType::ClientError;
+    bool probe = e.down && e.probing;
+    if (outage && (probe || ++e.consecutiveFailures >= breakerFailures))
+    {
+        e.down = true;
+        e.probing = false;
+        e.downUntil = now + std::chrono::seconds(breakerOpenSeconds);
+        e.consecutiveFailures = 0;
+        LOG_ERROR("server.loading", "[OpenRouter Chat] Endpoint {} failing ({}), not sending it queries for {} seconds.",
+                  e.name, QueryErrorTypeName(failure), breakerOpenSeconds);
+    }
+    else if (probe)
+    {
+        // It answered, if only with an error.
+        e.down = false;
+        e.probing = false;
+    }
+}
+
+std::vector<std::string> ChatEndpointRouter::describe() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point now = Clock::now();
+    std::vector<std::string> lines;
+    for (const ChatEndpointPtr& endpoint : endpoints)
+    {
+        const ChatEndpoint& e = *endpoint;
+        const char* state = e.down ? (e.probing ? "probing" : "down") : now < e.pausedUntil ? "paused" : "up";
+        lines.push_back(fmt::format("Endpoint {}: {} via {}, {}, {} running, {} ok, {} failed ({:.0f}% lately), avg {:.0f} ms",
+                                    e.name, e.model, e.url, state, e.inFlight, e.succeeded, e.failed, e.failureRate * 100, e.latencyMs));
+    }
+    return lines;
+}
+
+std::vector<std::string> ChatEndpointRouter::getUrls() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> urls;
+    for (const ChatEndpointPtr& endpoint : endpoints)
+        urls.push_back(endpoint->url);
+    return urls;
+}
+
+static bool EqualsIgnoreCase(const std::string& a, const char* b)
+{
+    size_t i = 0;
+    for (; i < a.size() && b[i]; ++i)
+    {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+            return false;
+    }
+    return i == a.size() && !b[i];
+}
+
+bool ParseQueryClassMask(const std::string& value, uint32_t& mask)
+{
+    mask = 0;
+    std::stringstream stream(value);
+    std::string name;
+    while (std::getline(stream, name, ','))
+    {
+        size_t first = name.find_first_not_of(" \t");
+        if (first == std::string::npos)
+            continue;
+        name = name.substr(first, name.find_last_not_of(" \t") - first + 1);
+
+        size_t cls = 0;
+        while (cls < QUERY_PRIORITY_COUNT && !EqualsIgnoreCase(name, QueryPriorityName(static_cast<QueryPriority>(cls))))
+            ++cls;
+        if (cls == QUERY_PRIORITY_COUNT)
+            return false;
+        mask |= 1u << cls;
+    }
+    return true;
+}
@@ -0,0 +1,111 @@
+#ifndef MOD_OLLAMA_CHAT_ROUTER_H
+#define MOD_OLLAMA_CHAT_ROUTER_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "mod-ollama-chat_metrics.h"
+#include "mod-ollama-chat_querymanager.h"
+
+struct curl_slist;
+
+enum class EndpointType : uint8_t {
+    OpenRouter = 0,   // OpenRouter's API: needs an API key, reports usage on request
+    OpenAI,           // any other OpenAI-compatible server, e.g. Ollama or llama.cpp
+};
+
+// One chat completions server and the model asked there. The settings are
+// fixed once the endpoint is configured; the health and load figures below
+// them belong to the router and are only touched under its lock.
+struct ChatEndpoint {
+    std::string name;
+    std::string url;
+    std::string model;
+    std::string apiKey;       // empty sends no Authorization header
+    EndpointType type = EndpointType::OpenRouter;
+    uint32_t classMask = 0;   // bit per QueryPriority served
+    uint32_t maxConcurrent = 0;  // 0 = no limit of its own
+    std::shared_ptr<curl_slist> headers;
+    // Request body around the messages, without and with streaming, and
+    // the JSON-escaped configured system prompt. See PrepareEndpointRequests.
+    std::string requestHead[2];
+    std::string requestTail[2];
+    std::string systemPrompt;
+    bool cacheControl = false;  // system prompt sent as a cache_control block
+
+    bool serves(QueryPriority priority) const { return classMask & (1u << static_cast<uint32_t>(priority)); }
+
+    uint32_t inFlight = 0;
+    double latencyMs = 0.0;   // moving average of successful queries, 0 until the first
+    double failureRate = 0.0; // moving average of failed queries, 0 to 1
+    uint64_t succeeded = 0;
+    uint64_t failed = 0;
+    uint32_t consecutiveFailures = 0;
+    bool down = false;        // circuit open; one probe is let through after downUntil
+    bool probing = false;
+    std::chrono::steady_clock::time_point downUntil;
+    std::chrono::steady_clock::time_point pausedUntil;  // Retry-After of a 429
+};
+
+using ChatEndpointPtr = std::shared_ptr<ChatEndpoint>;
+
+constexpr uint32_t ALL_QUERY_CLASSES = (1u << QUERY_PRIORITY_COUNT) - 1;
+
+// Spreads queries over the configured endpoints. Each query goes to an
+// endpoint serving its priority class; among those that are up and below
+// their own limit, the better of two random picks by average latency times
+// queries in flight, weighed up by the rate of failed queries. An endpoint
+// failing with 5xx, timeouts, network errors or 4xx (a bad key or model) is
+// taken out of rotation for a while, so its queries (and their retries) fail
+// over to the others.
+class ChatEndpointRouter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Replaces the endpoints. Queries running on the old ones finish there.
+    void configure(std::vector<ChatEndpointPtr> endpoints);
+    // After failures consecutive 5xx, timeouts, network errors or 4xx other
+    // than 429, an endpoint gets no queries for openSeconds, then a single
+    // probe decides (0 = off).
+    void setCircuitBreaker(uint32_t failures, uint32_t openSeconds);
+
+    // Takes a slot on an endpoint for a query of the class, preferring one
+    // other than avoid (the endpoint a retried query failed on). Returns null
+    // if none can take it now.
+    ChatEndpointPtr acquire(QueryPriority priority, const ChatEndpoint* avoid, Clock::time_point now);
+    // Whether acquire would find an endpoint for the class.
+    bool canServe(QueryPriority priority, Clock::time_point now) const;
+    // Whether an endpoint of the class is up, or due for a probe, regardless
+    // of pauses and load; retrying is pointless otherwise.
+    bool hasLiveEndpoint(QueryPriority priority, Clock::time_point now) const;
+    // When the next endpoint leaves its pause or becomes due for a probe.
+    Clock::time_point nextChange(Clock::time_point now) const;
+
+    enum class Outcome : uint8_t { Success, Failure, Aborted };
+    // Gives back the slot taken by acquire and records how the query went.
+    void release(const ChatEndpointPtr& endpoint, Outcome outcome, QueryErrorType failure, uint32_t retryAfter,
+                 Clock::duration elapsed, Clock::time_point now);
+
+    // One line per endpoint, for .ollama stats.
+    std::vector<std::string> describe() const;
+    std::vector<std::string> getUrls() const;
+
+private:
+    bool isUsable(const ChatEndpoint& endpoint, Clock::time_point now) const;
+
+    mutable std::mutex mutex_;
+    std::vector<ChatEndpointPtr> endpoints;
+    uint32_t breakerFailures = 0;
+    uint32_t breakerOpenSeconds = 30;
+};
+
+extern ChatEndpointRouter g_ChatEndpointRouter;
+
+// Parses a comma-separated list of priority class names into a class mask.
+// Returns false if a name is unknown.
+bool ParseQueryClassMask(const std::string& value, uint32_t& mask);
+
+#endif // MOD_OLLAMA_CHAT_ROUTER_H
@@ -0,0 +1,242 @@
+#include "mod-ollama-chat_template.h"
+#include "mod-ollama-chat_config.h"
+#include "Log.h"
+#include <cctype>
+
+PromptTemplate g_CompiledChatSystemPrompt;
+PromptTemplate g_CompiledChatPrompt;
+PromptTemplate g_CompiledChatExtraInfo;
+PromptTemplate g_CompiledRandomChatterSystemPrompt;
+PromptTemplate g_CompiledRandomChatterPrompt;
+PromptTemplate g_CompiledChatHistoryHeader;
+PromptTemplate g_CompiledChatHistoryLine;
+PromptTemplate g_CompiledChatHistoryFooter;
+PromptTemplate g_CompiledChatHistorySummary;
+PromptTemplate g_CompiledHistorySummaryPrompt;
+PromptTemplate g_CompiledChatBotSnapshot;
+PromptTemplate g_CompiledBatchPrompt;
+
+std::vector<PromptTemplate> g_CompiledEnvCommentCreature;
+std::vector<PromptTemplate> g_CompiledEnvCommentGameObject;
+std::vector<PromptTemplate> g_CompiledEnvCommentEquippedItem;
+std::vector<PromptTemplate> g_CompiledEnvCommentBagItem;
+std::vector<PromptTemplate> g_CompiledEnvCommentBagItemSell;
+std::vector<PromptTemplate> g_CompiledEnvCommentSpell;
+std::vector<PromptTemplate> g_CompiledEnvCommentQuestArea;
+std::vector<PromptTemplate> g_CompiledEnvCommentVendor;
+std::vector<PromptTemplate> g_CompiledEnvCommentQuestgiver;
+std::vector<PromptTemplate> g_CompiledEnvCommentBagSlots;
+std::vector<PromptTemplate> g_CompiledEnvCommentDungeon;
+std::vector<PromptTemplate> g_CompiledEnvCommentUnfinishedQuest;
+
+bool PromptTemplate::compile(std::string_view text, std::initializer_list<std::string_view> names, const char* option)
+{
+    literals.clear();
+    segments.clear();
+    bool valid = true;
+
+    size_t literalStart = 0;
+    auto addLiteral = [this, &literalStart]() {
+        if (literals.size() > literalStart)
+            segments.push_back({ static_cast<uint32_t>(literalStart), static_cast<uint32_t>(literals.size() - literalStart), -1 });
+        literalStart = literals.size();
+    };
+
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        char c = text[i];
+        if ((c == '{' || c == '}') && i + 1 < text.size() && text[i + 1] == c)
+        {
+            literals += c;
+            ++i;
+            continue;
+        }
+        if (c == '}')
+        {
+            LOG_ERROR("server.loading", "[Ollama Chat] {}: unmatched '}}' at position {}.", option, i);
+            valid = false;
+            literals += c;
+            continue;
+        }
+        if (c != '{')
+        {
+            literals += c;
+            continue;
+        }
+
+        size_t close = text.find('}', i + 1);
+        if (close == std::string_view::npos)
+        {
+            LOG_ERROR("server.loading", "[Ollama Chat] {}: unmatched '{{' at position {}.", option, i);
+            valid = false;
+            literals.append(text.substr(i));
+            break;
+        }
+
+        std::string_view name = text.substr(i + 1, close - i - 1);
+        int32_t slot = -1;
+        int32_t index = 0;
+        for (std::string_view known : names)
+        {
+            if (known == name)
+            {
+                slot = index;
+                break;
+            }
+            ++index;
+        }
+        if (slot < 0)
+        {
+            LOG_ERROR("server.loading", "[Ollama Chat] {}: unknown placeholder '{{{}}}'.", option, name);
+            valid = false;
+        }
+        else
+        {
+            addLiteral();
+            segments.push_back({ 0, 0, slot });
+        }
+        i = close;
+    }
+    addLiteral();
+    return valid;
+}
+
+void PromptTemplate::renderTo(std::string& out, std::initializer_list<std::string_view> values) const
+{
+    const std::string_view* slots = values.begin();
+    size_t size = out.size() + literals.size();
+    for (const Segment& segment : segments)
+    {
+        if (segment.slot >= 0 && static_cast<size_t>(segment.slot) < values.size())
+            size += slots[segment.slot].size();
+    }
+    out.reserve(size);
+
+    for (const Segment& segment : segments)
+    {
+        if (segment.slot < 0)
+            out.append(literals, segment.offset, segment.length);
+        else if (static_cast<size_t>(segment.slot) < values.size())
+            out.append(slots[segment.slot]);
+    }
+}
+
+std::string PromptTemplate::render(std::initializer_list<std::string_view> values) const
+{
+    std::string out;
+    renderTo(out, values);
+    return out;
+}
+
+bool PromptTemplate::usesPlaceholder(size_t index) const
+{
+    for (const Segment& segment : segments)
+    {
+        if (segment.slot == static_cast<int32_t>(index))
+            return true;
+    }
+    return false;
+}
+
+void CompilePromptTemplates()
+{
+    g_CompiledChatSystemPrompt.compile(g_ChatSystemPromptTemplate, { "bot_personality" }, "OllamaChat.ChatSystemPromptTemplate");
+    g_CompiledChatPrompt.compile(g_ChatPromptTemplate, {
+        "bot_name", "bot_level", "bot_class", "bot_personality", "player_level", "player_class",
+        "player_name", "player_message", "extra_info", "chat_history" }, "OllamaChat.ChatPromptTemplate");
+    g_CompiledChatExtraInfo.compile(g_ChatExtraInfoTemplate, {
+        "bot_race", "bot_gender", "bot_role", "bot_faction", "bot_guild", "bot_group_status", "bot_gold",
+        "player_race", "player_gender", "player_role", "player_faction", "player_guild", "player_group_status",
+        "player_gold", "player_distance", "bot_area", "bot_zone", "bot_map" }, "OllamaChat.ChatExtraInfoTemplate");
+    g_CompiledRandomChatterSystemPrompt.compile(g_RandomChatterSystemPromptTemplate, { "bot_personality" },
+        "OllamaChat.RandomChatterSystemPromptTemplate");
+    g_CompiledRandomChatterPrompt.compile(g_RandomChatterPromptTemplate, {
+        "bot_name", "bot_level", "bot_class", "bot_race", "bot_gender", "bot_role", "bot_faction",
+        "bot_area", "bot_zone", "bot_map", "bot_personality", "environment_info" }, "OllamaChat.RandomChatterPromptTemplate");
+    g_CompiledChatHistoryHeader.compile(g_ChatHistoryHeaderTemplate, { "player_name" }, "OllamaChat.ChatHistoryHeaderTemplate");
+    g_CompiledChatHistoryLine.compile(g_ChatHistoryLineTemplate, { "player_name", "player_message", "bot_reply" }, "OllamaChat.ChatHistoryLineTemplate");
+    g_CompiledChatHistoryFooter.compile(g_ChatHistoryFooterTemplate, { "player_name", "player_message" }, "OllamaChat.ChatHistoryFooterTemplate");
+    g_CompiledChatHistorySummary.compile(g_ChatHistorySummaryTemplate, { "player_name", "summary" }, "OllamaChat.ChatHistorySummaryTemplate");
+    g_CompiledHistorySummaryPrompt.compile(g_HistorySummaryPromptTemplate, {
+        "player_name", "summary", "conversation" }, "OllamaChat.HistorySummaryPromptTemplate");
+    g_CompiledChatBotSnapshot.compile(g_ChatBotSnapshotTemplate, {
+        "combat", "group", "spells", "quests", "los", "players" }, "OllamaChat.ChatBotSnapshotTemplate");
+    g_CompiledBatchPrompt.compile(g_BatchPromptTemplate, {
+        "bot_count", "bot_names", "player_name", "player_message", "bot_prompts" }, "OllamaChat.BatchPromptTemplate");
+}
+
+static std::vector<PromptTemplate> CompileEnvComments(const std::vector<std::string>& lines,
+                                                     std::initializer_list<std::string_view> names, const char* option)
+{
+    std::vector<PromptTemplate> compiled;
+    compiled.reserve(lines.size());
+    for (const std::string& line : lines)
+    {
+        PromptTemplate comment;
+        if (comment.compile(line, names, option))
+            compiled.push_back(std::move(comment));
+        else
+            LOG_ERROR("server.loading", "[Ollama Chat] {}: dropped the comment \"{}\".", option, line);
+    }
+    return compiled;
+}
+
+void CompileEnvCommentTemplates()
+{
+    g_CompiledEnvCommentCreature = CompileEnvComments(g_EnvCommentCreature, { "creature_name" }, "OllamaChat.EnvCommentCreature");
+    g_CompiledEnvCommentGameObject = CompileEnvComments(g_EnvCommentGameObject, { "object_name" }, "OllamaChat.EnvCommentGameObject");
+    g_CompiledEnvCommentEquippedItem = CompileEnvComments(g_EnvCommentEquippedItem, { "item_name" }, "OllamaChat.EnvCommentEquippedItem");
+    g_CompiledEnvCommentBagItem = CompileEnvComments(g_EnvCommentBagItem, { "item_count", "item_description" }, "OllamaChat.EnvCommentBagItem");
+    g_CompiledEnvCommentBagItemSell = CompileEnvComments(g_EnvCommentBagItemSell, { "item_count", "item_description" },
+        "OllamaChat.EnvCommentBagItemSell");
+    g_CompiledEnvCommentSpell = CompileEnvComments(g_EnvCommentSpell, { "spell_name", "spell_effect", "spell_cost" },
+        "OllamaChat.EnvCommentSpell");
+    g_CompiledEnvCommentQuestArea = CompileEnvComments(g_EnvCommentQuestArea, { "quest_area" }, "OllamaChat.EnvCommentQuestArea");
+    g_CompiledEnvCommentVendor = CompileEnvComments(g_EnvCommentVendor, { "vendor_name" }, "OllamaChat.EnvCommentVendor");
+    g_CompiledEnvCommentQuestgiver = CompileEnvComments(g_EnvCommentQuestgiver, { "questgiver_name", "quest_count" },
+        "OllamaChat.EnvCommentQuestgiver");
+    g_CompiledEnvCommentBagSlots = CompileEnvComments(g_EnvCommentBagSlots, { "bag_slots" }, "OllamaChat.EnvCommentBagSlots");
+    g_CompiledEnvCommentDungeon = CompileEnvComments(g_EnvCommentDungeon, { "dungeon_name" }, "OllamaChat.EnvCommentDungeon");
+    g_CompiledEnvCommentUnfinishedQuest = CompileEnvComments(g_EnvCommentUnfinishedQuest, { "quest_name" },
+        "OllamaChat.EnvCommentUnfinishedQuest");
+}
+
+// BPE vocabularies cover common English words in one or two tokens of about
+// five letters, split numbers into groups of up to three digits and give most
+// punctuation marks and non-ASCII characters a token of their own. Spaces
+// are part of the token that follows them.
+size_t EstimatePromptTokens(std::string_view text)
+{
+    size_t tokens = 0;
+    size_t i = 0;
+    while (i < text.size())
+    {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        size_t start = i;
+        if (std::isalpha(c))
+        {
+            while (i < text.size() && std::isalpha(static_cast<unsigned char>(text[i])))
+                ++i;
+            tokens += (i - start + 4) / 5;
+        }
+        else if (std::isdigit(c))
+        {
+            while (i < text.size() && std::isdigit(static_cast<unsigned char>(text[i])))
+                ++i;
+            tokens += (i - start + 2) / 3;
+        }
+        else if (c == ' ')
+        {
+            ++i;
+        }
+        else
+        {
+            // One token per character; UTF-8 continuation bytes belong to it.
+            ++i;
+            while (i < text.size() && (static_cast<unsigned char>(text[i]) & 0xC0) == 0x80)
+                ++i;
+            ++tokens;
+        }
+    }
+    return tokens;
+}
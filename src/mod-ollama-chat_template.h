@@ -0,0 +1,79 @@
+#ifndef MOD_OLLAMA_CHAT_TEMPLATE_H
+#define MOD_OLLAMA_CHAT_TEMPLATE_H
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A prompt template parsed once into literal text and placeholder slots.
+// Placeholders are written {name}; {{ and }} stand for literal braces, as in
+// fmt. Rendering copies the pieces into one buffer without any name lookup.
+class PromptTemplate {
+public:
+    // Parses text, mapping each placeholder to its index in names. Unknown
+    // placeholders (rendered as nothing) and unmatched braces (kept as text)
+    // are logged against option. Returns false if anything was logged.
+    bool compile(std::string_view text, std::initializer_list<std::string_view> names, const char* option);
+
+    // Appends the template to out, with values in the order of the names
+    // given to compile().
+    void renderTo(std::string& out, std::initializer_list<std::string_view> values) const;
+    std::string render(std::initializer_list<std::string_view> values) const;
+
+    bool usesPlaceholder(size_t index) const;
+
+private:
+    struct Segment {
+        uint32_t offset;  // into literals, when slot < 0
+        uint32_t length;
+        int32_t slot;     // placeholder index, or -1 for literal text
+    };
+
+    std::string literals;
+    std::vector<Segment> segments;
+};
+
+// Compiled forms of the prompt templates from the configuration.
+// The comment by each lists its placeholders in the order render() takes them.
+extern PromptTemplate g_CompiledChatSystemPrompt;     // bot_personality
+extern PromptTemplate g_CompiledChatPrompt;           // bot_name bot_level bot_class bot_personality player_level player_class player_name player_message extra_info chat_history
+extern PromptTemplate g_CompiledChatExtraInfo;        // bot_race bot_gender bot_role bot_faction bot_guild bot_group_status bot_gold player_race player_gender player_role player_faction player_guild player_group_status player_gold player_distance bot_area bot_zone bot_map
+extern PromptTemplate g_CompiledRandomChatterSystemPrompt; // bot_personality
+extern PromptTemplate g_CompiledRandomChatterPrompt;  // bot_name bot_level bot_class bot_race bot_gender bot_role bot_faction bot_area bot_zone bot_map bot_personality environment_info
+extern PromptTemplate g_CompiledChatHistoryHeader;    // player_name
+extern PromptTemplate g_CompiledChatHistoryLine;      // player_name player_message bot_reply
+extern PromptTemplate g_CompiledChatHistoryFooter;    // player_name player_message
+extern PromptTemplate g_CompiledChatHistorySummary;   // player_name summary
+extern PromptTemplate g_CompiledHistorySummaryPrompt; // player_name summary conversation
+extern PromptTemplate g_CompiledChatBotSnapshot;      // combat group spells quests los players
+extern PromptTemplate g_CompiledBatchPrompt;          // bot_count bot_names player_name player_message bot_prompts
+
+// Compiled environment comments (OllamaChat.EnvComment*), one per valid line.
+extern std::vector<PromptTemplate> g_CompiledEnvCommentCreature;        // creature_name
+extern std::vector<PromptTemplate> g_CompiledEnvCommentGameObject;      // object_name
+extern std::vector<PromptTemplate> g_CompiledEnvCommentEquippedItem;    // item_name
+extern std::vector<PromptTemplate> g_CompiledEnvCommentBagItem;         // item_count item_description
+extern std::vector<PromptTemplate> g_CompiledEnvCommentBagItemSell;     // item_count item_description
+extern std::vector<PromptTemplate> g_CompiledEnvCommentSpell;           // spell_name spell_effect spell_cost
+extern std::vector<PromptTemplate> g_CompiledEnvCommentQuestArea;       // quest_area
+extern std::vector<PromptTemplate> g_CompiledEnvCommentVendor;          // vendor_name
+extern std::vector<PromptTemplate> g_CompiledEnvCommentQuestgiver;      // questgiver_name quest_count
+extern std::vector<PromptTemplate> g_CompiledEnvCommentBagSlots;        // bag_slots
+extern std::vector<PromptTemplate> g_CompiledEnvCommentDungeon;         // dungeon_name
+extern std::vector<PromptTemplate> g_CompiledEnvCommentUnfinishedQuest; // quest_name
+
+// Index of {chat_history} in g_CompiledChatPrompt.
+constexpr size_t CHAT_PROMPT_CHAT_HISTORY = 9;
+
+// Parses the prompt templates of the current configuration.
+void CompilePromptTemplates();
+// Parses the environment comment lists; a line with an error is logged and dropped.
+void CompileEnvCommentTemplates();
+
+// Rough number of tokens the model's tokenizer makes of text. Good enough to
+// keep a prompt within a budget, not to bill by.
+size_t EstimatePromptTokens(std::string_view text);
+
+#endif // MOD_OLLAMA_CHAT_TEMPLATE_H